@@ -0,0 +1,572 @@
+#define _DEFAULT_SOURCE // dlopen
+
+#include "aot.h"
+
+#include "chunk.h"
+#include "debug.h"
+#include "function.h"
+#include "op.h"
+#include "value.h"
+#include "vm.h"
+
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* valueTypeNames[] = {
+    [VALUE_NONE] = "VALUE_NONE",
+    [VALUE_NUMBER] = "VALUE_NUMBER",
+    [VALUE_BOOL] = "VALUE_BOOL",
+    [VALUE_FUNCTION] = "VALUE_FUNCTION",
+    [VALUE_UNDECLARED] = "VALUE_UNDECLARED",
+};
+
+// the chunks of a translation are numbered with the script's first, followed
+// by the functions it creates
+struct Translation {
+  struct Chunk* script;
+  struct FunctionList functions;
+  size_t length;
+};
+
+static struct Function* functionAt(struct Translation* t, size_t index) {
+  return t->functions.functions[index - 1];
+}
+
+static struct Chunk* chunkAt(struct Translation* t, size_t index) {
+  return index == 0 ? t->script : &functionAt(t, index)->chunk;
+}
+
+static size_t functionIndex(struct Translation* t, struct Function* function) {
+  return functionListIndex(&t->functions, function) + 1;
+}
+
+// exact, hex floats keep every bit
+static void emitNumber(FILE* out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "NAN");
+  } else if (isinf(number)) {
+    fprintf(out, number > 0 ? "HUGE_VAL" : "-HUGE_VAL");
+  } else {
+    fprintf(out, "%a", number);
+  }
+}
+
+// numbers, bools and none, functions only exist once the unit is loaded
+static void emitValue(FILE* out, struct Value value) {
+  if (IS_NUMBER(value)) {
+    fprintf(out, "NUMBER_VALUE(");
+    emitNumber(out, AS_NUMBER(value));
+    fprintf(out, ")");
+  } else if (IS_BOOL(value)) {
+    fprintf(out, "BOOL_VALUE(%s)", AS_BOOL(value) ? "true" : "false");
+  } else {
+    fprintf(out, "NONE_VALUE");
+  }
+}
+
+static void emitString(FILE* out, struct String string) {
+  fputc('"', out);
+  for (size_t i = 0; i < string.length; i++) {
+    unsigned char c = string.str[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static size_t operand(const uint8_t* code, bool wide) {
+  return wide ? (size_t)code[1] | (size_t)code[2] << 8 | (size_t)code[3] << 16
+              : code[1];
+}
+
+static const char* binaryOperator(enum OpCode op) {
+  switch (op) {
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+      return "+";
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM_NUM:
+      return "-";
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM_NUM:
+      return "*";
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM_NUM:
+      return "/";
+    case OP_GREATER:
+    case OP_GREATER_NUM_NUM:
+      return ">";
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM_NUM:
+      return ">=";
+    case OP_LESSER:
+    case OP_LESSER_NUM_NUM:
+      return "<";
+    case OP_LESSER_EQUAL:
+    case OP_LESSER_EQUAL_NUM_NUM:
+      return "<=";
+    case OP_EQUAL:
+    case OP_EQUAL_NUM_NUM:
+      return "==";
+    case OP_NOT_EQUAL:
+    case OP_NOT_EQUAL_NUM_NUM:
+      return "!=";
+    default:
+      return NULL;
+  }
+}
+
+// emits the C for the instruction at offset. like the jit it only handles the
+// types the instruction expects and leaves everything else, including every
+// error, to the interpreter by exiting before touching the stack
+static void emitInstruction(FILE* out, struct Chunk* chunk, size_t offset) {
+  const uint8_t* code = &chunk->code[offset];
+  struct Value* constants = chunk->values.values;
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      struct Value value = constants[operand(code, code[0] != OP_CONSTANT)];
+      if (IS_FUNCTION(value))
+        break;
+
+      fprintf(out, "  *sp++ = ");
+      emitValue(out, value);
+      fprintf(out, ";\n");
+      return;
+    }
+    case OP_POP:
+      fprintf(out, "  sp--;\n");
+      return;
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+      fprintf(out,
+              "  if (!IS_NUMBER(sp[-1]))\n"
+              "    EXIT(%zu);\n"
+              "  sp[-1] = NUMBER_VALUE(-AS_NUMBER(sp[-1]));\n",
+              offset);
+      return;
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM_NUM:
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM_NUM:
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM_NUM:
+    case OP_GREATER:
+    case OP_GREATER_NUM_NUM:
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM_NUM:
+    case OP_LESSER:
+    case OP_LESSER_NUM_NUM:
+    case OP_LESSER_EQUAL:
+    case OP_LESSER_EQUAL_NUM_NUM: {
+      const char* symbol = binaryOperator(code[0]);
+      bool divide = strcmp(symbol, "/") == 0;
+      bool arithmetic = strchr("+-*/", symbol[0]) != NULL;
+
+      fprintf(out, "  if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])%s)\n",
+              divide ? " || AS_NUMBER(sp[-1]) == 0." : "");
+      fprintf(out, "    EXIT(%zu);\n", offset);
+      fprintf(out, "  sp--;\n");
+      fprintf(out, "  sp[-1] = %s(AS_NUMBER(sp[-1]) %s AS_NUMBER(sp[0]));\n",
+              arithmetic ? "NUMBER_VALUE" : "BOOL_VALUE", symbol);
+      return;
+    }
+    case OP_EQUAL:
+    case OP_EQUAL_NUM_NUM:
+    case OP_NOT_EQUAL:
+    case OP_NOT_EQUAL_NUM_NUM: {
+      const char* symbol = binaryOperator(code[0]);
+      fprintf(out,
+              "  if (IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1]))\n"
+              "    sp[-2] = BOOL_VALUE(AS_NUMBER(sp[-2]) %s "
+              "AS_NUMBER(sp[-1]));\n"
+              "  else if (IS_BOOL(sp[-2]) && IS_BOOL(sp[-1]))\n"
+              "    sp[-2] = BOOL_VALUE(AS_BOOL(sp[-2]) %s AS_BOOL(sp[-1]));\n"
+              "  else\n"
+              "    EXIT(%zu);\n"
+              "  sp--;\n",
+              symbol, symbol, offset);
+      return;
+    }
+    case OP_NOT:
+      fprintf(out,
+              "  if (!IS_BOOL(sp[-1]))\n"
+              "    EXIT(%zu);\n"
+              "  sp[-1] = BOOL_VALUE(!AS_BOOL(sp[-1]));\n",
+              offset);
+      return;
+    case OP_AND:
+    case OP_OR:
+      fprintf(out,
+              "  if (!IS_BOOL(sp[-2]) || !IS_BOOL(sp[-1]))\n"
+              "    EXIT(%zu);\n"
+              "  sp--;\n"
+              "  sp[-1] = BOOL_VALUE(AS_BOOL(sp[-1]) %s AS_BOOL(sp[0]));\n",
+              offset, code[0] == OP_AND ? "&&" : "||");
+      return;
+    case OP_READ:
+    case OP_READ_LONG: {
+      size_t slot = operand(code, code[0] == OP_READ_LONG);
+      fprintf(out,
+              "  if (IS_UNDECLARED(globals[%zu]))\n"
+              "    EXIT(%zu);\n"
+              "  *sp++ = globals[%zu];\n",
+              slot, offset, slot);
+      return;
+    }
+    case OP_ASSIGN:
+    case OP_ASSIGN_LONG: {
+      size_t slot = operand(code, code[0] == OP_ASSIGN_LONG);
+      fprintf(out,
+              "  if (IS_UNDECLARED(globals[%zu]) ||\n"
+              "      VALUE_TYPE(globals[%zu]) != VALUE_TYPE(sp[-1]))\n"
+              "    EXIT(%zu);\n"
+              "  globals[%zu] = *--sp;\n",
+              slot, slot, offset, slot);
+      return;
+    }
+    case OP_DECLARE:
+    case OP_DECLARE_LONG: {
+      bool wide = code[0] == OP_DECLARE_LONG;
+      size_t slot = operand(code, wide);
+      enum ValueType type = code[wide ? 4 : 2];
+
+      fprintf(out, "  if (!IS_UNDECLARED(globals[%zu])", slot);
+      if (type != VALUE_NONE) {
+        fprintf(out, " || VALUE_TYPE(sp[-1]) != %s", valueTypeNames[type]);
+      }
+      fprintf(out,
+              ")\n"
+              "    EXIT(%zu);\n"
+              "  globals[%zu] = *--sp;\n",
+              offset, slot);
+      return;
+    }
+    case OP_CONST_DECLARE: {
+      struct Value value = constants[code[1]];
+      enum ValueType type = code[3];
+
+      // a constant of the wrong type always fails
+      if (type != VALUE_NONE && VALUE_TYPE(value) != type)
+        break;
+      if (IS_FUNCTION(value))
+        break;
+
+      fprintf(out,
+              "  if (!IS_UNDECLARED(globals[%d]))\n"
+              "    EXIT(%zu);\n"
+              "  globals[%d] = ",
+              code[2], offset, code[2]);
+      emitValue(out, value);
+      fprintf(out, ";\n");
+      return;
+    }
+    case OP_READ_CONST_ADD: {
+      struct Value constant = constants[code[2]];
+      if (!IS_NUMBER(constant))
+        break;
+
+      // undeclared globals are not numbers either
+      fprintf(out,
+              "  if (!IS_NUMBER(globals[%d]))\n"
+              "    EXIT(%zu);\n"
+              "  *sp++ = NUMBER_VALUE(AS_NUMBER(globals[%d]) + ",
+              code[1], offset, code[1]);
+      emitNumber(out, AS_NUMBER(constant));
+      fprintf(out, ");\n");
+      return;
+    }
+    case OP_STORE_TEMP:
+      fprintf(out, "  vm->temps[%d] = sp[-1];\n", code[1]);
+      return;
+    case OP_LOAD_TEMP:
+      fprintf(out, "  *sp++ = vm->temps[%d];\n", code[1]);
+      return;
+    case OP_GET_LOCAL:
+      fprintf(out, "  *sp++ = slots[%d];\n", code[1]);
+      return;
+    case OP_SET_LOCAL_CHECKED:
+      fprintf(out,
+              "  if (VALUE_TYPE(sp[-1]) != VALUE_TYPE(slots[%d]))\n"
+              "    EXIT(%zu);\n",
+              code[1], offset);
+      // fallthrough
+    case OP_SET_LOCAL:
+      fprintf(out, "  slots[%d] = *--sp;\n", code[1]);
+      return;
+    case OP_POP_LOCALS:
+      fprintf(out, "  sp -= %d;\n", code[1]);
+      return;
+    case OP_CHECK_TYPE:
+      fprintf(out,
+              "  if (VALUE_TYPE(sp[-1]) != %s)\n"
+              "    EXIT(%zu);\n",
+              valueTypeNames[code[1]], offset);
+      return;
+    case OP_JUMP:
+      fprintf(out, "  goto at%zu;\n", jumpTarget(chunk->code, offset));
+      return;
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE:
+      fprintf(out,
+              "  if (!IS_BOOL(sp[-1]))\n"
+              "    EXIT(%zu);\n"
+              "  if (%sAS_BOOL(*--sp))\n"
+              "    goto at%zu;\n",
+              offset, code[0] == OP_JUMP_IF_FALSE ? "!" : "",
+              jumpTarget(chunk->code, offset));
+      return;
+    case OP_SHORT_AND:
+    case OP_SHORT_OR:
+      // the left operand stays for the operator after the right one
+      fprintf(out,
+              "  if (!IS_BOOL(sp[-1]))\n"
+              "    EXIT(%zu);\n"
+              "  if (%sAS_BOOL(sp[-1]))\n"
+              "    goto at%zu;\n",
+              offset, code[0] == OP_SHORT_AND ? "!" : "",
+              jumpTarget(chunk->code, offset));
+      return;
+  }
+
+  // printing, calls and returns are always left to the interpreter
+  fprintf(out, "  EXIT(%zu);\n", offset);
+}
+
+static void emitChunk(FILE* out, struct Translation* t, size_t index) {
+  struct Chunk* chunk = chunkAt(t, index);
+
+  // a straight line of code that can be entered at every instruction
+  fprintf(out,
+          "static size_t run%zu(size_t offset, struct VM* vm, "
+          "struct Value** out,\n"
+          "                   struct Value* slots) {\n"
+          "  struct Value* sp = *out;\n"
+          "  struct Value* globals = vm->globals;\n"
+          "  (void)slots;\n"
+          "  (void)globals;\n"
+          "\n"
+          "  switch (offset) {\n",
+          index);
+  for (size_t offset = 0; offset < chunk->length;
+       offset += instructionLength(&chunk->code[offset])) {
+    fprintf(out, "  case %zu:\n    goto at%zu;\n", offset, offset);
+  }
+  fprintf(out,
+          "  default:\n"
+          "    EXIT(offset);\n"
+          "  }\n");
+
+  for (size_t offset = 0; offset < chunk->length;
+       offset += instructionLength(&chunk->code[offset])) {
+    fprintf(out, "\nat%zu: // %s\n", offset,
+            opCodeString(chunk->code[offset]));
+    emitInstruction(out, chunk, offset);
+  }
+
+  // chunks end in a return, which the interpreter runs
+  fprintf(out, "\n  EXIT(%zu);\n}\n\n", chunk->length);
+
+  fprintf(out, "static const uint8_t code%zu[] = {", index);
+  for (size_t i = 0; i < chunk->length; i++) {
+    fprintf(out, i % 12 == 0 ? "\n    %d," : " %d,", chunk->code[i]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  if (chunk->values.length > 0) {
+    fprintf(out, "static const struct AotConstant constants%zu[] = {\n",
+            index);
+    for (size_t i = 0; i < chunk->values.length; i++) {
+      struct Value value = chunk->values.values[i];
+      fprintf(out, "    {%s, ", valueTypeNames[VALUE_TYPE(value)]);
+      emitNumber(out, IS_NUMBER(value) ? AS_NUMBER(value) : 0);
+      fprintf(out, ", %s, %zu},\n",
+              IS_BOOL(value) && AS_BOOL(value) ? "true" : "false",
+              IS_FUNCTION(value) ? functionIndex(t, AS_FUNCTION(value)) : 0);
+    }
+    fprintf(out, "};\n\n");
+  }
+
+  if (chunk->strings.length > 0) {
+    fprintf(out, "static const char* const strings%zu[] = {\n", index);
+    for (size_t i = 0; i < chunk->strings.length; i++) {
+      fprintf(out, "    ");
+      emitString(out, chunk->strings.strings[i]);
+      fprintf(out, ",\n");
+    }
+    fprintf(out, "};\n\n");
+  }
+}
+
+void emitC(FILE* out, struct Chunk* chunk) {
+  struct Translation t = {.script = chunk};
+  findFunctions(chunk, &t.functions);
+  t.length = t.functions.length + 1;
+
+  fprintf(out,
+          "// translated by toy --emit-c, build as a shared object with the "
+          "options toy\n"
+          "// was built with\n"
+          "#include \"aot.h\"\n"
+          "#include \"vm.h\"\n"
+          "\n"
+          "#include <math.h>\n"
+          "\n"
+          "// leaves the instruction at offset to the interpreter\n"
+          "#define EXIT(offset) return (*out = sp, (offset))\n"
+          "\n");
+
+  for (size_t i = 0; i < t.length; i++) {
+    emitChunk(out, &t, i);
+  }
+
+  fprintf(out, "static const struct AotChunk chunks[] = {\n");
+  for (size_t i = 0; i < t.length; i++) {
+    struct Chunk* translated = chunkAt(&t, i);
+    struct String name = i == 0 ? (struct String){.str = "", .length = 0}
+                                : functionAt(&t, i)->name;
+
+    fprintf(out, "    {");
+    emitString(out, name);
+    fprintf(out, ", %zu, code%zu, %zu, ", i == 0 ? 0 : functionAt(&t, i)->arity,
+            i, translated->length);
+    if (translated->values.length > 0) {
+      fprintf(out, "constants%zu, %zu, ", i, translated->values.length);
+    } else {
+      fprintf(out, "NULL, 0, ");
+    }
+    if (translated->strings.length > 0) {
+      fprintf(out, "strings%zu, %zu, ", i, translated->strings.length);
+    } else {
+      fprintf(out, "NULL, 0, ");
+    }
+    fprintf(out, "run%zu},\n", i);
+  }
+  fprintf(out,
+          "};\n"
+          "\n"
+          "const struct AotUnit toyUnit = {\n"
+          "    %d,\n"
+          "    sizeof(struct Value),\n"
+          "    sizeof(struct VM),\n"
+          "    chunks,\n"
+          "    %zu,\n"
+          "};\n",
+          AOT_VERSION, t.length);
+
+  freeFunctionList(&t.functions);
+}
+
+static void loadChunk(struct Chunk* chunk, const struct AotChunk* loaded,
+                      struct Function** functions) {
+  for (size_t i = 0; i < loaded->length; i++) {
+    writeChunk(chunk, loaded->code[i]);
+  }
+
+  // the pools were deduplicated when compiling, so every entry lands at the
+  // index the code uses
+  for (size_t i = 0; i < loaded->constantsLength; i++) {
+    const struct AotConstant* constant = &loaded->constants[i];
+    switch (constant->type) {
+      case VALUE_NUMBER:
+        addConstant(chunk, NUMBER_VALUE(constant->number));
+        break;
+      case VALUE_BOOL:
+        addConstant(chunk, BOOL_VALUE(constant->_bool));
+        break;
+      case VALUE_FUNCTION:
+        addConstant(chunk, FUNCTION_VALUE(functions[constant->function]));
+        break;
+      case VALUE_NONE:
+      case VALUE_UNDECLARED:
+        addConstant(chunk, NONE_VALUE);
+    }
+  }
+
+  // the strings stay owned by the shared object
+  for (size_t i = 0; i < loaded->stringsLength; i++) {
+    const char* string = loaded->strings[i];
+    addString(chunk, (struct String){.str = string, .length = strlen(string)});
+  }
+
+  chunk->native = loaded->native;
+
+  // the object carries the code, not how deep its stack gets
+  findMaxStack(chunk, loaded->arity);
+}
+
+bool loadNativeUnit(const char* path, struct NativeUnit* unit) {
+  // dlopen searches the library path for names without a slash
+  char relative[4096];
+  if (strchr(path, '/') == NULL) {
+    snprintf(relative, sizeof(relative), "./%s", path);
+    path = relative;
+  }
+
+  void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    printf("could not load %s: %s\n", path, dlerror());
+    return false;
+  }
+
+  const struct AotUnit* loaded = dlsym(handle, "toyUnit");
+  if (loaded == NULL) {
+    printf("%s was not translated by toy --emit-c\n", path);
+    dlclose(handle);
+    return false;
+  }
+
+  if (loaded->version != AOT_VERSION ||
+      loaded->valueSize != sizeof(struct Value) ||
+      loaded->vmSize != sizeof(struct VM)) {
+    printf("%s was built for another version or build of toy\n", path);
+    dlclose(handle);
+    return false;
+  }
+
+  unit->handle = handle;
+  unit->chunk = malloc(sizeof(struct Chunk));
+  initChunk(unit->chunk);
+
+  // all functions exist before any constant refers to one
+  unit->functionsLength = loaded->chunksLength;
+  unit->functions = malloc(loaded->chunksLength * sizeof(struct Function*));
+  unit->functions[0] = NULL;
+  for (size_t i = 1; i < loaded->chunksLength; i++) {
+    const char* name = loaded->chunks[i].name;
+    unit->functions[i] =
+        newFunction(&mallocAllocator,
+                    (struct String){.str = name, .length = strlen(name)},
+                    loaded->chunks[i].arity);
+  }
+
+  for (size_t i = 0; i < loaded->chunksLength; i++) {
+    loadChunk(i == 0 ? unit->chunk : &unit->functions[i]->chunk,
+              &loaded->chunks[i], unit->functions);
+  }
+
+  return true;
+}
+
+void unloadNativeUnit(struct NativeUnit* unit) {
+  for (size_t i = 1; i < unit->functionsLength; i++) {
+    freeFunction(unit->functions[i]);
+  }
+  free(unit->functions);
+
+  deinitChunk(unit->chunk);
+  free(unit->chunk);
+
+  dlclose(unit->handle);
+}
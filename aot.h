@@ -0,0 +1,73 @@
+#pragma once
+
+#include "value.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct Chunk;
+struct Function;
+struct VM;
+
+// scripts can be translated to C with toy --emit-c, built into a shared object
+// with the same options as toy and run by passing the object to toy:
+//   toy --emit-c script.toy > script.c
+//   cc -shared -fPIC -O2 -I path/to/toy -o script.so script.c
+//   toy ./script.so
+
+// the translated code of a chunk, same contract as runJit: runs from the
+// instruction at offset until one that the interpreter has to run and returns
+// its offset
+typedef size_t (*NativeChunk)(size_t offset, struct VM* vm, struct Value** sp,
+                              struct Value* slots);
+
+// bumped whenever the structs below or the bytecode change
+#define AOT_VERSION 2
+
+struct AotConstant {
+  enum ValueType type;
+  double number;
+  bool _bool;
+  size_t function; // index of its chunk in the unit
+};
+
+struct AotChunk {
+  const char* name; // functions only, empty if anonymous
+  size_t arity;
+
+  const uint8_t* code;
+  size_t length;
+  const struct AotConstant* constants;
+  size_t constantsLength;
+  const char* const* strings;
+  size_t stringsLength;
+
+  NativeChunk native;
+};
+
+// exported by the shared object as toyUnit
+struct AotUnit {
+  unsigned version;
+  // layout the code was built for, differs with NAN_BOXING
+  size_t valueSize, vmSize;
+
+  const struct AotChunk* chunks; // the script's chunk first
+  size_t chunksLength;
+};
+
+// writes the chunk and every function it creates as C
+void emitC(FILE* out, struct Chunk* chunk);
+
+// a unit loaded back into the chunks and functions the vm runs
+struct NativeUnit {
+  void* handle;
+  struct Chunk* chunk; // the script's
+  struct Function** functions;
+  size_t functionsLength;
+};
+
+// false after printing why if the object cannot be run by this build
+bool loadNativeUnit(const char* path, struct NativeUnit* unit);
+void unloadNativeUnit(struct NativeUnit* unit);
@@ -0,0 +1,99 @@
+// compiles and runs a script many times over, each run on fresh globals and a
+// fresh VM like separate executions would be, once with everything from
+// malloc and once from a pool that is reset after every run instead of
+// freeing what the run allocated
+#define _POSIX_C_SOURCE 199309L
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "source.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// compiles and runs the source once, freeing everything unless the pool
+// takes it all back at once
+static bool execute(struct Source* source, unsigned passes,
+                    struct Allocator* allocator, struct Pool* pool) {
+  struct GlobalNames globals;
+  initGlobalNames(&globals, allocator);
+
+  struct Chunk chunk =
+      compileString(source->string, source->length, false, &globals, passes);
+
+  struct VM vm;
+  initVM(&vm, allocator);
+  bool ok = chunk.code != NULL && runVM(&vm, &chunk) == RUN_OK;
+
+  if (pool != NULL) {
+    resetPool(pool); // nothing ran in the jit, so nothing else is owned
+  } else {
+    deinitVM(&vm);
+    deinitChunk(&chunk);
+    deinitGlobalNames(&globals);
+  }
+
+  return ok;
+}
+
+static bool measure(const char* name, struct Source* source, unsigned passes,
+                    long runs, struct Pool* pool) {
+  struct Allocator* allocator =
+      pool != NULL ? &pool->allocator : &mallocAllocator;
+
+  double start = now();
+  for (long i = 0; i < runs; i++) {
+    if (!execute(source, passes, allocator, pool))
+      return false;
+  }
+  double elapsed = now() - start;
+
+  printf("%-8s %ld runs in %.3fs: %.1f us/run\n", name, runs, elapsed,
+         elapsed / runs * 1e6);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3 && argc != 4) {
+    puts("usage: allocbench FILE RUNS [PASSES]");
+    return 1;
+  }
+
+  struct Source source;
+  if (!openSource(argv[1], &source)) {
+    return 1;
+  }
+
+  long runs = strtol(argv[2], NULL, 10);
+
+  unsigned passes = optLevelPasses(DEFAULT_OPT_LEVEL);
+  if (argc == 4 && !parsePasses(argv[3], &passes)) {
+    printf("unknown pass in '%s'\n", argv[3]);
+    return 1;
+  }
+
+  struct Pool pool;
+  initPool(&pool);
+
+  bool ok = measure("malloc", &source, passes, runs, NULL) &&
+            measure("pool", &source, passes, runs, &pool);
+  closeSource(&source);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("peak memory %ld KiB\n", usage.ru_maxrss);
+
+  freePool(&pool);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+# generates an arithmetic heavy straight-line script: ./bench/arith.sh LINES
+# (small by default, vmbench repeats it)
+lines=${1:-48}
+
+echo "let x = 1"
+echo "let y = 2"
+echo "let c = true"
+i=0
+while [ $i -lt "$lines" ]; do
+  echo "x = (x * 3 + y - 1) / 4"
+  echo "y = -y + x / 2 - 3"
+  echo "c = !(y < x and x >= 1 == c) or y != 2"
+  i=$((i + 3))
+done
@@ -0,0 +1,10 @@
+#!/bin/sh
+# generates variable free expressions made of unary and binary operators, to
+# measure stack traffic: ./bench/binop.sh LINES
+lines=${1:-16}
+
+i=0
+while [ $i -lt "$lines" ]; do
+  echo "-(3 * 4 + 1) / 2 - 5 * (6 - 7 / 8) < 9 == !(2 >= 1) and 1 != 2 or false"
+  i=$((i + 1))
+done
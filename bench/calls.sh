@@ -0,0 +1,48 @@
+#!/bin/sh
+# measures call overhead: a loop calling a small function, the same loop with
+# the body inlined, or a tail recursive counter. with RUNS it runs the script
+# with ./vmbench and reports calls per second:
+# ./bench/calls.sh call|inline|tail CALLS [RUNS]
+shape=${1:-call}
+calls=${2:-100000}
+runs=$3
+
+generate() {
+  echo "let i = 0"
+  echo "let x = 0"
+
+  case "$shape" in
+    call)
+      echo "fn add(a, b) { let c = a + b; return c }"
+      echo "while i < $calls {"
+      echo "  x = add(x, i)"
+      echo "  i = i + 1"
+      echo "}"
+      ;;
+    inline)
+      echo "while i < $calls {"
+      echo "  x = x + i"
+      echo "  i = i + 1"
+      echo "}"
+      ;;
+    tail)
+      echo "fn count(n, acc) {"
+      echo "  if n == 0 { return acc }"
+      echo "  return count(n - 1, acc + n)"
+      echo "}"
+      echo "x = count($calls, 0)"
+      ;;
+  esac
+}
+
+if [ -z "$runs" ]; then
+  generate
+  exit
+fi
+
+script=$(mktemp)
+generate >"$script"
+./vmbench "$script" "$runs" |
+  awk -v calls="$calls" '{ print }
+    / ms\/run$/ { printf "%.1f M calls/s\n", calls / $(NF - 1) / 1e3 }'
+rm -f "$script"
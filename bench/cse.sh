@@ -0,0 +1,16 @@
+#!/bin/sh
+# generates straight-line assignments that repeat subexpressions, to compare
+# the optimization passes: ./bench/cse.sh LINES
+lines=${1:-48}
+
+echo "let x = 1"
+echo "let y = 2"
+echo "let d = 0"
+echo "let unused = 0"
+i=0
+while [ $i -lt "$lines" ]; do
+  echo "d = (x * y + 1) * (x * y + 1) - (x - y) * (x - y)"
+  echo "x = (x * y + d) / (x * y + 2 + d * d)"
+  echo "unused = d * d - x"
+  i=$((i + 3))
+done
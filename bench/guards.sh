@@ -0,0 +1,17 @@
+#!/bin/sh
+# generates guard-style conditions whose right operand is costly and usually
+# skipped: ./bench/guards.sh LINES
+lines=${1:-48}
+
+echo "let x = 1"
+echo "let y = 2"
+echo "let c = true"
+i=0
+while [ $i -lt "$lines" ]; do
+  echo "c = x < 0 and (x * x / 3 + y * y / 5 - x * y / 7) * (x + y) > 100"
+  echo "c = y > 0 or (x * 3 - y / 2) * (x * 5 + y / 4) / (x + y + 1) < 0"
+  echo "c = c or x * y / (x + y) - x / 3 > y * (y - x) / 2"
+  echo "x = x + 1"
+  echo "y = y + 1"
+  i=$((i + 5))
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+# generates the same computation as a while loop or unrolled into
+# straight-line code, to compare them with vmbench:
+# ./bench/loops.sh loop|unrolled ITERATIONS
+shape=${1:-loop}
+iterations=${2:-1000}
+
+echo "let i = 0"
+echo "let x = 1"
+echo "let c = true"
+
+body() {
+  echo "$1x = (x * 3 + i) / 4"
+  echo "$1c = !(x < i) or c == false"
+  echo "$1i = i + 1"
+}
+
+if [ "$shape" = loop ]; then
+  echo "while i < $iterations {"
+  body "  "
+  echo "}"
+else
+  i=0
+  while [ $i -lt "$iterations" ]; do
+    body ""
+    i=$((i + 1))
+  done
+fi
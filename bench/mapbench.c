@@ -0,0 +1,230 @@
+// times the operations of struct Map on a number of interned names, or with
+// --stress checks a long random sequence of them against a plain array,
+// using keys whose hashes collide a lot to make the probes long
+#define _POSIX_C_SOURCE 199309L
+
+#include "map.h"
+#include "str.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define NO_SLOT SIZE_MAX
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, the same sequence for the same seed everywhere
+static uint64_t nextRandom(uint64_t* state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static void shuffle(const struct Symbol** keys, size_t length,
+                    uint64_t* random) {
+  for (size_t i = length; i > 1; i--) {
+    size_t j = nextRandom(random) % i;
+    const struct Symbol* key = keys[i - 1];
+    keys[i - 1] = keys[j];
+    keys[j] = key;
+  }
+}
+
+static void report(const char* name, size_t operations, double elapsed) {
+  printf("%-16s %10zu ops in %.3fs: %6.1f ns/op\n", name, operations, elapsed,
+         elapsed / operations * 1e9);
+}
+
+static int bench(size_t length) {
+  // the first half goes into the map, the second half is looked up but never
+  // found
+  const struct Symbol** keys = malloc(2 * length * sizeof(struct Symbol*));
+  for (size_t i = 0; i < 2 * length; i++) {
+    char name[32];
+    int nameLength = snprintf(name, sizeof(name), "name%zu", i);
+    keys[i] = intern(name, nameLength);
+  }
+
+  uint64_t random = 0x9e3779b97f4a7c15ULL;
+  struct Map map;
+  initMap(&map);
+  size_t found = 0;
+
+  double start = now();
+  for (size_t i = 0; i < length; i++) {
+    setMap(&map, &(struct Entry){.key = keys[i], .slot = i});
+  }
+  report("insert", length, now() - start);
+
+  shuffle(keys, length, &random);
+  start = now();
+  for (size_t i = 0; i < length; i++) {
+    found += getMap(&map, keys[i]) != NULL;
+  }
+  report("lookup hit", length, now() - start);
+
+  start = now();
+  for (size_t i = length; i < 2 * length; i++) {
+    found += getMap(&map, keys[i]) != NULL;
+  }
+  report("lookup miss", length, now() - start);
+
+  start = now();
+  size_t index = 0, visited = 0;
+  for (struct Entry* entry; (entry = nextMap(&map, &index)) != NULL;) {
+    visited += entry->slot;
+  }
+  report("iterate", length, now() - start);
+
+  shuffle(keys, length, &random);
+  start = now();
+  for (size_t i = 0; i < length; i++) {
+    found += removeMap(&map, keys[i]);
+  }
+  report("remove", length, now() - start);
+
+  shrinkMap(&map);
+  start = now();
+  reserveMap(&map, length);
+  for (size_t i = 0; i < length; i++) {
+    setMap(&map, &(struct Entry){.key = keys[i], .slot = i});
+  }
+  report("reserve, insert", length, now() - start);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%zu entries in %zu places, peak memory %ld KiB\n", map.length,
+         map.size, usage.ru_maxrss);
+
+  deinitMap(&map);
+  free(keys);
+
+  // keeps the loops from being optimized away
+  return found + visited == 0 && length > 0;
+}
+
+// stops the harness at the first difference from the array
+static bool failed(const char* what, size_t operation) {
+  printf("%s after %zu operations\n", what, operation);
+  return false;
+}
+
+// every entry the map holds is in the array and the other way around
+static bool sameEntries(struct Map* map, struct Symbol* keys, size_t* slots,
+                        size_t length, size_t operation) {
+  size_t expected = 0;
+  for (size_t i = 0; i < length; i++) {
+    struct Entry* entry = getMap(map, &keys[i]);
+    if ((entry == NULL) != (slots[i] == NO_SLOT) ||
+        (entry != NULL && entry->slot != slots[i])) {
+      return failed("lookup differs", operation);
+    }
+    expected += slots[i] != NO_SLOT;
+  }
+
+  size_t index = 0, visited = 0;
+  for (struct Entry* entry; (entry = nextMap(map, &index)) != NULL;) {
+    size_t key = entry->key - keys;
+    if (key >= length || slots[key] != entry->slot)
+      return failed("iteration differs", operation);
+    visited++;
+  }
+
+  if (visited != expected || map->length != expected)
+    return failed("length differs", operation);
+
+  return true;
+}
+
+static int stress(size_t operations, uint64_t seed) {
+  uint64_t random = seed | 1;
+
+  // a quarter of the keys have hashes whose low bits are 0, so that there are
+  // long runs of entries with few homes between them
+  size_t length = operations / 16 + 16;
+  struct Symbol* keys = malloc(length * sizeof(struct Symbol));
+  size_t* slots = malloc(length * sizeof(size_t));
+  for (size_t i = 0; i < length; i++) {
+    uint64_t hash = nextRandom(&random);
+    keys[i] = (struct Symbol){.hash = i % 4 == 0 ? hash << 6 : hash};
+    slots[i] = NO_SLOT;
+  }
+
+  struct Map map;
+  initMap(&map);
+
+  for (size_t operation = 1; operation <= operations; operation++) {
+    size_t key = nextRandom(&random) % length;
+    uint64_t choice = nextRandom(&random) % 10000;
+
+    if (choice < 5000) {
+      size_t slot = nextRandom(&random) % 1000;
+      setMap(&map, &(struct Entry){.key = &keys[key], .slot = slot});
+      slots[key] = slot;
+    } else if (choice < 8000) {
+      if (removeMap(&map, &keys[key]) != (slots[key] != NO_SLOT)) {
+        failed("remove differs", operation);
+        return 1;
+      }
+      slots[key] = NO_SLOT;
+    } else if (choice < 9999) {
+      struct Entry* entry = getMap(&map, &keys[key]);
+      if ((entry == NULL) != (slots[key] == NO_SLOT) ||
+          (entry != NULL && entry->slot != slots[key])) {
+        failed("lookup differs", operation);
+        return 1;
+      }
+    } else if (nextRandom(&random) % 2 == 0) { // rare, resizing is slow
+      shrinkMap(&map);
+    } else {
+      reserveMap(&map, map.length + nextRandom(&random) % length);
+    }
+
+    // checking everything is linear, so it happens less often as the map
+    // grows
+    if ((operation & (operation - 1)) == 0 || operation % 1000000 == 0 ||
+        operation == operations) {
+      if (!sameEntries(&map, keys, slots, length, operation))
+        return 1;
+    }
+  }
+
+  printf("%zu operations on %zu keys agree, %zu entries in %zu places\n",
+         operations, length, map.length, map.size);
+
+  deinitMap(&map);
+  free(keys);
+  free(slots);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  bool stressed = argc > 1 && strcmp(argv[1], "--stress") == 0;
+  if (stressed) {
+    argc--;
+    argv++;
+  }
+
+  if (argc != 2 && !(stressed && argc == 3)) {
+    puts("usage: mapbench KEYS\n"
+         "       mapbench --stress OPERATIONS [SEED]");
+    return 1;
+  }
+
+  size_t count = strtoull(argv[1], NULL, 10);
+  if (stressed) {
+    return stress(count, argc == 3 ? strtoull(argv[2], NULL, 10) : 1);
+  }
+
+  return bench(count);
+}
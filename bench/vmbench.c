@@ -0,0 +1,115 @@
+// compiles a script once and runs it repeatedly on a fresh VM, reporting the
+// time spent inside compileString and runVM, the size of the source and the
+// bytecode, and the peak memory use of the process
+#define _POSIX_C_SOURCE 199309L
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "op.h"
+#include "source.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// number of instructions in the chunk, also the number executed per run if
+// it has no jumps or calls
+static size_t countInstructions(struct Chunk* chunk, bool* jumps) {
+  size_t count = 0;
+  *jumps = false;
+
+  for (size_t i = 0; i < chunk->length; count++) {
+    uint8_t op = chunk->code[i];
+    *jumps = *jumps || isJump(op) || op == OP_CALL || op == OP_TAIL_CALL;
+    i += instructionLength(&chunk->code[i]);
+  }
+
+  return count;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+  bool jit = argc > 1 && strcmp(argv[1], "--jit") == 0;
+  if (jit) {
+    argc--;
+    argv++;
+  }
+
+  if (argc != 3 && argc != 4) {
+    puts("usage: vmbench [--jit] FILE ITERATIONS [PASSES]");
+    return 1;
+  }
+
+  struct Source source;
+  if (!openSource(argv[1], &source)) {
+    return 1;
+  }
+
+  long iterations = strtol(argv[2], NULL, 10);
+
+  unsigned passes = optLevelPasses(DEFAULT_OPT_LEVEL);
+  if (argc == 4 && !parsePasses(argv[3], &passes)) {
+    printf("unknown pass in '%s'\n", argv[3]);
+    return 1;
+  }
+
+  struct GlobalNames globals;
+  initGlobalNames(&globals, &mallocAllocator);
+
+  size_t sourceLength = source.length;
+  double compileStart = now();
+  struct Chunk chunk =
+      compileString(source.string, source.length, false, &globals, passes);
+  double compileTime = now() - compileStart;
+  closeSource(&source);
+
+  bool jumps;
+  size_t instructions = countInstructions(&chunk, &jumps);
+  double elapsed = 0;
+
+  for (long i = 0; i < iterations; i++) {
+    struct VM vm;
+    initVM(&vm, &mallocAllocator);
+    vm.jit = jit;
+
+    double start = now();
+    enum RunResult result = runVM(&vm, &chunk);
+    elapsed += now() - start;
+
+    deinitVM(&vm);
+
+    if (result != RUN_OK) {
+      return 1;
+    }
+  }
+
+  printf("compiled %zu source bytes into %zu code bytes in %.3fs\n",
+         sourceLength, chunk.length, compileTime);
+
+  if (jumps) { // the executed instructions are not known
+    printf("%zu instructions x %ld runs in %.3fs: %.3f ms/run\n",
+           instructions, iterations, elapsed, elapsed / iterations * 1e3);
+  } else {
+    printf("%zu instructions x %ld runs in %.3fs: %.1f M instructions/s\n",
+           instructions, iterations, elapsed,
+           instructions * iterations / elapsed / 1e6);
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("peak memory %ld KiB\n", usage.ru_maxrss);
+
+  deinitChunk(&chunk);
+  deinitGlobalNames(&globals);
+}
@@ -0,0 +1,310 @@
+#define _DEFAULT_SOURCE // dirent, fcntl locks
+
+#include "cache.h"
+
+#include "chunk.h"
+#include "image.h"
+#include "memory.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+// besides the source and the passes, what decides the code compiled from it.
+// every build of toy gets entries of its own
+static const char buildId[] = __DATE__ " " __TIME__
+#ifdef NO_CONSTANT_FOLDING
+    " NO_CONSTANT_FOLDING"
+#endif
+#ifdef NO_SUPERINSTRUCTIONS
+    " NO_SUPERINSTRUCTIONS"
+#endif
+    ;
+
+// the directory and the name of a file in it
+#define PATH_LENGTH 4096
+
+// temp files older than this were left by a process that died while writing
+#define STALE_TEMP_SECONDS 3600
+
+static bool makeDir(const char* path) {
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+bool openCache(struct Cache* cache) {
+  const char* dir = getenv("TOY_CACHE_DIR");
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  int length;
+
+  if (dir != NULL && *dir != '\0') {
+    length = snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+  } else if (xdg != NULL && *xdg != '\0') {
+    length = snprintf(cache->dir, sizeof(cache->dir), "%s/toy", xdg);
+  } else if (home != NULL && *home != '\0') {
+    length = snprintf(cache->dir, sizeof(cache->dir), "%s/.cache", home);
+    if (!makeDir(cache->dir))
+      return false;
+    length = snprintf(cache->dir, sizeof(cache->dir), "%s/.cache/toy", home);
+  } else {
+    return false;
+  }
+
+  if (length < 0 || (size_t)length >= sizeof(cache->dir))
+    return false;
+
+  cache->limit = DEFAULT_CACHE_LIMIT;
+  const char* limit = getenv("TOY_CACHE_LIMIT");
+  if (limit != NULL && *limit != '\0') {
+    char* end;
+    unsigned long long bytes = strtoull(limit, &end, 10);
+    if (*end == '\0') {
+      cache->limit = bytes;
+    }
+  }
+
+  return makeDir(cache->dir);
+}
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+#define FNV_PRIME 0x100000001b3
+
+// a second FNV-1a stream with other constants, together they make a key
+// unlikely enough to collide that the source is not stored to compare
+#define SECOND_OFFSET_BASIS 0x84222325cbf29ce4
+#define SECOND_PRIME 0x9e3779b97f4a7c15
+
+static void hashBytes(uint64_t hashes[2], const void* data, size_t length) {
+  const uint8_t* bytes = data;
+  uint64_t first = hashes[0], second = hashes[1];
+
+  for (size_t i = 0; i < length; i++) {
+    first = (first ^ bytes[i]) * FNV_PRIME;
+    second = (second ^ bytes[i]) * SECOND_PRIME;
+  }
+
+  hashes[0] = first;
+  hashes[1] = second;
+}
+
+// spreads the last bytes hashed over every bit
+static uint64_t finish(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+struct CacheKey cacheKey(const char* source, size_t length, unsigned passes) {
+  uint64_t hashes[2] = {FNV_OFFSET_BASIS, SECOND_OFFSET_BASIS};
+  unsigned version = IMAGE_VERSION;
+
+  hashBytes(hashes, source, length);
+  hashBytes(hashes, &passes, sizeof(passes));
+  hashBytes(hashes, &version, sizeof(version));
+  hashBytes(hashes, buildId, sizeof(buildId));
+
+  struct CacheKey key;
+  snprintf(key.name, sizeof(key.name), "%016" PRIx64 "%016" PRIx64,
+           finish(hashes[0]), finish(hashes[1]));
+  return key;
+}
+
+static void entryPath(struct Cache* cache, struct CacheKey* key,
+                      char path[PATH_LENGTH]) {
+  snprintf(path, PATH_LENGTH, "%s/%s.toyc", cache->dir, key->name);
+}
+
+// the hits and the misses, stored in the byte order of the machine
+static void readStats(int fd, uint64_t counts[2]) {
+  if (pread(fd, counts, 2 * sizeof(uint64_t), 0) != 2 * sizeof(uint64_t)) {
+    counts[0] = counts[1] = 0;
+  }
+}
+
+// the stats file is locked while it is updated so that processes counting at
+// the same time do not lose counts
+static void count(struct Cache* cache, bool hit) {
+  char path[PATH_LENGTH];
+  snprintf(path, sizeof(path), "%s/stats", cache->dir);
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return;
+
+  struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+  if (fcntl(fd, F_SETLKW, &lock) == 0) {
+    uint64_t counts[2];
+    readStats(fd, counts);
+    counts[hit ? 0 : 1]++;
+    if (pwrite(fd, counts, sizeof(counts), 0) != sizeof(counts)) {
+      // the count is lost, the cache still works
+    }
+  }
+
+  close(fd); // releases the lock
+}
+
+bool loadCached(struct Cache* cache, struct CacheKey* key,
+                struct Image* image) {
+  char path[PATH_LENGTH];
+  entryPath(cache, key, path);
+
+  // a missing entry or one that cannot be used is a miss, compiling again
+  // replaces it
+  bool hit = loadImage(path, image) == NULL;
+  if (hit) {
+    utime(path, NULL); // the modification time orders entries for eviction
+  }
+
+  count(cache, hit);
+  return hit;
+}
+
+struct Entry {
+  char name[64];
+  time_t used;
+  off_t size;
+};
+
+struct Entries {
+  struct Entry* entries;
+  size_t size, length;
+  uint64_t bytes;
+};
+
+static bool hasSuffix(const char* name, const char* suffix) {
+  size_t length = strlen(name), suffixLength = strlen(suffix);
+  return length > suffixLength &&
+         strcmp(name + length - suffixLength, suffix) == 0;
+}
+
+// lists the entries and removes temp files that will never be renamed
+static void scanEntries(struct Cache* cache, struct Entries* entries) {
+  *entries = (struct Entries){0};
+
+  DIR* dir = opendir(cache->dir);
+  if (dir == NULL)
+    return;
+
+  time_t now = time(NULL);
+  struct dirent* file;
+  while ((file = readdir(dir)) != NULL) {
+    bool temp = hasSuffix(file->d_name, ".tmp");
+    if ((!temp && !hasSuffix(file->d_name, ".toyc")) ||
+        strlen(file->d_name) >= sizeof(entries->entries->name)) {
+      continue;
+    }
+
+    char path[PATH_LENGTH];
+    struct stat status;
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, file->d_name);
+    if (stat(path, &status) != 0)
+      continue;
+
+    if (temp) {
+      if (now - status.st_mtime > STALE_TEMP_SECONDS) {
+        remove(path);
+      }
+      continue;
+    }
+
+    if (entries->length >= entries->size) {
+      size_t previousSize = entries->size;
+      entries->size = nextArraySize(previousSize);
+      entries->entries = reallocate(entries->entries, entries->size,
+                                    previousSize, sizeof(struct Entry));
+    }
+
+    struct Entry* entry = &entries->entries[entries->length++];
+    strcpy(entry->name, file->d_name);
+    entry->used = status.st_mtime;
+    entry->size = status.st_size;
+    entries->bytes += status.st_size;
+  }
+
+  closedir(dir);
+}
+
+static int compareUse(const void* a, const void* b) {
+  time_t x = ((const struct Entry*)a)->used;
+  time_t y = ((const struct Entry*)b)->used;
+  return (x > y) - (x < y);
+}
+
+// removes the least recently used entries until the cache fits its limit
+static void evict(struct Cache* cache) {
+  struct Entries entries;
+  scanEntries(cache, &entries);
+
+  if (entries.bytes > cache->limit) {
+    qsort(entries.entries, entries.length, sizeof(struct Entry), compareUse);
+
+    for (size_t i = 0; i < entries.length && entries.bytes > cache->limit;
+         i++) {
+      char path[PATH_LENGTH];
+      snprintf(path, sizeof(path), "%s/%s", cache->dir,
+               entries.entries[i].name);
+
+      // a process that mapped the entry keeps running it
+      if (remove(path) == 0) {
+        entries.bytes -= entries.entries[i].size;
+      }
+    }
+  }
+
+  free(entries.entries);
+}
+
+void storeCached(struct Cache* cache, struct CacheKey* key,
+                 struct Chunk* chunk) {
+  char path[PATH_LENGTH], temp[PATH_LENGTH];
+  entryPath(cache, key, path);
+  snprintf(temp, sizeof(temp), "%s/%s.%ld.tmp", cache->dir, key->name,
+           (long)getpid());
+
+  // readers only ever see a complete entry, renaming replaces it atomically
+  FILE* file = fopen(temp, "wb");
+  if (file == NULL)
+    return;
+
+  bool written = writeImage(file, chunk);
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temp, path) != 0) {
+    remove(temp);
+    return;
+  }
+
+  evict(cache);
+}
+
+void printCacheStats(struct Cache* cache) {
+  uint64_t counts[2] = {0, 0};
+  char path[PATH_LENGTH];
+  snprintf(path, sizeof(path), "%s/stats", cache->dir);
+
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    readStats(fd, counts);
+    close(fd);
+  }
+
+  struct Entries entries;
+  scanEntries(cache, &entries);
+  free(entries.entries);
+
+  printf("%s: %" PRIu64 " hits, %" PRIu64 " misses, %zu entries using %" PRIu64
+         " of %zu bytes\n",
+         cache->dir, counts[0], counts[1], entries.length, entries.bytes,
+         cache->limit);
+}
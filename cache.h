@@ -0,0 +1,41 @@
+#pragma once
+
+#include "chunk.h"
+#include "image.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// scripts run from a file are compiled once and kept as images in a cache
+// directory, TOY_CACHE_DIR or else $XDG_CACHE_HOME/toy or ~/.cache/toy. an
+// entry is named by a hash of the source, the passes and the build of toy, so
+// a changed script or a rebuilt toy never finds a stale one. the least
+// recently used entries are removed once the directory holds more than
+// TOY_CACHE_LIMIT bytes
+
+#define DEFAULT_CACHE_LIMIT (64 * 1024 * 1024)
+
+struct Cache {
+  char dir[3584]; // short enough for the paths of the files in it
+  size_t limit;
+};
+
+// false if no cache directory can be used
+bool openCache(struct Cache* cache);
+
+struct CacheKey {
+  char name[33]; // 128 bit hash in hex
+};
+
+struct CacheKey cacheKey(const char* source, size_t length, unsigned passes);
+
+// maps the entry into image and counts a hit, or counts a miss
+bool loadCached(struct Cache* cache, struct CacheKey* key,
+                struct Image* image);
+// adds an entry for the compiled chunk, racing processes each write their own
+// file and the last rename wins
+void storeCached(struct Cache* cache, struct CacheKey* key,
+                 struct Chunk* chunk);
+
+void printCacheStats(struct Cache* cache);
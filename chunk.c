@@ -1,10 +1,22 @@
 #include "chunk.h"
 
 #include "memory.h"
+#include "op.h"
 #include "str.h"
 #include <stdlib.h>
+#include <string.h>
+
+#define MAX_POOL_INDEX_LOAD 0.5
+
+static void initPoolIndex(struct PoolIndex* index) {
+  index->entries = NULL;
+  index->size = 0;
+  index->length = 0;
+}
 
 void initChunk(struct Chunk* chunk) {
+  chunk->allocator = &mallocAllocator;
+
   chunk->code = NULL;
   chunk->size = 0;
   chunk->length = 0;
@@ -12,56 +24,408 @@ void initChunk(struct Chunk* chunk) {
   chunk->values.values = NULL;
   chunk->values.length = 0;
   chunk->values.size = 0;
+  initPoolIndex(&chunk->valuesIndex);
 
   chunk->strings.strings = NULL;
   chunk->strings.length = 0;
   chunk->strings.size = 0;
+  initPoolIndex(&chunk->stringsIndex);
+
+  chunk->maxStack = 0;
+
+  chunk->peepholeBytes = 0;
+  chunk->peepholeDispatches = 0;
+
+  chunk->jit = NULL;
+  chunk->native = NULL;
 }
 
 void deinitChunk(struct Chunk* chunk) {
-  free(chunk->code);
-  free(chunk->values.values);
+  struct Allocator* allocator = chunk->allocator;
+
+  freeWith(allocator, MEMORY_CODE, chunk->code, chunk->size, sizeof(uint8_t));
+  freeWith(allocator, MEMORY_CONSTANTS, chunk->values.values,
+           chunk->values.size, sizeof(struct Value));
+  freeWith(allocator, MEMORY_CONSTANTS, chunk->valuesIndex.entries,
+           chunk->valuesIndex.size, sizeof(struct PoolEntry));
+  // the strings themselves are not owned
+  freeWith(allocator, MEMORY_STRINGS, chunk->strings.strings,
+           chunk->strings.size, sizeof(struct String));
+  freeWith(allocator, MEMORY_STRINGS, chunk->stringsIndex.entries,
+           chunk->stringsIndex.size, sizeof(struct PoolEntry));
+  freeJitCode(chunk->jit);
 
   initChunk(chunk);
+  chunk->allocator = allocator;
 }
 
 void writeChunk(struct Chunk* chunk, uint8_t byte) {
   if (chunk->length >= chunk->size) {
     size_t previousSize = chunk->size;
     chunk->size = nextArraySize(chunk->size);
-    chunk->code =
-        reallocate(chunk->code, chunk->size, previousSize, sizeof(byte));
+    chunk->code = reallocateWith(chunk->allocator, MEMORY_CODE, chunk->code,
+                                 chunk->size, previousSize, sizeof(byte));
   }
 
   chunk->code[chunk->length++] = byte;
 }
 
+// first entry with the given hash at or after *position, NULL if there is none
+static struct PoolEntry* probePoolIndex(struct PoolIndex* index, uint64_t hash,
+                                        size_t* position) {
+  for (;;) {
+    struct PoolEntry* entry = &index->entries[*position];
+    *position = (*position + 1) & (index->size - 1);
+
+    if (entry->index == 0) {
+      return NULL;
+    } else if (entry->hash == hash) {
+      return entry;
+    }
+  }
+}
+
+static void insertPoolIndex(struct Allocator* allocator, enum MemoryUse use,
+                            struct PoolIndex* index, uint64_t hash,
+                            size_t poolIndex) {
+  if (index->length + 1 > index->size * MAX_POOL_INDEX_LOAD) {
+    struct PoolIndex grown = {
+        .size = nextArraySize(index->size),
+        .length = index->length,
+    };
+    grown.entries = reallocateWith(allocator, use, NULL, grown.size, 0,
+                                   sizeof(struct PoolEntry));
+    memset(grown.entries, 0, grown.size * sizeof(struct PoolEntry));
+
+    for (size_t i = 0; i < index->size; i++) {
+      struct PoolEntry entry = index->entries[i];
+      if (entry.index == 0)
+        continue;
+
+      size_t position = entry.hash & (grown.size - 1);
+      while (grown.entries[position].index != 0) {
+        position = (position + 1) & (grown.size - 1);
+      }
+      grown.entries[position] = entry;
+    }
+
+    freeWith(allocator, use, index->entries, index->size,
+             sizeof(struct PoolEntry));
+    *index = grown;
+  }
+
+  size_t position = hash & (index->size - 1);
+  while (index->entries[position].index != 0) {
+    position = (position + 1) & (index->size - 1);
+  }
+
+  index->entries[position] = (struct PoolEntry){hash, poolIndex + 1};
+  index->length++;
+}
+
+// hashes and compares the representation, so 0 and -0 stay different
+static uint64_t hashValue(struct Value value) {
+  uint64_t bits = VALUE_TYPE(value);
+
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+  } else if (IS_BOOL(value)) {
+    bits ^= AS_BOOL(value) ? 0x100 : 0;
+  } else if (IS_FUNCTION(value)) {
+    bits ^= (uintptr_t)AS_FUNCTION(value);
+  }
+
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return bits;
+}
+
+static bool sameValue(struct Value a, struct Value b) {
+  if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
+    return false;
+  } else if (IS_NUMBER(a)) {
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(x)) == 0;
+  } else if (IS_BOOL(a)) {
+    return AS_BOOL(a) == AS_BOOL(b);
+  } else if (IS_FUNCTION(a)) {
+    return AS_FUNCTION(a) == AS_FUNCTION(b);
+  }
+
+  return true;
+}
+
 size_t addConstant(struct Chunk* chunk, struct Value value) {
   struct ValueArray* values = &chunk->values;
+  uint64_t hash = hashValue(value);
+
+  if (chunk->valuesIndex.entries != NULL) {
+    size_t position = hash & (chunk->valuesIndex.size - 1);
+    struct PoolEntry* entry;
+
+    while ((entry = probePoolIndex(&chunk->valuesIndex, hash, &position))) {
+      if (sameValue(values->values[entry->index - 1], value)) {
+        return entry->index - 1;
+      }
+    }
+  }
 
   if (values->length >= values->size) {
     size_t previousSize = values->size;
     values->size = nextArraySize(values->size);
     values->values =
-        reallocate(values->values, values->size, previousSize, sizeof(value));
+        reallocateWith(chunk->allocator, MEMORY_CONSTANTS, values->values,
+                       values->size, previousSize, sizeof(value));
   }
 
   values->values[values->length++] = value;
+  insertPoolIndex(chunk->allocator, MEMORY_CONSTANTS, &chunk->valuesIndex,
+                  hash, values->length - 1);
 
   return values->length - 1;
 }
 
 size_t addString(struct Chunk* chunk, struct String string) {
   struct StringArray* strings = &chunk->strings;
+  uint64_t hash = hashString(&string);
+
+  if (chunk->stringsIndex.entries != NULL) {
+    size_t position = hash & (chunk->stringsIndex.size - 1);
+    struct PoolEntry* entry;
+
+    while ((entry = probePoolIndex(&chunk->stringsIndex, hash, &position))) {
+      struct String* existing = &strings->strings[entry->index - 1];
+
+      if (existing->length == string.length &&
+          memcmp(existing->str, string.str, string.length) == 0) {
+        return entry->index - 1;
+      }
+    }
+  }
 
   if (strings->length >= strings->size) {
     size_t previousSize = strings->size;
     strings->size = nextArraySize(previousSize);
-    strings->strings = reallocate(strings->strings, strings->size, previousSize,
-                                  sizeof(string));
+    strings->strings =
+        reallocateWith(chunk->allocator, MEMORY_STRINGS, strings->strings,
+                       strings->size, previousSize, sizeof(string));
   }
 
   strings->strings[strings->length++] = string;
+  insertPoolIndex(chunk->allocator, MEMORY_STRINGS, &chunk->stringsIndex,
+                  hash, strings->length - 1);
 
   return strings->length - 1;
 }
+
+size_t instructionLength(const uint8_t* code) {
+  switch (*code) {
+    case OP_CONSTANT:
+    case OP_ASSIGN:
+    case OP_READ:
+    case OP_STORE_TEMP:
+    case OP_LOAD_TEMP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_CHECKED:
+    case OP_POP_LOCALS:
+    case OP_CHECK_TYPE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return 2;
+    case OP_DECLARE:
+    case OP_READ_CONST_ADD:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE:
+    case OP_SHORT_AND:
+    case OP_SHORT_OR:
+      return 3;
+    case OP_CONST_DECLARE:
+    case OP_CONSTANT_LONG:
+    case OP_ASSIGN_LONG:
+    case OP_READ_LONG:
+      return 4;
+    case OP_DECLARE_LONG:
+      return 5;
+  }
+
+  return 1;
+}
+
+bool isJump(enum OpCode op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP_IF_TRUE ||
+         op == OP_SHORT_AND || op == OP_SHORT_OR;
+}
+
+size_t jumpTarget(const uint8_t* code, size_t offset) {
+  size_t distance = code[offset + 1] | code[offset + 2] << 8;
+  size_t end = offset + instructionLength(&code[offset]);
+
+  return code[offset] == OP_LOOP_IF_TRUE ? end - distance : end + distance;
+}
+
+void setJumpTarget(uint8_t* code, size_t offset, size_t target) {
+  size_t end = offset + instructionLength(&code[offset]);
+  size_t distance =
+      code[offset] == OP_LOOP_IF_TRUE ? end - target : target - end;
+
+  code[offset + 1] = distance & 0xff;
+  code[offset + 2] = (distance >> 8) & 0xff;
+}
+
+// values the instruction at code takes from the stack and leaves on it
+static void stackEffect(const uint8_t* code, size_t* pops, size_t* pushes) {
+  *pops = 0;
+  *pushes = 0;
+
+  switch (*code) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_READ:
+    case OP_READ_LONG:
+    case OP_LOAD_TEMP:
+    case OP_GET_LOCAL:
+    case OP_READ_CONST_ADD:
+      *pushes = 1;
+      break;
+    case OP_POP:
+    case OP_ASSIGN:
+    case OP_ASSIGN_LONG:
+    case OP_DECLARE:
+    case OP_DECLARE_LONG:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_CHECKED:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP_IF_TRUE:
+    case OP_PRINT_POP:
+      *pops = 1;
+      break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_DIVIDE:
+    case OP_MULTIPLY:
+    case OP_AND:
+    case OP_OR:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESSER:
+    case OP_LESSER_EQUAL:
+    case OP_ADD_NUM_NUM:
+    case OP_SUBTRACT_NUM_NUM:
+    case OP_MULTIPLY_NUM_NUM:
+    case OP_DIVIDE_NUM_NUM:
+    case OP_EQUAL_NUM_NUM:
+    case OP_NOT_EQUAL_NUM_NUM:
+    case OP_GREATER_NUM_NUM:
+    case OP_GREATER_EQUAL_NUM_NUM:
+    case OP_LESSER_NUM_NUM:
+    case OP_LESSER_EQUAL_NUM_NUM:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_STORE_TEMP:
+    case OP_CHECK_TYPE:
+    case OP_SHORT_AND:
+    case OP_SHORT_OR:
+      // look at the top without moving it
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case OP_POP_LOCALS:
+      *pops = code[1];
+      break;
+    case OP_CALL:
+      *pops = code[1] + 1;
+      *pushes = 1;
+      break;
+    case OP_TAIL_CALL:
+      *pops = code[1] + 1;
+      break;
+  }
+}
+
+// whether the next instruction can run after the one at code
+static bool fallsThrough(const uint8_t* code) {
+  return *code != OP_RETURN && *code != OP_JUMP && *code != OP_TAIL_CALL;
+}
+
+// marks the height the stack has at offset, false if another path got there
+// with a different one
+static bool reachHeight(size_t* heights, size_t* pending, size_t* nPending,
+                        size_t offset, size_t height) {
+  if (heights[offset] == SIZE_MAX) {
+    heights[offset] = height;
+    pending[(*nPending)++] = offset;
+    return true;
+  }
+
+  return heights[offset] == height;
+}
+
+bool findMaxStack(struct Chunk* chunk, size_t arity) {
+  const uint8_t* code = chunk->code;
+  size_t length = chunk->length;
+
+  if (length == 0)
+    return false;
+
+  // every offset is walked once, the first path to reach it sets its height
+  size_t* heights = malloc(length * sizeof(size_t));
+  size_t* pending = malloc(length * sizeof(size_t));
+  size_t nPending = 0;
+  for (size_t i = 0; i < length; i++) {
+    heights[i] = SIZE_MAX;
+  }
+
+  size_t max = arity;
+  bool ok = reachHeight(heights, pending, &nPending, 0, arity);
+
+  while (ok && nPending > 0) {
+    size_t offset = pending[--nPending];
+    size_t height = heights[offset];
+    const uint8_t* instruction = &code[offset];
+
+    size_t pops, pushes;
+    stackEffect(instruction, &pops, &pushes);
+
+    // locals are indexed from the frame's first slot and have to be below
+    // the top, a stored value is popped before
+    bool local = *instruction == OP_GET_LOCAL ||
+                 *instruction == OP_SET_LOCAL ||
+                 *instruction == OP_SET_LOCAL_CHECKED;
+    if (pops > height || (local && instruction[1] >= height - pops)) {
+      ok = false;
+      break;
+    }
+
+    height = height - pops + pushes;
+    if (height > max) {
+      max = height;
+    }
+
+    size_t next = offset + instructionLength(instruction);
+    if (isJump(*instruction)) {
+      ok = reachHeight(heights, pending, &nPending,
+                       jumpTarget(code, offset), height);
+    }
+    if (ok && fallsThrough(instruction)) {
+      ok = next < length &&
+           reachHeight(heights, pending, &nPending, next, height);
+    }
+  }
+
+  free(heights);
+  free(pending);
+
+  chunk->maxStack = max;
+  return ok;
+}
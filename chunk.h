@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "aot.h"
+#include "jit.h"
+#include "memory.h"
+#include "op.h"
 #include "str.h"
 #include "value.h"
 
@@ -13,7 +17,29 @@ struct ValueArray {
   size_t length;
 };
 
+// open addressing table of pool index + 1 (0 marks a free entry) used to find
+// an existing pool entry equal to the one being added
+struct PoolIndex {
+  struct PoolEntry {
+    uint64_t hash;
+    size_t index;
+  }* entries;
+  size_t size, length;
+};
+
+// largest operand of the _LONG instructions
+#define MAX_LONG_OPERAND 0xffffff
+
+// temps are addressed by a one byte operand
+#define MAX_TEMPS 256
+
+// largest distance a jump can cover
+#define MAX_JUMP 0xffff
+
 struct Chunk {
+  // what the arrays below come from, malloc unless set after initChunk
+  struct Allocator* allocator;
+
   // 8 bit array
   uint8_t* code;
   size_t size;
@@ -21,13 +47,46 @@ struct Chunk {
 
   // constants array
   struct ValueArray values;
+  struct PoolIndex valuesIndex;
 
-  // interned strings
+  // names of the global slots, indexed by slot
   struct StringArray strings;
+  struct PoolIndex stringsIndex;
+
+  // most values a frame running the code holds at once, counting from its
+  // first slot, so a call can check that the stack has room before it starts
+  size_t maxStack;
+
+  // what the peephole pass removed, reported by debugChunk
+  size_t peepholeBytes, peepholeDispatches;
+
+  // native code the vm compiled the chunk into, NULL until it runs with the
+  // jit enabled
+  struct JitCode* jit;
+  // translation loaded from a shared object, run instead of the jit's code
+  NativeChunk native;
 };
 
 void initChunk(struct Chunk* chunk);
 void deinitChunk(struct Chunk* chunk);
 void writeChunk(struct Chunk* chunk, uint8_t byte);
+
+// both return the index of an equal entry if one was added before
 size_t addConstant(struct Chunk* chunk, struct Value value);
 size_t addString(struct Chunk* chunk, struct String string);
+
+// size of the instruction at code including its operands
+size_t instructionLength(const uint8_t* code);
+
+bool isJump(enum OpCode op);
+// offset the jump at offset continues at, and the other way around. the
+// distance has to fit in MAX_JUMP
+size_t jumpTarget(const uint8_t* code, size_t offset);
+void setJumpTarget(uint8_t* code, size_t offset, size_t target);
+
+// follows the height of the stack through the code of a frame that starts with
+// arity values and sets maxStack. false if an instruction takes more values
+// than the frame holds, uses a local at or above the top, falls off the end,
+// or if paths meet with different heights. the instructions and their jump
+// targets have to be within the code
+bool findMaxStack(struct Chunk* chunk, size_t arity);
@@ -1,12 +1,17 @@
 #include "compiler.h"
 
 #include "chunk.h"
+#include "ir.h"
+#include "map.h"
+#include "memory.h"
 #include "op.h"
+#include "peephole.h"
 #include "token.h"
 #include "value.h"
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -14,18 +19,82 @@
 #include "debug.h"
 #endif
 
+#define MAX_RECENT_OPS 8
+
+// locals are addressed by a one byte operand
+#define MAX_LOCALS 256
+#define NO_LOCAL SIZE_MAX
+
+// what the compiler knows about a global within the current compilation unit
+struct GlobalInfo {
+  // target of an assignment somewhere in the unit
+  bool assigned;
+  // value of its `let` if that was a constant and it is never assigned,
+  // NONE_VALUE otherwise
+  struct Value value;
+};
+
+// a variable declared in a block, which lives on the value stack
+struct Local {
+  struct Token name;
+  size_t depth;
+  // VALUE_NONE if it is only known at runtime
+  enum ValueType type;
+};
+
+// the locals of the code being parsed, by stack slot of its frame
+struct Scope {
+  struct Local locals[MAX_LOCALS];
+  size_t localsLength;
+  // code the function is declared in, NULL outside of functions
+  struct Scope* enclosing;
+};
+
 struct Parser {
   struct Scanner scanner;
   struct Chunk compiling;
+  struct GlobalNames* globals;
+
+  // the unit is parsed into ir first, then optimized by the enabled passes and
+  // lowered into compiling
+  struct Ir ir;
+  unsigned passes;
+
   struct Token previous, current;
 
   bool panic;
   bool hadError;
 
+  // later compilations continue the program, as REPL lines and the batches of
+  // a stream do, so nothing may assume the globals are only used here
   bool repl;
   bool emitPrint;
+  bool batch; // each line prints like a line of the REPL would
+
+  // blocks the parser or the lowering is inside of
+  size_t depth;
+
+  // locals in scope while parsing
+  struct Scope* scope;
+
+  // function being lowered, NULL while lowering the unit's own code
+  struct Function* function;
+
+  // start offsets of the most recently emitted instructions, newest last, used
+  // to fold constants and fuse common sequences into superinstructions
+  size_t recentOps[MAX_RECENT_OPS];
+  size_t nRecentOps;
+
+  // indexed by global slot, grown on demand
+  struct GlobalInfo* globalInfo;
+  size_t globalInfoSize;
+
+  // what the compilation allocates for itself, freed once it finished
+  struct Arena arena;
 };
 
+#define NO_OFFSET SIZE_MAX
+
 static void resetParser(struct Parser* parser) {
   parser->scanner = (struct Scanner){0};
   parser->previous = (struct Token){0};
@@ -34,6 +103,15 @@ static void resetParser(struct Parser* parser) {
   parser->panic = false;
   parser->hadError = false;
 
+  parser->nRecentOps = 0;
+  parser->depth = 0;
+  parser->function = NULL;
+
+  parser->globalInfo = NULL;
+  parser->globalInfoSize = 0;
+
+  initArena(&parser->arena);
+  initIr(&parser->ir, &parser->arena);
   initChunk(&parser->compiling);
 }
 
@@ -74,6 +152,10 @@ static bool atEnd(struct Parser* parser) {
   return parser->current.type == TOKEN_EOF;
 }
 
+static bool check(struct Parser* parser, enum TokenType type) {
+  return parser->current.type == type;
+}
+
 static void consume(struct Parser* parser, enum TokenType type,
                     const char* error) {
   if (!match(parser, type)) {
@@ -96,146 +178,592 @@ static void emitByte(struct Parser* parser, uint8_t byte) {
   writeChunk(&parser->compiling, byte);
 }
 
-// duplicate string
-static char* duplicateString(const char* string, size_t length) {
-  char* dup = malloc(length);
-  strncpy(dup, string, length);
-  return dup;
+#if !defined(NO_CONSTANT_FOLDING) || !defined(NO_SUPERINSTRUCTIONS)
+// offset of the n-th most recent instruction, 0 being the last one
+static size_t recentOp(struct Parser* parser, size_t n) {
+  return n < parser->nRecentOps ? parser->recentOps[parser->nRecentOps - 1 - n]
+                                : NO_OFFSET;
+}
+#endif
+
+static void pushRecentOp(struct Parser* parser, size_t offset) {
+  if (parser->nRecentOps == MAX_RECENT_OPS) { // forget the oldest one
+    memmove(parser->recentOps, parser->recentOps + 1,
+            (MAX_RECENT_OPS - 1) * sizeof(size_t));
+    parser->nRecentOps--;
+  }
+
+  parser->recentOps[parser->nRecentOps++] = offset;
+}
+
+static void emitConstant(struct Parser* parser, struct Value value);
+
+#ifndef NO_CONSTANT_FOLDING
+// removes the last n instructions from the chunk
+static void dropRecentOps(struct Parser* parser, size_t n) {
+  parser->compiling.length = recentOp(parser, n - 1);
+  parser->nRecentOps -= n;
+}
+
+// value pushed by the instruction at offset, false if it is not a constant
+static bool constantAt(struct Parser* parser, size_t offset,
+                       struct Value* value) {
+  if (offset == NO_OFFSET)
+    return false;
+
+  uint8_t* code = &parser->compiling.code[offset];
+  size_t index;
+
+  if (code[0] == OP_CONSTANT) {
+    index = code[1];
+  } else if (code[0] == OP_CONSTANT_LONG) {
+    index = code[1] | code[2] << 8 | code[3] << 16;
+  } else {
+    return false;
+  }
+
+  *value = parser->compiling.values.values[index];
+  return true;
+}
+
+// evaluates op the way the vm would, returns false where the vm raises an
+// error so that it is still reported at runtime
+static bool evaluateOp(enum OpCode op, struct Value a, struct Value b,
+                       struct Value* result) {
+  bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+  bool bools = IS_BOOL(a) && IS_BOOL(b);
+
+  switch (op) {
+    case OP_NEGATE:
+      *result = NUMBER_VALUE(-AS_NUMBER(b));
+      return IS_NUMBER(b);
+    case OP_NOT:
+      *result = BOOL_VALUE(!AS_BOOL(b));
+      return IS_BOOL(b);
+    case OP_ADD:
+      *result = NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b));
+      return numbers;
+    case OP_SUBTRACT:
+      *result = NUMBER_VALUE(AS_NUMBER(a) - AS_NUMBER(b));
+      return numbers;
+    case OP_MULTIPLY:
+      *result = NUMBER_VALUE(AS_NUMBER(a) * AS_NUMBER(b));
+      return numbers;
+    case OP_DIVIDE:
+      if (!numbers || AS_NUMBER(b) == 0.)
+        return false;
+      *result = NUMBER_VALUE(AS_NUMBER(a) / AS_NUMBER(b));
+      return true;
+    case OP_AND:
+      *result = BOOL_VALUE(AS_BOOL(a) && AS_BOOL(b));
+      return bools;
+    case OP_OR:
+      *result = BOOL_VALUE(AS_BOOL(a) || AS_BOOL(b));
+      return bools;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL: {
+      bool equal = numbers ? AS_NUMBER(a) == AS_NUMBER(b)
+                           : bools && AS_BOOL(a) == AS_BOOL(b);
+      *result = BOOL_VALUE(op == OP_EQUAL ? equal : !equal);
+      return numbers || bools;
+    }
+    case OP_GREATER:
+      *result = BOOL_VALUE(AS_NUMBER(a) > AS_NUMBER(b));
+      return numbers;
+    case OP_GREATER_EQUAL:
+      *result = BOOL_VALUE(AS_NUMBER(a) >= AS_NUMBER(b));
+      return numbers;
+    case OP_LESSER:
+      *result = BOOL_VALUE(AS_NUMBER(a) < AS_NUMBER(b));
+      return numbers;
+    case OP_LESSER_EQUAL:
+      *result = BOOL_VALUE(AS_NUMBER(a) <= AS_NUMBER(b));
+      return numbers;
+    default:
+      return false;
+  }
+}
+
+// replaces the constant operands of op with its result, returns false if they
+// are not all constants
+static bool foldOp(struct Parser* parser, enum OpCode op) {
+  struct Value a = NONE_VALUE, b, result;
+
+  size_t operands = op == OP_NEGATE || op == OP_NOT ? 1 : 2;
+
+  if (!constantAt(parser, recentOp(parser, 0), &b) ||
+      (operands == 2 && !constantAt(parser, recentOp(parser, 1), &a)) ||
+      !evaluateOp(op, a, b, &result)) {
+    return false;
+  }
+
+  dropRecentOps(parser, operands);
+  emitConstant(parser, result);
+  return true;
 }
+#endif
+
+#ifndef NO_SUPERINSTRUCTIONS
+static bool lastOpIs(struct Parser* parser, size_t offset, enum OpCode op) {
+  return offset != NO_OFFSET && parser->compiling.code[offset] == op;
+}
+
+// rewrites the previously emitted instructions into a superinstruction that
+// also does the work of op, returns false if no pattern matched
+static bool fuseOp(struct Parser* parser, enum OpCode op) {
+  struct Chunk* chunk = &parser->compiling;
+  size_t last = recentOp(parser, 0), beforeLast = recentOp(parser, 1);
+
+  switch (op) {
+    case OP_ADD:
+      // READ x; CONSTANT k; ADD -> READ_CONST_ADD x k
+      if (lastOpIs(parser, last, OP_CONSTANT) &&
+          lastOpIs(parser, beforeLast, OP_READ)) {
+        chunk->code[beforeLast] = OP_READ_CONST_ADD;
+        chunk->code[beforeLast + 2] = chunk->code[last + 1];
+        chunk->length--;
+
+        parser->nRecentOps--;
+        return true;
+      }
+      break;
+    case OP_DECLARE:
+      // CONSTANT k; DECLARE x t -> CONST_DECLARE k x t, operands follow
+      if (lastOpIs(parser, last, OP_CONSTANT)) {
+        chunk->code[last] = OP_CONST_DECLARE;
+        return true;
+      }
+      break;
+    default:;
+  }
+
+  return false;
+}
+#endif
+
+static void emitOp(struct Parser* parser, enum OpCode op) {
+#ifndef NO_CONSTANT_FOLDING
+  if ((parser->passes & PASS_FOLD) && foldOp(parser, op))
+    return;
+#endif
+
+#ifndef NO_SUPERINSTRUCTIONS
+  if (fuseOp(parser, op))
+    return;
+#endif
+
+  pushRecentOp(parser, parser->compiling.length);
+  emitByte(parser, op);
+}
+
+static const struct {
+  const char* name;
+  enum Pass pass;
+} passNames[] = {
+    {"fold", PASS_FOLD},
+    {"cse", PASS_CSE},
+    {"dse", PASS_DSE},
+    {"peephole", PASS_PEEPHOLE},
+};
+
+unsigned optLevelPasses(int level) {
+  if (level <= 0) {
+    return 0;
+  } else if (level == 1) {
+    return PASS_FOLD | PASS_PEEPHOLE;
+  }
+
+  return PASS_FOLD | PASS_CSE | PASS_DSE | PASS_PEEPHOLE;
+}
+
+bool parsePasses(const char* list, unsigned* passes) {
+  *passes = 0;
+
+  while (*list != '\0') {
+    size_t length = strcspn(list, ",");
+    bool known = false;
+
+    for (size_t i = 0; i < sizeof(passNames) / sizeof(passNames[0]); i++) {
+      if (strlen(passNames[i].name) == length &&
+          memcmp(passNames[i].name, list, length) == 0) {
+        *passes |= passNames[i].pass;
+        known = true;
+      }
+    }
+
+    if (!known)
+      return false;
+
+    list += length;
+    if (*list == ',')
+      list++;
+  }
+
+  return true;
+}
+
+void initGlobalNames(struct GlobalNames* globals, struct Allocator* allocator) {
+  globals->allocator = allocator;
+
+  initMap(&globals->slots);
+  globals->slots.allocator = allocator;
+
+  globals->names.strings = NULL;
+  globals->names.length = 0;
+  globals->names.size = 0;
+
+  globals->functions = NULL;
+  globals->functionsSize = 0;
+  globals->functionsLength = 0;
+}
+
+void deinitGlobalNames(struct GlobalNames* globals) {
+  struct Allocator* allocator = globals->allocator;
+
+  freeWith(allocator, MEMORY_STRINGS, globals->names.strings,
+           globals->names.size, sizeof(struct String));
+
+  for (size_t i = 0; i < globals->functionsLength; i++) {
+    freeFunction(globals->functions[i]);
+  }
+  freeWith(allocator, MEMORY_FUNCTIONS, globals->functions,
+           globals->functionsSize, sizeof(struct Function*));
+
+  deinitMap(&globals->slots);
+  initGlobalNames(globals, allocator);
+}
+
+// slot of a global variable, assigning the next free one on first use
+static size_t resolveGlobal(struct Parser* parser, struct Token name) {
+  struct GlobalNames* globals = parser->globals;
+  const struct Symbol* symbol = intern(name.start, name.length);
+
+  struct Entry* entry = getMap(&globals->slots, symbol);
+  if (entry != NULL) {
+    return entry->slot;
+  }
+
+  struct StringArray* names = &globals->names;
+  if (names->length >= names->size) {
+    size_t previousSize = names->size;
+    names->size = nextArraySize(previousSize);
+    names->strings =
+        reallocateWith(globals->allocator, MEMORY_STRINGS, names->strings,
+                       names->size, previousSize, sizeof(struct String));
+  }
+
+  // the symbol outlives the source, which may be unmapped after compiling
+  names->strings[names->length] = symbol->string;
 
-// duplicate and add a string to the chunk
-static void emitString(struct Parser* parser, const char* string,
-                       size_t length) {
-  struct String str = {
-      .str = duplicateString(string, length),
-      .length = length,
+  struct Entry newEntry = {
+      .key = symbol,
+      .slot = names->length,
   };
+  setMap(&globals->slots, &newEntry);
 
-  emitByte(parser, addString(&parser->compiling, str));
+  return names->length++;
 }
 
-static void expr(struct Parser* parser);
+static bool sameName(struct Token a, struct Token b) {
+  return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
+}
+
+// slot of the innermost local with the name, NO_LOCAL if it is a global
+static size_t resolveLocal(struct Parser* parser, struct Token name) {
+  struct Scope* scope = parser->scope;
+  for (size_t i = scope->localsLength; i > 0; i--) {
+    if (sameName(scope->locals[i - 1].name, name)) {
+      return i - 1;
+    }
+  }
+
+  // the frame of the enclosing code may be gone when the function runs
+  for (scope = scope->enclosing; scope != NULL; scope = scope->enclosing) {
+    for (size_t i = 0; i < scope->localsLength; i++) {
+      if (sameName(scope->locals[i].name, name)) {
+        parseError(parser, name,
+                   "functions cannot use locals of the enclosing code");
+        return NO_LOCAL;
+      }
+    }
+  }
+
+  return NO_LOCAL;
+}
+
+// reports a value that is known not to have the type it needs
+static void checkType(struct Parser* parser, struct Token token,
+                      enum ValueType expected, enum ValueType type) {
+  if (expected == VALUE_NONE || type == VALUE_NONE || expected == type)
+    return;
+
+  char error[64];
+  snprintf(error, sizeof(error), "expected type '%s' but got '%s'",
+           valueTypeStr(expected), valueTypeStr(type));
+  parseError(parser, token, error);
+}
+
+// emits op with a one byte operand, or longOp with a 24 bit one if it does not
+// fit
+static void emitIndexed(struct Parser* parser, enum OpCode op,
+                        enum OpCode longOp, size_t index) {
+  if (index <= UINT8_MAX) {
+    emitOp(parser, op);
+    emitByte(parser, index);
+  } else if (index <= MAX_LONG_OPERAND) {
+    emitOp(parser, longOp);
+    emitByte(parser, index & 0xff);
+    emitByte(parser, (index >> 8) & 0xff);
+    emitByte(parser, (index >> 16) & 0xff);
+  } else {
+    parseError(parser, parser->previous,
+               "too many constants or variables in one chunk");
+  }
+}
+
+static void emitConstant(struct Parser* parser, struct Value value) {
+  emitIndexed(parser, OP_CONSTANT, OP_CONSTANT_LONG,
+              addConstant(&parser->compiling, value));
+}
+
+static struct GlobalInfo* globalInfo(struct Parser* parser, size_t slot) {
+  if (slot >= parser->globalInfoSize) {
+    size_t previousSize = parser->globalInfoSize;
+    while (parser->globalInfoSize <= slot) {
+      parser->globalInfoSize = nextArraySize(parser->globalInfoSize);
+    }
+
+    parser->globalInfo =
+        arenaReallocate(&parser->arena, parser->globalInfo,
+                        parser->globalInfoSize, previousSize,
+                        sizeof(struct GlobalInfo));
+
+    for (size_t i = previousSize; i < parser->globalInfoSize; i++) {
+      parser->globalInfo[i] = (struct GlobalInfo){false, NONE_VALUE};
+    }
+  }
 
-static void atomExpr(struct Parser* parser) {
+  return &parser->globalInfo[slot];
+}
+
+static size_t expr(struct Parser* parser);
+static size_t function(struct Parser* parser, struct Token name);
+
+static size_t constantNode(struct Parser* parser, struct Value value) {
+  struct Node node = makeNode(NODE_CONSTANT, parser->previous);
+  node.as.value = value;
+  return addNode(&parser->ir, node);
+}
+
+// unary if left is NO_NODE
+static size_t operatorNode(struct Parser* parser, struct Token op,
+                           enum OpCode code, size_t left, size_t right) {
+  struct Node node = makeNode(left == NO_NODE ? NODE_UNARY : NODE_BINARY, op);
+  node.op = code;
+  node.left = left;
+  node.right = right;
+  return addNode(&parser->ir, node);
+}
+
+// the source is not terminated, so strtod reads a copy of the literal
+static double parseNumber(struct Parser* parser, struct Token token) {
+  char buffer[64];
+  char* literal = buffer;
+  if (token.length >= sizeof(buffer)) {
+    literal = arenaAllocate(&parser->arena, token.length + 1);
+  }
+
+  memcpy(literal, token.start, token.length);
+  literal[token.length] = '\0';
+  return strtod(literal, NULL);
+}
+
+static size_t atomExpr(struct Parser* parser) {
   if (match(parser, TOKEN_NUMBER)) {
-    double number = strtod(parser->previous.start, NULL);
-    struct Value value = NUMBER_VALUE(number);
-    emitByte(parser, OP_CONSTANT);
-    emitByte(parser, addConstant(&parser->compiling, value));
+    double number = parseNumber(parser, parser->previous);
+    return constantNode(parser, NUMBER_VALUE(number));
   } else if (match(parser, TOKEN_TRUE) || match(parser, TOKEN_FALSE)) {
     bool value = parser->previous.type == TOKEN_TRUE ? true : false;
-    emitByte(parser, OP_CONSTANT);
-    emitByte(parser, addConstant(&parser->compiling, BOOL_VALUE(value)));
+    return constantNode(parser, BOOL_VALUE(value));
   } else if (match(parser, TOKEN_LPAREN)) { // grouping expr
-    expr(parser);
+    size_t node = expr(parser);
     consume(parser, TOKEN_RPAREN, "expected ')'");
+    return node;
   } else if (match(parser, TOKEN_IDENTIFIER)) {
-    struct Token identifier = parser->previous;
-    emitByte(parser, OP_READ);
-    emitString(parser, identifier.start, identifier.length);
-  } else {
-    parseError(parser, parser->current, "expected expression");
+    struct Node node = makeNode(NODE_READ, parser->previous);
+    size_t local = resolveLocal(parser, parser->previous);
+
+    if (local == NO_LOCAL) {
+      node.slot = resolveGlobal(parser, parser->previous);
+    } else {
+      node.type = NODE_LOCAL;
+      node.slot = local;
+      node.valueType = parser->scope->locals[local].type;
+    }
+
+    return addNode(&parser->ir, node);
+  } else if (match(parser, TOKEN_FN)) { // anonymous function
+    return function(parser, (struct Token){.start = "", .length = 0});
   }
+
+  parseError(parser, parser->current, "expected expression");
+  return NO_NODE;
+}
+
+static size_t callExpr(struct Parser* parser) {
+  size_t node = atomExpr(parser);
+
+  while (match(parser, TOKEN_LPAREN)) {
+    struct Node call = makeNode(NODE_CALL, parser->previous);
+    call.op = OP_CALL;
+    call.left = node;
+    call.slot = 0;
+
+    // the arguments are chained through their right, in evaluation order
+    size_t last = NO_NODE;
+    if (!check(parser, TOKEN_RPAREN)) {
+      do {
+        struct Node arg = makeNode(NODE_ARG, parser->current);
+        arg.left = expr(parser);
+        size_t index = addNode(&parser->ir, arg);
+
+        if (last == NO_NODE) {
+          call.right = index;
+        } else {
+          parser->ir.nodes[last].right = index;
+        }
+        last = index;
+
+        if (++call.slot > UINT8_MAX) {
+          parseError(parser, parser->previous, "too many arguments");
+        }
+      } while (match(parser, TOKEN_COMMA));
+    }
+
+    consume(parser, TOKEN_RPAREN, "expected ')' after arguments");
+    node = addNode(&parser->ir, call);
+  }
+
+  return node;
 }
 
-static void unaryExpr(struct Parser* parser) {
+static size_t unaryExpr(struct Parser* parser) {
   if (match(parser, TOKEN_PLUS) || match(parser, TOKEN_MINUS) ||
       match(parser, TOKEN_NOT)) {
     struct Token op = parser->previous;
-    unaryExpr(parser);
+    size_t operand = unaryExpr(parser);
 
     // no special opcode for TOKEN_PLUS
     if (op.type == TOKEN_MINUS) {
-      emitByte(parser, OP_NEGATE);
+      return operatorNode(parser, op, OP_NEGATE, NO_NODE, operand);
     } else if (op.type == TOKEN_NOT) {
-      emitByte(parser, OP_NOT);
+      return operatorNode(parser, op, OP_NOT, NO_NODE, operand);
     }
-  } else {
-    atomExpr(parser);
+
+    return operand;
   }
+
+  return callExpr(parser);
 }
 
-static void multiplicativeExpr(struct Parser* parser) {
-  unaryExpr(parser);
+static size_t multiplicativeExpr(struct Parser* parser) {
+  size_t node = unaryExpr(parser);
 
   while (match(parser, TOKEN_STAR) || match(parser, TOKEN_SLASH)) {
-    enum OpCode code =
-        parser->previous.type == TOKEN_STAR ? OP_MULTIPLY : OP_DIVIDE;
-    unaryExpr(parser);
-    emitByte(parser, code);
+    struct Token op = parser->previous;
+    enum OpCode code = op.type == TOKEN_STAR ? OP_MULTIPLY : OP_DIVIDE;
+    size_t right = unaryExpr(parser);
+    node = operatorNode(parser, op, code, node, right);
   }
+
+  return node;
 }
 
-static void additiveExpr(struct Parser* parser) {
-  multiplicativeExpr(parser);
+static size_t additiveExpr(struct Parser* parser) {
+  size_t node = multiplicativeExpr(parser);
 
   while (match(parser, TOKEN_PLUS) || match(parser, TOKEN_MINUS)) {
-    enum OpCode code =
-        parser->previous.type == TOKEN_PLUS ? OP_ADD : OP_SUBTRACT;
-    multiplicativeExpr(parser);
-    emitByte(parser, code);
+    struct Token op = parser->previous;
+    enum OpCode code = op.type == TOKEN_PLUS ? OP_ADD : OP_SUBTRACT;
+    size_t right = multiplicativeExpr(parser);
+    node = operatorNode(parser, op, code, node, right);
   }
+
+  return node;
 }
 
-static void comparisonExpr(struct Parser* parser) {
-  additiveExpr(parser);
+static size_t comparisonExpr(struct Parser* parser) {
+  size_t node = additiveExpr(parser);
 
   while (match(parser, TOKEN_GREATER) || match(parser, TOKEN_GREATER_EQUALS) ||
          match(parser, TOKEN_LESSER) || match(parser, TOKEN_LESSER_EQUALS)) {
     struct Token op = parser->previous;
-
-    additiveExpr(parser);
+    enum OpCode code = OP_GREATER;
 
     switch (op.type) {
       case TOKEN_GREATER:
-        emitByte(parser, OP_GREATER);
+        code = OP_GREATER;
         break;
       case TOKEN_GREATER_EQUALS:
-        emitByte(parser, OP_GREATER_EQUAL);
+        code = OP_GREATER_EQUAL;
         break;
       case TOKEN_LESSER:
-        emitByte(parser, OP_LESSER);
+        code = OP_LESSER;
         break;
       case TOKEN_LESSER_EQUALS:
-        emitByte(parser, OP_LESSER_EQUAL);
+        code = OP_LESSER_EQUAL;
         break;
       default:; // unreachable
     }
+
+    size_t right = additiveExpr(parser);
+    node = operatorNode(parser, op, code, node, right);
   }
+
+  return node;
 }
 
-static void equalityExpr(struct Parser* parser) {
-  comparisonExpr(parser);
+static size_t equalityExpr(struct Parser* parser) {
+  size_t node = comparisonExpr(parser);
 
   while (match(parser, TOKEN_EQUALS_EQUALS) ||
          match(parser, TOKEN_NOT_EQUALS)) {
+    struct Token op = parser->previous;
     enum OpCode code =
-        parser->previous.type == TOKEN_EQUALS_EQUALS ? OP_EQUAL : OP_NOT_EQUAL;
-    comparisonExpr(parser);
-    emitByte(parser, code);
+        op.type == TOKEN_EQUALS_EQUALS ? OP_EQUAL : OP_NOT_EQUAL;
+    size_t right = comparisonExpr(parser);
+    node = operatorNode(parser, op, code, node, right);
   }
+
+  return node;
 }
 
-static void andExpr(struct Parser* parser) {
-  equalityExpr(parser);
+static size_t andExpr(struct Parser* parser) {
+  size_t node = equalityExpr(parser);
 
   while (match(parser, TOKEN_AND)) {
-    equalityExpr(parser);
-    emitByte(parser, OP_AND);
+    struct Token op = parser->previous;
+    size_t right = equalityExpr(parser);
+    node = operatorNode(parser, op, OP_AND, node, right);
   }
+
+  return node;
 }
 
-static void orExpr(struct Parser* parser) {
-  andExpr(parser);
+static size_t orExpr(struct Parser* parser) {
+  size_t node = andExpr(parser);
 
   while (match(parser, TOKEN_OR)) {
-    andExpr(parser);
-    emitByte(parser, OP_OR);
+    struct Token op = parser->previous;
+    size_t right = andExpr(parser);
+    node = operatorNode(parser, op, OP_OR, node, right);
   }
+
+  return node;
 }
 
-static void assignmentExpr(struct Parser* parser) {
-  orExpr(parser);
+static size_t assignmentExpr(struct Parser* parser) {
+  size_t node = orExpr(parser);
 
   struct Token last = parser->previous;
   while (match(parser, TOKEN_EQUALS)) {
@@ -246,15 +774,35 @@ static void assignmentExpr(struct Parser* parser) {
       parseError(parser, last, "not a valid assignment target");
     }
 
-    orExpr(parser);
-    emitByte(parser, OP_ASSIGN);
-    emitString(parser, last.start, last.length);
+    // the target was parsed as part of the left side, whose value is what the
+    // assignment evaluates to
+    struct Node assign = makeNode(NODE_ASSIGN, last);
+    assign.left = node;
+    assign.right = orExpr(parser);
+    size_t local = resolveLocal(parser, last);
+
+    if (local == NO_LOCAL) {
+      assign.slot = resolveGlobal(parser, last);
+    } else {
+      assign.type = NODE_SET_LOCAL;
+      assign.slot = local;
+      assign.valueType = parser->scope->locals[local].type;
+      checkType(parser, last, assign.valueType,
+                inferType(&parser->ir, assign.right));
+    }
+
+    node = addNode(&parser->ir, assign);
   }
+
+  return node;
 }
 
-static void expr(struct Parser* parser) { assignmentExpr(parser); }
+static size_t expr(struct Parser* parser) { return assignmentExpr(parser); }
 
 static void consumeStatementTerminator(struct Parser* parser) {
+  // the last statement of a block can end at its brace
+  if (parser->depth > 0 && check(parser, TOKEN_RBRACE))
+    return;
 
   enum TokenType statementTerminators[] = {TOKEN_NEWLINE, TOKEN_EOF,
                                            TOKEN_SEMICOLON};
@@ -269,58 +817,265 @@ static enum ValueType valueTypeFromToken(struct Token t) {
     return VALUE_NUMBER;
   } else if (t.length == 4 && memcmp(t.start, "Bool", t.length) == 0) {
     return VALUE_BOOL;
+  } else if (t.length == 8 && memcmp(t.start, "Function", t.length) == 0) {
+    return VALUE_FUNCTION;
   }
 
   return VALUE_NONE;
 }
 
-static void declStmt(struct Parser* parser) {
-  consume(parser, TOKEN_IDENTIFIER, "expected an identifier after 'let'");
+// declares a local of the innermost block, whose slot is the next one on the
+// stack since statements leave nothing else on it
+static void declareLocal(struct Parser* parser, struct Node* node) {
+  struct Token name = {.start = node->as.name.str,
+                       .length = node->as.name.length,
+                       .line = node->line};
+  struct Scope* scope = parser->scope;
+  for (size_t i = scope->localsLength; i > 0; i--) {
+    struct Local* local = &scope->locals[i - 1];
+    if (local->depth < parser->depth)
+      break;
+
+    if (sameName(local->name, name)) {
+      parseError(parser, name, "redeclaration of local variable");
+      return;
+    }
+  }
+
+  if (scope->localsLength == MAX_LOCALS) {
+    parseError(parser, name, "too many local variables");
+    return;
+  }
+
+  // an unannotated local has the type of its initial value
+  enum ValueType type = node->right == NO_NODE
+                            ? node->valueType
+                            : inferType(&parser->ir, node->right);
+  checkType(parser, name, node->valueType, type);
 
-  struct Token identifier = parser->previous;
-  struct String str = {
-      .length = identifier.length,
-      .str = duplicateString(identifier.start, identifier.length),
+  scope->locals[scope->localsLength++] = (struct Local){
+      .name = name,
+      .depth = parser->depth,
+      .type = node->valueType != VALUE_NONE ? node->valueType : type,
   };
+}
 
-  size_t i = addString(&parser->compiling, str);
+static size_t declStmt(struct Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "expected an identifier after 'let'");
 
-  enum ValueType type = VALUE_NONE;
+  struct Node node = makeNode(NODE_DECLARE, parser->previous);
+  if (parser->depth > 0) {
+    node.type = NODE_DECLARE_LOCAL;
+  } else {
+    node.slot = resolveGlobal(parser, parser->previous);
+  }
 
   if (match(parser, TOKEN_IDENTIFIER)) {
-    type = valueTypeFromToken(parser->previous);
+    node.valueType = valueTypeFromToken(parser->previous);
 
-    if (type == VALUE_NONE) {
+    if (node.valueType == VALUE_NONE) {
       parseError(parser, parser->previous, "unknown type");
     }
   }
 
   consume(parser, TOKEN_EQUALS, "expected '=' after declaration");
-  expr(parser);
-
-  emitByte(parser, OP_DECLARE);
-  emitByte(parser, i);
-  emitByte(parser, type);
 
+  // the initial value cannot see the local yet
+  node.right = expr(parser);
   consumeStatementTerminator(parser);
+
+  if (node.type == NODE_DECLARE_LOCAL && !parser->panic) {
+    declareLocal(parser, &node);
+  }
+
+  return addNode(&parser->ir, node);
 }
 
-static void exprStmt(struct Parser* parser) {
-  expr(parser);
+static size_t exprStmt(struct Parser* parser) {
+  struct Node node = makeNode(NODE_EXPR, parser->current);
+
+  node.right = expr(parser);
   consumeStatementTerminator(parser);
-  if (parser->repl && parser->emitPrint) {
-    emitByte(parser, OP_PRINT);
+  node.print = parser->repl && parser->emitPrint && parser->depth == 0;
+
+  return addNode(&parser->ir, node);
+}
+
+static size_t stmt(struct Parser* parser);
+
+static size_t block(struct Parser* parser) {
+  consume(parser, TOKEN_LBRACE, "expected '{' before block");
+
+  struct Node node = makeNode(NODE_BLOCK, parser->previous);
+  size_t last = NO_NODE;
+
+  parser->depth++;
+  while (!check(parser, TOKEN_RBRACE) && !atEnd(parser) && !parser->panic) {
+    size_t statement = stmt(parser);
+    if (statement == NO_NODE)
+      continue;
+
+    if (last == NO_NODE) {
+      node.body = statement;
+    } else {
+      parser->ir.nodes[last].next = statement;
+    }
+    last = statement;
+  }
+  parser->depth--;
+
+  // the locals of the block go out of scope
+  struct Scope* scope = parser->scope;
+  while (scope->localsLength > 0 &&
+         scope->locals[scope->localsLength - 1].depth > parser->depth) {
+    scope->localsLength--;
+    node.locals++;
+  }
+
+  consume(parser, TOKEN_RBRACE, "expected '}' after block");
+
+  return addNode(&parser->ir, node);
+}
+
+static size_t ifStmt(struct Parser* parser) {
+  struct Node node = makeNode(NODE_IF, parser->previous);
+
+  node.left = expr(parser);
+  node.body = block(parser);
+
+  if (match(parser, TOKEN_ELSE)) {
+    node.orElse = match(parser, TOKEN_IF) ? ifStmt(parser) : block(parser);
+  }
+
+  return addNode(&parser->ir, node);
+}
+
+// parses the parameters and body of a function after 'fn' and its name
+static size_t function(struct Parser* parser, struct Token name) {
+  struct Node node = makeNode(NODE_FUNCTION, name);
+  node.slot = 0;
+
+  // the function runs in its own frame, whose first locals are the arguments
+  struct Scope scope = {.localsLength = 0, .enclosing = parser->scope};
+  parser->scope = &scope;
+  parser->depth++;
+
+  // what the body assigns does not decide whether the statement prints
+  bool emitPrint = parser->emitPrint;
+
+  consume(parser, TOKEN_LPAREN, "expected '(' before parameters");
+  size_t last = NO_NODE;
+  if (!check(parser, TOKEN_RPAREN)) {
+    do {
+      consume(parser, TOKEN_IDENTIFIER, "expected a parameter name");
+
+      struct Node param = makeNode(NODE_DECLARE_LOCAL, parser->previous);
+      param.slot = node.slot;
+      if (match(parser, TOKEN_IDENTIFIER)) {
+        param.valueType = valueTypeFromToken(parser->previous);
+
+        if (param.valueType == VALUE_NONE) {
+          parseError(parser, parser->previous, "unknown type");
+        }
+      }
+
+      if (!parser->panic)
+        declareLocal(parser, &param);
+
+      size_t index = addNode(&parser->ir, param);
+      if (last == NO_NODE) {
+        node.left = index;
+      } else {
+        parser->ir.nodes[last].next = index;
+      }
+      last = index;
+
+      if (++node.slot > UINT8_MAX) {
+        parseError(parser, parser->previous, "too many parameters");
+      }
+    } while (match(parser, TOKEN_COMMA) && !parser->panic);
   }
-  emitByte(parser, OP_POP);
+  consume(parser, TOKEN_RPAREN, "expected ')' after parameters");
+
+  // the parameters are not dropped with the locals of the body
+  node.body = block(parser);
+
+  parser->emitPrint = emitPrint;
+  parser->depth--;
+  parser->scope = scope.enclosing;
+
+  return addNode(&parser->ir, node);
 }
 
-static void stmt(struct Parser* parser) {
+// a named function is declared like a variable holding it
+static size_t fnStmt(struct Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "expected an identifier after 'fn'");
+
+  struct Token name = parser->previous;
+  struct Node node = makeNode(NODE_DECLARE, name);
+  if (parser->depth > 0) {
+    node.type = NODE_DECLARE_LOCAL;
+  } else {
+    node.slot = resolveGlobal(parser, parser->previous);
+  }
+
+  node.right = function(parser, name);
+
+  // a local function cannot call itself by name, its body cannot see locals
+  if (node.type == NODE_DECLARE_LOCAL && !parser->panic) {
+    declareLocal(parser, &node);
+  }
+
+  return addNode(&parser->ir, node);
+}
+
+static size_t returnStmt(struct Parser* parser) {
+  struct Node node = makeNode(NODE_RETURN, parser->previous);
+
+  if (parser->scope->enclosing == NULL) {
+    parseError(parser, parser->previous, "return outside of a function");
+  }
+
+  if (!check(parser, TOKEN_NEWLINE) && !check(parser, TOKEN_SEMICOLON) &&
+      !check(parser, TOKEN_RBRACE) && !atEnd(parser)) {
+    node.right = expr(parser);
+
+    // nothing of the frame is needed after the call, so it can be replaced
+    if (node.right != NO_NODE && parser->ir.nodes[node.right].type == NODE_CALL)
+      parser->ir.nodes[node.right].op = OP_TAIL_CALL;
+  }
+  consumeStatementTerminator(parser);
+
+  return addNode(&parser->ir, node);
+}
+
+static size_t whileStmt(struct Parser* parser) {
+  struct Node node = makeNode(NODE_WHILE, parser->previous);
+
+  node.left = expr(parser);
+  node.body = block(parser);
+
+  return addNode(&parser->ir, node);
+}
+
+// NO_NODE for an empty statement
+static size_t stmt(struct Parser* parser) {
   if (match(parser, TOKEN_SEMICOLON) || match(parser, TOKEN_NEWLINE)) {
-    // do nothing
+    return NO_NODE;
   } else if (match(parser, TOKEN_LET)) {
-    declStmt(parser);
+    return declStmt(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    return ifStmt(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    return whileStmt(parser);
+  } else if (match(parser, TOKEN_FN)) {
+    return fnStmt(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    return returnStmt(parser);
+  } else if (check(parser, TOKEN_LBRACE)) {
+    return block(parser);
   } else {
-    exprStmt(parser);
+    return exprStmt(parser);
   }
 }
 
@@ -339,27 +1094,497 @@ static void synchronize(struct Parser* parser) {
   }
 }
 
+// whether an enabled pass has to see every statement of the unit before the
+// first one is lowered
+static bool wholeUnit(struct Parser* parser) {
+#ifndef NO_CONSTANT_FOLDING
+  // a constant let is only propagated if no later statement assigns it
+  if (parser->passes & PASS_FOLD)
+    return true;
+#endif
+
+  return (parser->passes & PASS_DSE) && !parser->repl;
+}
+
+static void lowerStatement(struct Parser* parser, size_t index);
+
+// lowers a statement as soon as it is parsed, so that the ir never holds more
+// than one. nothing is lowered after an error
+static void lowerParsed(struct Parser* parser, size_t statement) {
+  if (statement != NO_NODE && !parser->hadError) {
+    struct Token previous = parser->previous;
+    lowerStatement(parser, statement);
+    parser->previous = previous;
+
+    // keep parsing to report the syntax errors after it as well
+    parser->panic = false;
+  }
+
+  resetIr(&parser->ir);
+}
+
 static void program(struct Parser* parser) {
   advance(parser);
+  bool streamed = !wholeUnit(parser);
 
   while (!atEnd(parser)) {
-    stmt(parser);
+    if (parser->batch && parser->previous.type == TOKEN_NEWLINE)
+      parser->emitPrint = true;
+
+    size_t statement = stmt(parser);
 
-    if (parser->panic)
+    if (parser->panic) {
       synchronize(parser);
+    } else if (!streamed && statement != NO_NODE) {
+      addStatement(&parser->ir, statement);
+    }
+
+    if (streamed) {
+      lowerParsed(parser, statement);
+    }
+  }
+}
+
+#ifndef NO_CONSTANT_FOLDING
+// marks every global that is the target of an assignment in the unit, so that
+// constant lets can be propagated when the variable never changes
+static void findAssignments(struct Parser* parser) {
+  for (size_t i = 0; i < parser->ir.length; i++) {
+    struct Node* node = &parser->ir.nodes[i];
+
+    if (node->type == NODE_ASSIGN) {
+      globalInfo(parser, node->slot)->assigned = true;
+    }
+  }
+}
+
+// replaces reads of globals that are known to hold a constant by the constant
+static void propagateConstants(struct Parser* parser, size_t index) {
+  if (index == NO_NODE)
+    return;
+
+  struct Node* node = &parser->ir.nodes[index];
+
+  if (node->type == NODE_READ) {
+    struct Value known = globalInfo(parser, node->slot)->value;
+
+    if (!IS_NONE(known)) {
+      node->type = NODE_CONSTANT;
+      node->as.value = known;
+    }
+  }
+
+  propagateConstants(parser, node->left);
+  propagateConstants(parser, node->right);
+}
+#endif
+
+// marks the current offset as a jump target. what was emitted before it can
+// be reached from elsewhere, so nothing after it is folded or fused with it
+static size_t label(struct Parser* parser) {
+  parser->nRecentOps = 0;
+  return parser->compiling.length;
+}
+
+static void setJump(struct Parser* parser, size_t offset, size_t target) {
+  size_t end = offset + instructionLength(&parser->compiling.code[offset]);
+  size_t distance = target > end ? target - end : end - target;
+
+  if (distance > MAX_JUMP) {
+    parseError(parser, parser->previous, "too much code to jump over");
+  }
+
+  setJumpTarget(parser->compiling.code, offset, target);
+}
+
+// emits a forward jump whose target is set later by patchJump
+static size_t emitJump(struct Parser* parser, enum OpCode op) {
+  size_t offset = parser->compiling.length;
+
+  emitOp(parser, op);
+  emitByte(parser, 0);
+  emitByte(parser, 0);
+
+  return offset;
+}
+
+static void patchJump(struct Parser* parser, size_t offset) {
+  setJump(parser, offset, label(parser));
+}
+
+static void emitLoop(struct Parser* parser, size_t target) {
+  size_t offset = parser->compiling.length;
+
+  emitOp(parser, OP_LOOP_IF_TRUE);
+  emitByte(parser, 0);
+  emitByte(parser, 0);
+
+  setJump(parser, offset, target);
+}
+
+static void lowerNode(struct Parser* parser, size_t index);
+
+// the right operand of 'and' / 'or' only runs if the left one does not decide
+// the result
+static void lowerShortCircuit(struct Parser* parser, struct Node* node) {
+  size_t start = parser->compiling.length;
+  lowerNode(parser, node->left);
+  parser->previous.line = node->line;
+
+#ifdef NO_CONSTANT_FOLDING
+  (void)start;
+#else
+  // a constant left operand decides the result at compile time, or leaves the
+  // plain operator to check the type of the right one
+  struct Value value;
+  if ((parser->passes & PASS_FOLD) && recentOp(parser, 0) == start &&
+      constantAt(parser, start, &value) && IS_BOOL(value)) {
+    if (AS_BOOL(value) == (node->op == OP_OR))
+      return;
+
+    lowerNode(parser, node->right);
+    parser->previous.line = node->line;
+    emitOp(parser, node->op);
+    return;
+  }
+#endif
+
+  size_t skip =
+      emitJump(parser, node->op == OP_AND ? OP_SHORT_AND : OP_SHORT_OR);
+  lowerNode(parser, node->right);
+  parser->previous.line = node->line;
+  emitOp(parser, node->op);
+  patchJump(parser, skip);
+}
+
+// checks at runtime that the value has the type, unless the compiler could
+// prove that already
+static void emitTypeCheck(struct Parser* parser, enum ValueType type,
+                          size_t value) {
+  if (type != VALUE_NONE && inferType(&parser->ir, value) != type) {
+    emitOp(parser, OP_CHECK_TYPE);
+    emitByte(parser, type);
+  }
+}
+
+static void emitSetLocal(struct Parser* parser, struct Node* node) {
+  if (node->valueType == VALUE_NONE) {
+    emitOp(parser, OP_SET_LOCAL_CHECKED);
+  } else {
+    emitTypeCheck(parser, node->valueType, node->right);
+    emitOp(parser, OP_SET_LOCAL);
+  }
+  emitByte(parser, node->slot);
+}
+
+static void lowerOperation(struct Parser* parser, struct Node* node) {
+  size_t start = parser->compiling.length;
+
+  // a statement that only assigns a local does not need its old value, and
+  // reading a local cannot fail
+  if (node->type == NODE_EXPR && !node->print &&
+      parser->ir.nodes[node->right].type == NODE_SET_LOCAL) {
+    struct Node* assign = &parser->ir.nodes[node->right];
+
+    lowerNode(parser, assign->right);
+    parser->previous.line = assign->line;
+    emitSetLocal(parser, assign);
+    return;
+  }
+
+  // operands in evaluation order
+  if (node->left != NO_NODE)
+    lowerNode(parser, node->left);
+  if (node->right != NO_NODE)
+    lowerNode(parser, node->right);
+
+  // errors while emitting point at the node
+  parser->previous.line = node->line;
+
+  switch (node->type) {
+    case NODE_CONSTANT:
+      emitConstant(parser, node->as.value);
+      break;
+    case NODE_READ:
+      emitIndexed(parser, OP_READ, OP_READ_LONG, node->slot);
+      break;
+    case NODE_UNARY:
+    case NODE_BINARY:
+      emitOp(parser, node->op);
+      break;
+    case NODE_ASSIGN:
+      emitIndexed(parser, OP_ASSIGN, OP_ASSIGN_LONG, node->slot);
+      break;
+    case NODE_TEMP:
+      break; // handled by lowerNode
+    case NODE_LOCAL:
+      emitOp(parser, OP_GET_LOCAL);
+      emitByte(parser, node->slot);
+      break;
+    case NODE_SET_LOCAL:
+      emitSetLocal(parser, node);
+      break;
+    case NODE_DECLARE_LOCAL: // the value stays where it is
+      emitTypeCheck(parser, node->valueType, node->right);
+      break;
+    case NODE_DECLARE: {
+      struct GlobalInfo* info = globalInfo(parser, node->slot);
+      info->value = NONE_VALUE;
+
+#ifdef NO_CONSTANT_FOLDING
+      (void)start;
+#else
+      // reads after this point see the value directly, unless the declaration
+      // is going to fail at runtime anyway
+      struct Value value;
+      if ((parser->passes & PASS_FOLD) && !info->assigned &&
+          parser->depth == 0 && recentOp(parser, 0) == start &&
+          constantAt(parser, start, &value) &&
+          (node->valueType == VALUE_NONE ||
+           node->valueType == VALUE_TYPE(value))) {
+        info->value = value;
+      }
+#endif
+
+      emitIndexed(parser, OP_DECLARE, OP_DECLARE_LONG, node->slot);
+      emitByte(parser, node->valueType);
+      break;
+    }
+    case NODE_CALL:
+      emitOp(parser, node->op);
+      emitByte(parser, node->slot);
+      break;
+    case NODE_ARG: // the value stays where it is
+      break;
+    case NODE_EXPR:
+      if (node->print) {
+        emitOp(parser, OP_PRINT);
+      }
+      emitOp(parser, OP_POP);
+      break;
+    case NODE_FUNCTION: // handled by lowerNode
+    case NODE_BLOCK:
+    case NODE_IF:
+    case NODE_WHILE:
+    case NODE_RETURN:
+      break; // lowered by lowerStatement
+  }
+}
+
+static void registerFunction(struct Parser* parser, struct Function* function) {
+  struct GlobalNames* globals = parser->globals;
+
+  if (globals->functionsLength >= globals->functionsSize) {
+    size_t previousSize = globals->functionsSize;
+    globals->functionsSize = nextArraySize(previousSize);
+    globals->functions = reallocateWith(
+        globals->allocator, MEMORY_FUNCTIONS, globals->functions,
+        globals->functionsSize, previousSize, sizeof(struct Function*));
+  }
+
+  globals->functions[globals->functionsLength++] = function;
+}
+
+// lowers the body into the chunk of a new function, which the enclosing code
+// pushes as a constant
+static void lowerFunction(struct Parser* parser, struct Node* node) {
+  struct String name = node->as.name;
+  struct Function* function =
+      newFunction(parser->globals->allocator, name, node->slot);
+  registerFunction(parser, function);
+
+  // the enclosing chunk continues where it stopped afterwards
+  struct Chunk enclosing = parser->compiling;
+  struct Function* enclosingFunction = parser->function;
+  size_t recentOps[MAX_RECENT_OPS];
+  size_t nRecentOps = parser->nRecentOps;
+  memcpy(recentOps, parser->recentOps, sizeof(recentOps));
+
+  parser->compiling = function->chunk;
+  parser->function = function;
+  parser->nRecentOps = 0;
+
+  // arguments of annotated parameters are checked when the function starts
+  for (size_t i = node->left; i != NO_NODE; i = parser->ir.nodes[i].next) {
+    struct Node* param = &parser->ir.nodes[i];
+    if (param->valueType == VALUE_NONE)
+      continue;
+
+    parser->previous.line = param->line;
+    emitOp(parser, OP_GET_LOCAL);
+    emitByte(parser, param->slot);
+    emitOp(parser, OP_CHECK_TYPE);
+    emitByte(parser, param->valueType);
+    emitOp(parser, OP_POP);
+  }
+
+  lowerStatement(parser, node->body);
+  emitConstant(parser, NONE_VALUE);
+  emitOp(parser, OP_RETURN);
+
+  if (!parser->hadError && (parser->passes & PASS_PEEPHOLE)) {
+    runPeephole(&parser->compiling);
+  }
+  if (!parser->hadError) {
+    findMaxStack(&parser->compiling, function->arity);
+  }
+
+#ifdef PRINT_DEBUG
+  printf("\n<fn %.*s>", (int)name.length, name.str);
+  debugChunk(parser->compiling);
+#endif
+
+  function->chunk = parser->compiling;
+  parser->compiling = enclosing;
+  parser->function = enclosingFunction;
+  parser->nRecentOps = nRecentOps;
+  memcpy(parser->recentOps, recentOps, sizeof(recentOps));
+
+  parser->previous.line = node->line;
+  emitConstant(parser, FUNCTION_VALUE(function));
+}
+
+static void lowerNode(struct Parser* parser, size_t index) {
+  struct Node* node = &parser->ir.nodes[index];
+
+  if (node->type == NODE_TEMP) {
+    emitOp(parser, OP_LOAD_TEMP);
+    emitByte(parser, node->temp);
+    return;
+  }
+
+  if (node->type == NODE_BINARY && (node->op == OP_AND || node->op == OP_OR)) {
+    lowerShortCircuit(parser, node);
+  } else if (node->type == NODE_FUNCTION) {
+    lowerFunction(parser, node);
+  } else {
+    lowerOperation(parser, node);
   }
 
-  emitByte(parser, OP_RETURN);
+  if (node->temp != NO_TEMP) {
+    emitOp(parser, OP_STORE_TEMP);
+    emitByte(parser, node->temp);
+  }
+}
+
+// lowers an expression statement, declaration or condition after running the
+// expression passes on it
+static void lowerTree(struct Parser* parser, size_t index) {
+#ifndef NO_CONSTANT_FOLDING
+  // a function may run after later lines of the REPL assigned the global
+  if ((parser->passes & PASS_FOLD) &&
+      !(parser->repl && parser->function != NULL))
+    propagateConstants(parser, index);
+#endif
+
+  if (parser->passes & PASS_CSE)
+    eliminateCommonSubexpressions(&parser->ir, index);
+
+  lowerNode(parser, index);
 }
 
-struct Chunk compileString(const char* string, bool repl) {
+static void lowerStatement(struct Parser* parser, size_t index) {
+  struct Node* node = &parser->ir.nodes[index];
+
+  switch (node->type) {
+    case NODE_BLOCK:
+      parser->depth++;
+      for (size_t i = node->body; i != NO_NODE; i = parser->ir.nodes[i].next) {
+        lowerStatement(parser, i);
+      }
+      parser->depth--;
+
+      if (node->locals > 0) {
+        emitOp(parser, OP_POP_LOCALS);
+        emitByte(parser, node->locals);
+      }
+      break;
+    case NODE_IF: {
+      lowerTree(parser, node->left);
+      size_t elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+      lowerStatement(parser, node->body);
+
+      if (node->orElse == NO_NODE) {
+        patchJump(parser, elseJump);
+        break;
+      }
+
+      size_t endJump = emitJump(parser, OP_JUMP);
+      patchJump(parser, elseJump);
+
+      lowerStatement(parser, node->orElse);
+
+      patchJump(parser, endJump);
+      break;
+    }
+    case NODE_WHILE: {
+      // the condition is placed after the body so that each iteration only
+      // takes one jump
+      size_t conditionJump = emitJump(parser, OP_JUMP);
+      size_t body = label(parser);
+      lowerStatement(parser, node->body);
+
+      patchJump(parser, conditionJump);
+      lowerTree(parser, node->left);
+      emitLoop(parser, body);
+      break;
+    }
+    case NODE_RETURN:
+      if (node->right == NO_NODE) {
+        parser->previous.line = node->line;
+        emitConstant(parser, NONE_VALUE);
+      } else {
+        lowerTree(parser, node->right);
+      }
+
+      // a tail call does not come back to this frame
+      if (node->right == NO_NODE ||
+          parser->ir.nodes[node->right].type != NODE_CALL ||
+          parser->ir.nodes[node->right].op != OP_TAIL_CALL) {
+        emitOp(parser, OP_RETURN);
+      }
+      break;
+    default:
+      lowerTree(parser, index);
+  }
+}
+
+static void lowerProgram(struct Parser* parser) {
+  struct Ir* ir = &parser->ir;
+
+  if ((parser->passes & PASS_DSE) && !parser->repl)
+    eliminateDeadStores(ir);
+
+#ifndef NO_CONSTANT_FOLDING
+  if (parser->passes & PASS_FOLD)
+    findAssignments(parser);
+#endif
+
+  for (size_t i = 0; i < ir->statementsLength; i++) {
+    lowerStatement(parser, ir->statements[i]);
+  }
+
+  emitOp(parser, OP_RETURN);
+}
+
+static struct Chunk compile(const char* string, size_t length, size_t line,
+                            bool repl, bool batch, struct GlobalNames* globals,
+                            unsigned passes) {
   struct Parser parser;
   resetParser(&parser);
-  parser.repl = repl;
-  parser.emitPrint = repl;
+
+  struct Scope scope = {.localsLength = 0, .enclosing = NULL};
+  parser.scope = &scope;
+  parser.repl = repl || batch;
+  parser.emitPrint = parser.repl;
+  parser.batch = batch;
+  parser.globals = globals;
+  parser.compiling.allocator = globals->allocator;
+  parser.passes = passes;
 
   struct Scanner scanner;
-  initScanner(&scanner, string);
+  initScanner(&scanner, string, length);
+  scanner.line = line;
 
 #ifdef PRINT_DEBUG
   debugScanner(scanner);
@@ -368,9 +1593,38 @@ struct Chunk compileString(const char* string, bool repl) {
   parser.scanner = scanner;
 
   program(&parser);
+  if (!parser.hadError) {
+    lowerProgram(&parser);
+  }
+
+  if (!parser.hadError && (passes & PASS_PEEPHOLE)) {
+    runPeephole(&parser.compiling);
+  }
+  if (!parser.hadError) {
+    findMaxStack(&parser.compiling, 0);
+  }
+
+  freeArena(&parser.arena);
+
   if (parser.hadError) {
     deinitChunk(&parser.compiling);
+    return parser.compiling;
+  }
+
+  // the vm only needs the names for error messages, they stay owned by globals
+  for (size_t i = 0; i < globals->names.length; i++) {
+    addString(&parser.compiling, globals->names.strings[i]);
   }
 
   return parser.compiling;
 }
+
+struct Chunk compileString(const char* string, size_t length, bool repl,
+                           struct GlobalNames* globals, unsigned passes) {
+  return compile(string, length, 1, repl, false, globals, passes);
+}
+
+struct Chunk compileBatch(const char* string, size_t length, size_t line,
+                          struct GlobalNames* globals, unsigned passes) {
+  return compile(string, length, line, false, true, globals, passes);
+}
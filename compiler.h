@@ -3,7 +3,56 @@
 #include <stdlib.h>
 
 #include "chunk.h"
+#include "function.h"
+#include "map.h"
+#include "memory.h"
 #include "scanner.h"
+#include "str.h"
 #include "token.h"
 
-struct Chunk compileString(const char* string, bool repl);
+// global variables live in numbered slots of the vm, the names are resolved
+// once at compile time. shared between compilations that run on the same vm
+// so REPL lines see each others variables
+struct GlobalNames {
+  // what the compilations using these globals allocate their chunks and
+  // functions from, besides the tables here
+  struct Allocator* allocator;
+
+  struct Map slots;         // name -> slot
+  struct StringArray names; // slot -> name, the strings of interned symbols
+
+  // every function compiled so far, any global may still hold one
+  struct Function** functions;
+  size_t functionsSize, functionsLength;
+};
+
+void initGlobalNames(struct GlobalNames* globals, struct Allocator* allocator);
+void deinitGlobalNames(struct GlobalNames* globals);
+
+// optimizations the compiler can run, picked together with an optimization
+// level or one by one
+enum Pass {
+  PASS_FOLD = 1 << 0,     // constant folding and propagation of constant lets
+  PASS_CSE = 1 << 1,      // reuse of subexpressions repeated in a statement
+  PASS_DSE = 1 << 2,      // removal of stores to globals that are never read
+  PASS_PEEPHOLE = 1 << 3, // rewriting of wasteful sequences in the bytecode
+};
+
+#define DEFAULT_OPT_LEVEL 1
+#define MAX_OPT_LEVEL 2
+
+// 0 runs no pass, 1 folds constants and runs the peephole pass, 2 runs them
+// all
+unsigned optLevelPasses(int level);
+// comma separated pass names, false if one is unknown
+bool parsePasses(const char* list, unsigned* passes);
+
+// the compiled chunk's strings hold the names of every slot it may touch. the
+// string does not need to be terminated and may be freed once compiled
+struct Chunk compileString(const char* string, size_t length, bool repl,
+                           struct GlobalNames* globals, unsigned passes);
+// compiles whole lines of a longer program, starting at line, that print the
+// values of expressions like the REPL does. the batches before it already ran
+// and the ones after it may use its globals
+struct Chunk compileBatch(const char* string, size_t length, size_t line,
+                          struct GlobalNames* globals, unsigned passes);
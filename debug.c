@@ -23,6 +23,12 @@ static const char* tokenTypeString(enum TokenType type) {
       return "TOKEN_LPAREN";
     case TOKEN_RPAREN:
       return "TOKEN_RPAREN";
+    case TOKEN_LBRACE:
+      return "TOKEN_LBRACE";
+    case TOKEN_RBRACE:
+      return "TOKEN_RBRACE";
+    case TOKEN_COMMA:
+      return "TOKEN_COMMA";
     case TOKEN_IDENTIFIER:
       return "TOKEN_IDENTIFIER";
     case TOKEN_NUMBER:
@@ -57,6 +63,16 @@ static const char* tokenTypeString(enum TokenType type) {
       return "TOKEN_OR";
     case TOKEN_LET:
       return "TOKEN_LET";
+    case TOKEN_IF:
+      return "TOKEN_IF";
+    case TOKEN_ELSE:
+      return "TOKEN_ELSE";
+    case TOKEN_WHILE:
+      return "TOKEN_WHILE";
+    case TOKEN_FN:
+      return "TOKEN_FN";
+    case TOKEN_RETURN:
+      return "TOKEN_RETURN";
   }
 
   return "UNKNOWN_TOKEN";
@@ -83,6 +99,138 @@ void debugScanner(struct Scanner scanner) {
   }
 }
 
+const char* opCodeString(enum OpCode code) {
+  switch (code) {
+    case OP_RETURN:
+      return "OP_RETURN";
+    case OP_PRINT:
+      return "OP_PRINT";
+    case OP_POP:
+      return "OP_POP";
+    case OP_CONSTANT:
+      return "OP_CONSTANT";
+    case OP_NEGATE:
+      return "OP_NEGATE";
+    case OP_ADD:
+      return "OP_ADD";
+    case OP_SUBTRACT:
+      return "OP_SUBTRACT";
+    case OP_DIVIDE:
+      return "OP_DIVIDE";
+    case OP_MULTIPLY:
+      return "OP_MULTIPLY";
+    case OP_NOT:
+      return "OP_NOT";
+    case OP_AND:
+      return "OP_AND";
+    case OP_OR:
+      return "OP_OR";
+    case OP_ASSIGN:
+      return "OP_ASSIGN";
+    case OP_DECLARE:
+      return "OP_DECLARE";
+    case OP_READ:
+      return "OP_READ";
+    case OP_EQUAL:
+      return "OP_EQUAL";
+    case OP_NOT_EQUAL:
+      return "OP_NOT_EQUAL";
+    case OP_GREATER:
+      return "OP_GREATER";
+    case OP_GREATER_EQUAL:
+      return "OP_GREATER_EQUAL";
+    case OP_LESSER:
+      return "OP_LESSER";
+    case OP_LESSER_EQUAL:
+      return "OP_LESSER_EQUAL";
+    case OP_STORE_TEMP:
+      return "OP_STORE_TEMP";
+    case OP_LOAD_TEMP:
+      return "OP_LOAD_TEMP";
+    case OP_GET_LOCAL:
+      return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:
+      return "OP_SET_LOCAL";
+    case OP_SET_LOCAL_CHECKED:
+      return "OP_SET_LOCAL_CHECKED";
+    case OP_POP_LOCALS:
+      return "OP_POP_LOCALS";
+    case OP_CHECK_TYPE:
+      return "OP_CHECK_TYPE";
+    case OP_CALL:
+      return "OP_CALL";
+    case OP_TAIL_CALL:
+      return "OP_TAIL_CALL";
+    case OP_JUMP:
+      return "OP_JUMP";
+    case OP_JUMP_IF_FALSE:
+      return "OP_JUMP_IF_FALSE";
+    case OP_LOOP_IF_TRUE:
+      return "OP_LOOP_IF_TRUE";
+    case OP_SHORT_AND:
+      return "OP_SHORT_AND";
+    case OP_SHORT_OR:
+      return "OP_SHORT_OR";
+    case OP_READ_CONST_ADD:
+      return "OP_READ_CONST_ADD";
+    case OP_CONST_DECLARE:
+      return "OP_CONST_DECLARE";
+    case OP_PRINT_POP:
+      return "OP_PRINT_POP";
+    case OP_CONSTANT_LONG:
+      return "OP_CONSTANT_LONG";
+    case OP_ASSIGN_LONG:
+      return "OP_ASSIGN_LONG";
+    case OP_DECLARE_LONG:
+      return "OP_DECLARE_LONG";
+    case OP_READ_LONG:
+      return "OP_READ_LONG";
+    case OP_NEGATE_NUM:
+      return "OP_NEGATE_NUM";
+    case OP_ADD_NUM_NUM:
+      return "OP_ADD_NUM_NUM";
+    case OP_SUBTRACT_NUM_NUM:
+      return "OP_SUBTRACT_NUM_NUM";
+    case OP_MULTIPLY_NUM_NUM:
+      return "OP_MULTIPLY_NUM_NUM";
+    case OP_DIVIDE_NUM_NUM:
+      return "OP_DIVIDE_NUM_NUM";
+    case OP_EQUAL_NUM_NUM:
+      return "OP_EQUAL_NUM_NUM";
+    case OP_NOT_EQUAL_NUM_NUM:
+      return "OP_NOT_EQUAL_NUM_NUM";
+    case OP_GREATER_NUM_NUM:
+      return "OP_GREATER_NUM_NUM";
+    case OP_GREATER_EQUAL_NUM_NUM:
+      return "OP_GREATER_EQUAL_NUM_NUM";
+    case OP_LESSER_NUM_NUM:
+      return "OP_LESSER_NUM_NUM";
+    case OP_LESSER_EQUAL_NUM_NUM:
+      return "OP_LESSER_EQUAL_NUM_NUM";
+  }
+
+  return "UNKNOWN_OPCODE";
+}
+
+// a 24 bit operand followed by extraOperands single byte ones
+size_t longOperandInstruction(char* string, uint8_t* code,
+                              size_t extraOperands) {
+  printf("%s, %d", string, code[1] | code[2] << 8 | code[3] << 16);
+
+  for (size_t i = 0; i < extraOperands; i++) {
+    printf(", %d", code[4 + i]);
+  }
+  printf("\n");
+
+  return 4 + extraOperands;
+}
+
+size_t threeOperandInstruction(char* string, uint8_t operand0,
+                               uint8_t operand1, uint8_t operand2) {
+  printf("%s, %d, %d, %d\n", string, operand0, operand1, operand2);
+  return 4;
+}
+
 size_t twoOperandInstruction(char* string, uint8_t operand0, uint8_t operand1) {
   printf("%s, %d, %d\n", string, operand0, operand1);
   return 3;
@@ -93,6 +241,12 @@ size_t oneOperandInstruction(char* string, uint8_t operand) {
   return 2;
 }
 
+// the relative offset with its direction
+size_t jumpInstruction(char* string, int sign, uint8_t* code) {
+  printf("%s, %+d\n", string, sign * (code[1] | code[2] << 8));
+  return 3;
+}
+
 size_t simpleInstruction(char* string) {
   printf("%s\n", string);
   return 1;
@@ -144,6 +298,71 @@ size_t printInstruction(uint8_t* code) {
       return simpleInstruction("LESSER");
     case OP_LESSER_EQUAL:
       return simpleInstruction("LESSER_EQUAL");
+    case OP_STORE_TEMP:
+      return oneOperandInstruction("STORE_TEMP", code[1]);
+    case OP_LOAD_TEMP:
+      return oneOperandInstruction("LOAD_TEMP", code[1]);
+    case OP_GET_LOCAL:
+      return oneOperandInstruction("GET_LOCAL", code[1]);
+    case OP_SET_LOCAL:
+      return oneOperandInstruction("SET_LOCAL", code[1]);
+    case OP_SET_LOCAL_CHECKED:
+      return oneOperandInstruction("SET_LOCAL_CHECKED", code[1]);
+    case OP_POP_LOCALS:
+      return oneOperandInstruction("POP_LOCALS", code[1]);
+    case OP_CHECK_TYPE:
+      return oneOperandInstruction("CHECK_TYPE", code[1]);
+    case OP_CALL:
+      return oneOperandInstruction("CALL", code[1]);
+    case OP_TAIL_CALL:
+      return oneOperandInstruction("TAIL_CALL", code[1]);
+    case OP_JUMP:
+      return jumpInstruction("JUMP", 1, code);
+    case OP_JUMP_IF_FALSE:
+      return jumpInstruction("JUMP_IF_FALSE", 1, code);
+    case OP_LOOP_IF_TRUE:
+      return jumpInstruction("LOOP_IF_TRUE", -1, code);
+    case OP_SHORT_AND:
+      return jumpInstruction("SHORT_AND", 1, code);
+    case OP_SHORT_OR:
+      return jumpInstruction("SHORT_OR", 1, code);
+    case OP_READ_CONST_ADD:
+      return twoOperandInstruction("READ_CONST_ADD", code[1], code[2]);
+    case OP_CONST_DECLARE:
+      return threeOperandInstruction("CONST_DECLARE", code[1], code[2],
+                                     code[3]);
+    case OP_PRINT_POP:
+      return simpleInstruction("PRINT_POP");
+    case OP_CONSTANT_LONG:
+      return longOperandInstruction("CONSTANT_LONG", code, 0);
+    case OP_ASSIGN_LONG:
+      return longOperandInstruction("OP_ASSIGN_LONG", code, 0);
+    case OP_DECLARE_LONG:
+      return longOperandInstruction("OP_DECLARE_LONG", code, 1);
+    case OP_READ_LONG:
+      return longOperandInstruction("OP_READ_LONG", code, 0);
+    case OP_NEGATE_NUM:
+      return simpleInstruction("NEGATE_NUM");
+    case OP_ADD_NUM_NUM:
+      return simpleInstruction("ADD_NUM_NUM");
+    case OP_SUBTRACT_NUM_NUM:
+      return simpleInstruction("SUBTRACT_NUM_NUM");
+    case OP_MULTIPLY_NUM_NUM:
+      return simpleInstruction("MULTIPLY_NUM_NUM");
+    case OP_DIVIDE_NUM_NUM:
+      return simpleInstruction("DIVIDE_NUM_NUM");
+    case OP_EQUAL_NUM_NUM:
+      return simpleInstruction("EQUAL_NUM_NUM");
+    case OP_NOT_EQUAL_NUM_NUM:
+      return simpleInstruction("NOT_EQUAL_NUM_NUM");
+    case OP_GREATER_NUM_NUM:
+      return simpleInstruction("GREATER_NUM_NUM");
+    case OP_GREATER_EQUAL_NUM_NUM:
+      return simpleInstruction("GREATER_EQUAL_NUM_NUM");
+    case OP_LESSER_NUM_NUM:
+      return simpleInstruction("LESSER_NUM_NUM");
+    case OP_LESSER_EQUAL_NUM_NUM:
+      return simpleInstruction("LESSER_EQUAL_NUM_NUM");
   }
 
   return simpleInstruction("UNKNOWN");
@@ -153,5 +372,7 @@ void debugChunk(struct Chunk chunk) {
   puts("\n==DECOMPILED CHUNK START==\n");
   for (size_t i = 0; i < chunk.length; i += printInstruction(&chunk.code[i]))
     ;
+  printf("\npeephole: %zu bytes saved, %zu dispatches avoided\n",
+         chunk.peepholeBytes, chunk.peepholeDispatches);
   puts("\n==DECOMPILED CHUNK END==\n");
 }
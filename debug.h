@@ -1,9 +1,11 @@
 #pragma once
 
 #include "chunk.h"
+#include "op.h"
 #include "scanner.h"
 #include "token.h"
 
 void debugToken(struct Token token);
 void debugScanner(struct Scanner scanner);
 void debugChunk(struct Chunk chunk);
+const char* opCodeString(enum OpCode code);
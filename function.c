@@ -0,0 +1,90 @@
+#include "function.h"
+
+#include "chunk.h"
+#include "memory.h"
+#include "str.h"
+#include "value.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct Function* newFunction(struct Allocator* allocator, struct String name,
+                             size_t arity) {
+  struct Function* function =
+      reallocateWith(allocator, MEMORY_FUNCTIONS, NULL, 1, 0,
+                     sizeof(struct Function));
+  initChunk(&function->chunk);
+  function->chunk.allocator = allocator;
+  function->arity = arity;
+
+  function->name = (struct String){.str = "", .length = 0};
+  if (name.length > 0) {
+    char* copy = reallocateWith(allocator, MEMORY_FUNCTIONS, NULL,
+                                name.length, 0, sizeof(char));
+    memcpy(copy, name.str, name.length);
+    function->name = (struct String){.str = copy, .length = name.length};
+  }
+
+  return function;
+}
+
+void freeFunction(struct Function* function) {
+  struct Allocator* allocator = function->chunk.allocator;
+
+  deinitChunk(&function->chunk);
+  if (function->name.length > 0) {
+    freeWith(allocator, MEMORY_FUNCTIONS, (char*)function->name.str,
+             function->name.length, sizeof(char));
+  }
+  freeWith(allocator, MEMORY_FUNCTIONS, function, 1, sizeof(struct Function));
+}
+
+// appends the function unless it was found before
+static void addFunction(struct FunctionList* list, struct Function* function) {
+  for (size_t i = 0; i < list->length; i++) {
+    if (list->functions[i] == function)
+      return;
+  }
+
+  if (list->length >= list->size) {
+    size_t previousSize = list->size;
+    list->size = nextArraySize(previousSize);
+    list->functions = reallocate(list->functions, list->size, previousSize,
+                                 sizeof(struct Function*));
+  }
+
+  list->functions[list->length++] = function;
+}
+
+static void addCreatedFunctions(struct FunctionList* list,
+                                struct Chunk* chunk) {
+  for (size_t i = 0; i < chunk->values.length; i++) {
+    if (IS_FUNCTION(chunk->values.values[i])) {
+      addFunction(list, AS_FUNCTION(chunk->values.values[i]));
+    }
+  }
+}
+
+void findFunctions(struct Chunk* chunk, struct FunctionList* list) {
+  *list = (struct FunctionList){0};
+
+  // functions found are searched in turn as the loop reaches them
+  addCreatedFunctions(list, chunk);
+  for (size_t i = 0; i < list->length; i++) {
+    addCreatedFunctions(list, &list->functions[i]->chunk);
+  }
+}
+
+void freeFunctionList(struct FunctionList* list) {
+  free(list->functions);
+  *list = (struct FunctionList){0};
+}
+
+size_t functionListIndex(struct FunctionList* list, struct Function* function) {
+  size_t index = 0;
+  while (list->functions[index] != function) {
+    index++;
+  }
+
+  return index;
+}
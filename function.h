@@ -0,0 +1,32 @@
+#pragma once
+
+#include "chunk.h"
+#include "memory.h"
+#include "str.h"
+
+#include <stdlib.h>
+
+// a compiled function. it outlives the chunk that created it, so it is owned
+// by the GlobalNames of the compilations whose globals may refer to it
+struct Function {
+  struct Chunk chunk;
+  size_t arity;
+  struct String name; // owned, empty for an anonymous function
+};
+
+// the function, its name and its chunk come from the allocator
+struct Function* newFunction(struct Allocator* allocator, struct String name,
+                             size_t arity);
+void freeFunction(struct Function* function);
+
+// the functions a chunk creates, including the ones those create in turn, in
+// the order they are found
+struct FunctionList {
+  struct Function** functions;
+  size_t size, length;
+};
+
+void findFunctions(struct Chunk* chunk, struct FunctionList* list);
+void freeFunctionList(struct FunctionList* list);
+// position of the function in the list
+size_t functionListIndex(struct FunctionList* list, struct Function* function);
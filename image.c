@@ -0,0 +1,436 @@
+#define _DEFAULT_SOURCE // mmap
+
+#include "image.h"
+
+#include "chunk.h"
+#include "function.h"
+#include "memory.h"
+#include "value.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// offsets are from the start of the file and every table is 8 byte aligned,
+// so the image can be mapped anywhere. numbers are stored in the byte order
+// of the machine that wrote them, which has to match the reader's
+struct ImageHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder; // BYTE_ORDER_MARK as the writer stored it
+  uint32_t chunksLength;
+  uint64_t chunks; // ImageChunk table, the script's chunk first
+};
+
+#define IMAGE_MAGIC "TOYC"
+#define BYTE_ORDER_MARK 0x01020304
+
+struct ImageChunk {
+  uint64_t code, length;
+  uint64_t constants, constantsLength; // ImageConstant table
+  uint64_t strings, stringsLength;     // ImageString table
+  uint64_t name, nameLength;           // functions only
+  uint64_t arity;
+};
+
+// independent of the build's value representation
+struct ImageConstant {
+  uint64_t type; // enum ValueType
+  // the double's bits for a number, 0 or 1 for a bool and the index of the
+  // chunk for a function
+  uint64_t bits;
+};
+
+struct ImageString {
+  uint64_t offset, length;
+};
+
+struct Buffer {
+  uint8_t* bytes;
+  size_t size, length;
+};
+
+// offset of length zeroed bytes appended at the next aligned position
+static size_t reserve(struct Buffer* buffer, size_t length) {
+  size_t offset = (buffer->length + 7) & ~(size_t)7;
+
+  while (offset + length > buffer->size) {
+    size_t previousSize = buffer->size;
+    buffer->size = nextArraySize(previousSize);
+    buffer->bytes = reallocate(buffer->bytes, buffer->size, previousSize,
+                               sizeof(uint8_t));
+  }
+
+  memset(buffer->bytes + buffer->length, 0, offset + length - buffer->length);
+  buffer->length = offset + length;
+  return offset;
+}
+
+static size_t append(struct Buffer* buffer, const void* data, size_t length) {
+  size_t offset = reserve(buffer, length);
+  memcpy(buffer->bytes + offset, data, length);
+  return offset;
+}
+
+static struct ImageConstant imageConstant(struct Value value,
+                                          struct FunctionList* functions) {
+  struct ImageConstant constant = {.type = VALUE_TYPE(value)};
+
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    memcpy(&constant.bits, &number, sizeof(number));
+  } else if (IS_BOOL(value)) {
+    constant.bits = AS_BOOL(value);
+  } else if (IS_FUNCTION(value)) {
+    constant.bits = functionListIndex(functions, AS_FUNCTION(value)) + 1;
+  }
+
+  return constant;
+}
+
+static struct ImageChunk writeChunkImage(struct Buffer* buffer,
+                                         struct Chunk* chunk,
+                                         struct FunctionList* functions) {
+  struct ImageChunk written = {
+      .length = chunk->length,
+      .constantsLength = chunk->values.length,
+      .stringsLength = chunk->strings.length,
+  };
+
+  written.code = append(buffer, chunk->code, chunk->length);
+
+  written.constants = reserve(
+      buffer, chunk->values.length * sizeof(struct ImageConstant));
+  for (size_t i = 0; i < chunk->values.length; i++) {
+    struct ImageConstant constant =
+        imageConstant(chunk->values.values[i], functions);
+    memcpy(buffer->bytes + written.constants + i * sizeof(constant), &constant,
+           sizeof(constant));
+  }
+
+  written.strings =
+      reserve(buffer, chunk->strings.length * sizeof(struct ImageString));
+  for (size_t i = 0; i < chunk->strings.length; i++) {
+    struct String string = chunk->strings.strings[i];
+    struct ImageString imageString = {
+        .offset = append(buffer, string.str, string.length),
+        .length = string.length,
+    };
+    memcpy(buffer->bytes + written.strings + i * sizeof(imageString),
+           &imageString, sizeof(imageString));
+  }
+
+  return written;
+}
+
+bool writeImage(FILE* out, struct Chunk* chunk) {
+  struct FunctionList functions;
+  findFunctions(chunk, &functions);
+
+  struct Buffer buffer = {0};
+  size_t chunksLength = functions.length + 1;
+
+  struct ImageHeader header = {
+      .magic = IMAGE_MAGIC,
+      .version = IMAGE_VERSION,
+      .byteOrder = BYTE_ORDER_MARK,
+      .chunksLength = chunksLength,
+  };
+  reserve(&buffer, sizeof(header));
+  header.chunks = reserve(&buffer, chunksLength * sizeof(struct ImageChunk));
+
+  for (size_t i = 0; i < chunksLength; i++) {
+    struct ImageChunk written;
+
+    if (i == 0) {
+      written = writeChunkImage(&buffer, chunk, &functions);
+    } else {
+      struct Function* function = functions.functions[i - 1];
+      written = writeChunkImage(&buffer, &function->chunk, &functions);
+      written.name =
+          append(&buffer, function->name.str, function->name.length);
+      written.nameLength = function->name.length;
+      written.arity = function->arity;
+    }
+
+    memcpy(buffer.bytes + header.chunks + i * sizeof(written), &written,
+           sizeof(written));
+  }
+  memcpy(buffer.bytes, &header, sizeof(header));
+
+  bool ok = fwrite(buffer.bytes, 1, buffer.length, out) == buffer.length;
+
+  free(buffer.bytes);
+  freeFunctionList(&functions);
+  return ok;
+}
+
+// whether count entries of size at offset lie within the image
+static bool inImage(struct Image* image, uint64_t offset, uint64_t count,
+                    size_t size) {
+  return offset <= image->size && count <= (image->size - offset) / size;
+}
+
+static size_t longOperand(const uint8_t* code) {
+  return code[1] | code[2] << 8 | code[3] << 16;
+}
+
+// the vm trusts its code, so the code of an image is checked once before it
+// runs: every instruction is known and ends within the code, its indices are
+// within the chunk's tables, its types are ones a script can name and every
+// jump lands on an instruction. globals are named by the script's chunk,
+// functions included. then the stack height is followed from the frame's
+// arguments, which also finds how much stack a call needs. temps are byte
+// operands, which always fall within the vm's temps
+static bool verifyCode(struct Chunk* chunk, size_t globals, size_t arity) {
+  const uint8_t* code = chunk->code;
+  size_t constants = chunk->values.length;
+
+  if (chunk->length == 0)
+    return false;
+
+  bool* starts = calloc(chunk->length, sizeof(bool));
+  bool ok = true;
+  size_t offset = 0;
+
+  while (ok && offset < chunk->length) {
+    const uint8_t* instruction = &code[offset];
+
+    if (*instruction > OP_LESSER_EQUAL_NUM_NUM ||
+        instructionLength(instruction) > chunk->length - offset) {
+      ok = false;
+      break;
+    }
+
+    switch (*instruction) {
+      case OP_CONSTANT:
+        ok = instruction[1] < constants;
+        break;
+      case OP_CONSTANT_LONG:
+        ok = longOperand(instruction) < constants;
+        break;
+      case OP_ASSIGN:
+      case OP_READ:
+        ok = instruction[1] < globals;
+        break;
+      case OP_ASSIGN_LONG:
+      case OP_READ_LONG:
+        ok = longOperand(instruction) < globals;
+        break;
+      case OP_DECLARE:
+        ok = instruction[1] < globals && instruction[2] < VALUE_UNDECLARED;
+        break;
+      case OP_DECLARE_LONG:
+        ok = longOperand(instruction) < globals &&
+             instruction[4] < VALUE_UNDECLARED;
+        break;
+      case OP_CHECK_TYPE:
+        ok = instruction[1] < VALUE_UNDECLARED;
+        break;
+      case OP_READ_CONST_ADD:
+        ok = instruction[1] < globals && instruction[2] < constants;
+        break;
+      case OP_CONST_DECLARE:
+        ok = instruction[1] < constants && instruction[2] < globals &&
+             instruction[3] < VALUE_UNDECLARED;
+        break;
+    }
+
+    starts[offset] = true;
+    offset += instructionLength(instruction);
+  }
+
+  for (offset = 0; ok && offset < chunk->length;
+       offset += instructionLength(&code[offset])) {
+    if (isJump(code[offset])) {
+      // a loop further back than the start wraps around past the length
+      size_t target = jumpTarget(code, offset);
+      ok = target < chunk->length && starts[target];
+    }
+  }
+
+  free(starts);
+  return ok && findMaxStack(chunk, arity) && chunk->maxStack < STACK_MAX;
+}
+
+static bool loadChunkImage(struct Image* image, struct Chunk* chunk,
+                           const struct ImageChunk* loaded) {
+  uint8_t* bytes = image->mapping;
+
+  if (!inImage(image, loaded->code, loaded->length, 1) ||
+      !inImage(image, loaded->constants, loaded->constantsLength,
+               sizeof(struct ImageConstant)) ||
+      !inImage(image, loaded->strings, loaded->stringsLength,
+               sizeof(struct ImageString))) {
+    return false;
+  }
+
+  // quickening rewrites the code in place, which only copies the pages it
+  // touches since the mapping is private
+  chunk->code = bytes + loaded->code;
+  chunk->size = chunk->length = loaded->length;
+
+  const struct ImageConstant* constants =
+      (const struct ImageConstant*)(bytes + loaded->constants);
+  chunk->values.size = chunk->values.length = loaded->constantsLength;
+  chunk->values.values =
+      reallocateWith(chunk->allocator, MEMORY_CONSTANTS, NULL,
+                     loaded->constantsLength, 0, sizeof(struct Value));
+
+  for (size_t i = 0; i < loaded->constantsLength; i++) {
+    const struct ImageConstant* constant = &constants[i];
+    struct Value* value = &chunk->values.values[i];
+
+    switch (constant->type) {
+      case VALUE_NUMBER: {
+        double number;
+        memcpy(&number, &constant->bits, sizeof(number));
+        *value = NUMBER_VALUE(number);
+        break;
+      }
+      case VALUE_BOOL:
+        *value = BOOL_VALUE(constant->bits != 0);
+        break;
+      case VALUE_FUNCTION:
+        if (constant->bits == 0 || constant->bits > image->functionsLength)
+          return false;
+
+        *value = FUNCTION_VALUE(image->functions[constant->bits - 1]);
+        break;
+      default:
+        *value = NONE_VALUE;
+    }
+  }
+
+  const struct ImageString* strings =
+      (const struct ImageString*)(bytes + loaded->strings);
+  chunk->strings.size = chunk->strings.length = loaded->stringsLength;
+  chunk->strings.strings =
+      reallocateWith(chunk->allocator, MEMORY_STRINGS, NULL,
+                     loaded->stringsLength, 0, sizeof(struct String));
+
+  for (size_t i = 0; i < loaded->stringsLength; i++) {
+    if (!inImage(image, strings[i].offset, strings[i].length, 1))
+      return false;
+
+    chunk->strings.strings[i] = (struct String){
+        .str = (const char*)bytes + strings[i].offset,
+        .length = strings[i].length,
+    };
+  }
+
+  // the script starts with an empty stack whatever the image says
+  size_t arity = chunk == &image->chunk ? 0 : loaded->arity;
+  return verifyCode(chunk, image->chunk.strings.length, arity);
+}
+
+static const char* mapImage(const char* path, struct Image* image) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return "cannot be read";
+
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size == 0) {
+    close(fd);
+    return "cannot be read";
+  }
+
+  image->size = status.st_size;
+  image->mapping = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  return image->mapping == MAP_FAILED ? "cannot be mapped" : NULL;
+}
+
+// checks the header before anything it points to is read
+static const char* checkHeader(struct Image* image) {
+  const struct ImageHeader* header = image->mapping;
+
+  if (image->size < sizeof(*header) ||
+      memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+    return "is not a compiled toy script";
+  }
+
+  if (header->version != IMAGE_VERSION ||
+      header->byteOrder != BYTE_ORDER_MARK) {
+    return "was compiled by another version of toy or on another machine";
+  }
+
+  if (header->chunksLength == 0 ||
+      !inImage(image, header->chunks, header->chunksLength,
+               sizeof(struct ImageChunk))) {
+    return "is corrupt";
+  }
+
+  return NULL;
+}
+
+const char* loadImage(const char* path, struct Image* image) {
+  image->functions = NULL;
+  image->functionsLength = 0;
+  initChunk(&image->chunk);
+
+  const char* error = mapImage(path, image);
+  if (error != NULL)
+    return error;
+
+  error = checkHeader(image);
+  if (error != NULL) {
+    munmap(image->mapping, image->size);
+    return error;
+  }
+
+  const struct ImageHeader* header = image->mapping;
+  const struct ImageChunk* chunks =
+      (const struct ImageChunk*)((uint8_t*)image->mapping + header->chunks);
+
+  // all functions exist before any constant refers to one
+  image->functionsLength = header->chunksLength - 1;
+  image->functions =
+      malloc(image->functionsLength * sizeof(struct Function*));
+  for (size_t i = 0; i < image->functionsLength; i++) {
+    const struct ImageChunk* loaded = &chunks[i + 1];
+    struct String name = {.str = "", .length = 0};
+
+    if (inImage(image, loaded->name, loaded->nameLength, 1)) {
+      name = (struct String){
+          .str = (const char*)image->mapping + loaded->name,
+          .length = loaded->nameLength,
+      };
+    }
+    image->functions[i] = newFunction(&mallocAllocator, name, loaded->arity);
+  }
+
+  bool ok = loadChunkImage(image, &image->chunk, &chunks[0]);
+  for (size_t i = 0; ok && i < image->functionsLength; i++) {
+    ok = loadChunkImage(image, &image->functions[i]->chunk, &chunks[i + 1]);
+  }
+
+  if (!ok) {
+    unloadImage(image);
+    return "is corrupt";
+  }
+
+  return NULL;
+}
+
+void unloadImage(struct Image* image) {
+  // the code belongs to the mapping, everything else to the chunks
+  image->chunk.code = NULL;
+  deinitChunk(&image->chunk);
+
+  for (size_t i = 0; i < image->functionsLength; i++) {
+    image->functions[i]->chunk.code = NULL;
+    freeFunction(image->functions[i]);
+  }
+  free(image->functions);
+
+  munmap(image->mapping, image->size);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "chunk.h"
+#include "function.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// compiled scripts can be saved as .toyc images with toy --compile, which the
+// vm runs without scanning or compiling the source again. an image is mapped
+// into memory and the code runs from the mapping, only the small constant and
+// name tables are rebuilt because they hold pointers
+
+// bumped whenever the layout below or the bytecode change
+#define IMAGE_VERSION 1
+
+// a mapped image, the chunks point into the mapping
+struct Image {
+  void* mapping;
+  size_t size;
+
+  struct Chunk chunk; // the script's
+  struct Function** functions;
+  size_t functionsLength;
+};
+
+bool writeImage(FILE* out, struct Chunk* chunk);
+
+// NULL once loaded, otherwise why the file cannot be run, to follow its path
+// in an error message
+const char* loadImage(const char* path, struct Image* image);
+void unloadImage(struct Image* image);
@@ -0,0 +1,467 @@
+#include "ir.h"
+
+#include "memory.h"
+
+#include <string.h>
+
+void initIr(struct Ir* ir, struct Arena* arena) {
+  ir->arena = arena;
+
+  ir->nodes = NULL;
+  ir->size = 0;
+  ir->length = 0;
+
+  ir->statements = NULL;
+  ir->statementsSize = 0;
+  ir->statementsLength = 0;
+
+  ir->available = NULL;
+  ir->availableSize = 0;
+}
+
+void resetIr(struct Ir* ir) {
+  ir->length = 0;
+  ir->statementsLength = 0;
+}
+
+struct Node makeNode(enum NodeType type, struct Token token) {
+  return (struct Node){
+      .type = type,
+      .line = token.line,
+      .left = NO_NODE,
+      .right = NO_NODE,
+      .body = NO_NODE,
+      .orElse = NO_NODE,
+      .next = NO_NODE,
+      .valueType = VALUE_NONE,
+      .temp = NO_TEMP,
+      .as.name = {.str = token.start, .length = token.length},
+  };
+}
+
+size_t addNode(struct Ir* ir, struct Node node) {
+  if (ir->length >= ir->size) {
+    size_t previousSize = ir->size;
+    ir->size = nextArraySize(previousSize);
+    ir->nodes = arenaReallocate(ir->arena, ir->nodes, ir->size, previousSize,
+                                sizeof(struct Node));
+  }
+
+  ir->nodes[ir->length] = node;
+  return ir->length++;
+}
+
+void addStatement(struct Ir* ir, size_t node) {
+  if (ir->statementsLength >= ir->statementsSize) {
+    size_t previousSize = ir->statementsSize;
+    ir->statementsSize = nextArraySize(previousSize);
+    ir->statements = arenaReallocate(ir->arena, ir->statements,
+                                     ir->statementsSize, previousSize,
+                                     sizeof(uint32_t));
+  }
+
+  ir->statements[ir->statementsLength++] = node;
+}
+
+enum ValueType inferType(struct Ir* ir, size_t index) {
+  struct Node* node = &ir->nodes[index];
+
+  switch (node->type) {
+    case NODE_CONSTANT:
+      return VALUE_TYPE(node->as.value);
+    case NODE_LOCAL:
+      return node->valueType;
+    case NODE_FUNCTION:
+      return VALUE_FUNCTION;
+    case NODE_ASSIGN:
+    case NODE_SET_LOCAL: // the old value
+      return inferType(ir, node->left);
+    case NODE_UNARY:
+      return node->op == OP_NEGATE ? VALUE_NUMBER : VALUE_BOOL;
+    case NODE_BINARY:
+      switch (node->op) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+          return VALUE_NUMBER;
+        default:
+          return VALUE_BOOL;
+      }
+    default:
+      return VALUE_NONE;
+  }
+}
+
+// common subexpression elimination
+
+// a subexpression is only reused if it lowers to at least this many
+// instructions, below that saving and loading the temp costs as much
+#define MIN_REUSE_COST 3
+
+struct Cse {
+  struct Ir* ir;
+
+  // nodes whose value has been computed at the current point of the statement
+  size_t* available;
+  size_t availableSize, availableLength;
+
+  // node each temp holds the value of
+  size_t sources[MAX_TEMPS];
+  size_t temps;
+
+  // right operands of 'and' / 'or' the current node is in. they may not run,
+  // so what they compute is not available after them
+  size_t conditional;
+};
+
+// instructions the node lowers to, counting a superinstruction as one
+static size_t cost(struct Ir* ir, size_t index) {
+  struct Node* node = &ir->nodes[index];
+
+  switch (node->type) {
+    case NODE_UNARY:
+      return 1 + cost(ir, node->right);
+    case NODE_BINARY:
+#ifndef NO_SUPERINSTRUCTIONS
+      // READ x; CONSTANT k; ADD is fused into READ_CONST_ADD
+      if (node->op == OP_ADD && ir->nodes[node->left].type == NODE_READ &&
+          ir->nodes[node->right].type == NODE_CONSTANT) {
+        return 1;
+      }
+#endif
+      return 1 + cost(ir, node->left) + cost(ir, node->right);
+    default:
+      return 1;
+  }
+}
+
+// expressions without reads are left for constant folding instead
+static bool hasRead(struct Ir* ir, size_t index) {
+  if (index == NO_NODE)
+    return false;
+
+  struct Node* node = &ir->nodes[index];
+  return node->type == NODE_READ || node->type == NODE_LOCAL ||
+         node->type == NODE_TEMP || hasRead(ir, node->left) ||
+         hasRead(ir, node->right);
+}
+
+static bool reusable(struct Ir* ir, size_t index) {
+  struct Node* node = &ir->nodes[index];
+  return (node->type == NODE_UNARY || node->type == NODE_BINARY) &&
+         hasRead(ir, index) && cost(ir, index) >= MIN_REUSE_COST;
+}
+
+static bool sameConstant(struct Value a, struct Value b) {
+  if (VALUE_TYPE(a) != VALUE_TYPE(b))
+    return false;
+
+  if (IS_NUMBER(a)) { // bitwise so that 0 and -0 differ
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+
+  if (IS_FUNCTION(a))
+    return AS_FUNCTION(a) == AS_FUNCTION(b);
+
+  return IS_NONE(a) || AS_BOOL(a) == AS_BOOL(b);
+}
+
+static bool sameExpr(struct Cse* cse, size_t a, size_t b) {
+  struct Node* x = &cse->ir->nodes[a];
+  struct Node* y = &cse->ir->nodes[b];
+
+  // a temp stands for the subexpression it replaced
+  if (x->type == NODE_TEMP)
+    return sameExpr(cse, cse->sources[x->temp], b);
+  if (y->type == NODE_TEMP)
+    return sameExpr(cse, a, cse->sources[y->temp]);
+
+  if (x->type != y->type)
+    return false;
+
+  switch (x->type) {
+    case NODE_CONSTANT:
+      return sameConstant(x->as.value, y->as.value);
+    case NODE_READ:
+    case NODE_LOCAL:
+      return x->slot == y->slot;
+    case NODE_UNARY:
+      return x->op == y->op && sameExpr(cse, x->right, y->right);
+    case NODE_BINARY:
+      return x->op == y->op && sameExpr(cse, x->left, y->left) &&
+             sameExpr(cse, x->right, y->right);
+    default:
+      return false;
+  }
+}
+
+// whether the expression reads the variable that read nodes of the type and
+// slot refer to
+static bool readsSlot(struct Cse* cse, size_t index, enum NodeType read,
+                      size_t slot) {
+  if (index == NO_NODE)
+    return false;
+
+  struct Node* node = &cse->ir->nodes[index];
+
+  if (node->type == read)
+    return node->slot == slot;
+  if (node->type == NODE_TEMP)
+    return readsSlot(cse, cse->sources[node->temp], read, slot);
+
+  return readsSlot(cse, node->left, read, slot) ||
+         readsSlot(cse, node->right, read, slot);
+}
+
+// drops the available values that depend on a variable that was just assigned
+static void forgetReads(struct Cse* cse, enum NodeType read, size_t slot) {
+  size_t kept = 0;
+
+  for (size_t i = 0; i < cse->availableLength; i++) {
+    if (!readsSlot(cse, cse->available[i], read, slot)) {
+      cse->available[kept++] = cse->available[i];
+    }
+  }
+
+  cse->availableLength = kept;
+}
+
+static void makeAvailable(struct Cse* cse, size_t index) {
+  if (cse->availableLength >= cse->availableSize) {
+    size_t previousSize = cse->availableSize;
+    cse->availableSize = nextArraySize(previousSize);
+    cse->available = arenaReallocate(cse->ir->arena, cse->available,
+                                     cse->availableSize, previousSize,
+                                     sizeof(size_t));
+  }
+
+  cse->available[cse->availableLength++] = index;
+}
+
+// replaces the node with a temp if an equal one was computed before it,
+// otherwise visits its operands in evaluation order
+static void replaceCommon(struct Cse* cse, size_t index) {
+  if (index == NO_NODE)
+    return;
+
+  struct Node* node = &cse->ir->nodes[index];
+  bool candidate = reusable(cse->ir, index);
+
+  for (size_t i = 0; candidate && i < cse->availableLength; i++) {
+    struct Node* source = &cse->ir->nodes[cse->available[i]];
+    if (!sameExpr(cse, cse->available[i], index))
+      continue;
+
+    if (source->temp == NO_TEMP) {
+      if (cse->temps == MAX_TEMPS)
+        break;
+
+      source->temp = cse->temps;
+      cse->sources[cse->temps++] = cse->available[i];
+    }
+
+    node->type = NODE_TEMP;
+    node->temp = source->temp;
+    return;
+  }
+
+  bool shortCircuit =
+      node->type == NODE_BINARY && (node->op == OP_AND || node->op == OP_OR);
+
+  replaceCommon(cse, node->left);
+  cse->conditional += shortCircuit;
+  replaceCommon(cse, node->right);
+  cse->conditional -= shortCircuit;
+
+  if (node->type == NODE_CALL) {
+    // the function may assign any global and reuses the temps
+    cse->availableLength = 0;
+  } else if (node->type == NODE_ASSIGN) {
+    forgetReads(cse, NODE_READ, node->slot);
+  } else if (node->type == NODE_SET_LOCAL) {
+    forgetReads(cse, NODE_LOCAL, node->slot);
+  } else if (candidate && cse->conditional == 0) {
+    makeAvailable(cse, index);
+  }
+}
+
+void eliminateCommonSubexpressions(struct Ir* ir, size_t root) {
+  struct Cse cse = {.ir = ir,
+                    .available = ir->available,
+                    .availableSize = ir->availableSize,
+                    .temps = 0,
+                    .conditional = 0};
+  replaceCommon(&cse, root);
+
+  ir->available = cse.available;
+  ir->availableSize = cse.availableSize;
+}
+
+// dead store elimination
+
+// how the unit uses a global
+struct Uses {
+  size_t reads; // not counting the target of an assignment
+  size_t declarations;
+  // indices of the top level statements they are part of
+  size_t declaredAt, firstAssignedAt;
+  bool valueUsed; // an assignment to it is part of a bigger expression
+  enum ValueType type;
+};
+
+static void countUses(struct Ir* ir, struct Uses* uses, size_t index,
+                      size_t statement, bool discarded) {
+  if (index == NO_NODE)
+    return;
+
+  struct Node* node = &ir->nodes[index];
+
+  switch (node->type) {
+    case NODE_READ:
+      uses[node->slot].reads++;
+      break;
+    case NODE_ASSIGN: {
+      struct Uses* use = &uses[node->slot];
+      struct Node* target = &ir->nodes[node->left];
+
+      if (!discarded)
+        use->valueUsed = true;
+      if (statement < use->firstAssignedAt)
+        use->firstAssignedAt = statement;
+      if (target->type != NODE_READ || target->slot != node->slot)
+        countUses(ir, uses, node->left, statement, false);
+
+      countUses(ir, uses, node->right, statement, false);
+      break;
+    }
+    case NODE_DECLARE:
+      uses[node->slot].declarations++;
+      uses[node->slot].declaredAt = statement;
+      countUses(ir, uses, node->right, statement, false);
+      break;
+    case NODE_EXPR:
+      countUses(ir, uses, node->right, statement, !node->print);
+      break;
+    case NODE_BLOCK:
+      for (size_t i = node->body; i != NO_NODE; i = ir->nodes[i].next) {
+        countUses(ir, uses, i, statement, false);
+      }
+      break;
+    case NODE_IF:
+    case NODE_WHILE:
+      countUses(ir, uses, node->left, statement, false);
+      countUses(ir, uses, node->body, statement, false);
+      countUses(ir, uses, node->orElse, statement, false);
+      break;
+    case NODE_FUNCTION:
+      // the body may run at any point after the function is created, so what
+      // it assigns counts as assigned before every statement
+      countUses(ir, uses, node->body, 0, false);
+      break;
+    default:
+      countUses(ir, uses, node->left, statement, false);
+      countUses(ir, uses, node->right, statement, false);
+  }
+}
+
+// the assignment a statement consists of, NULL if it is something else
+static struct Node* assignmentStatement(struct Ir* ir, struct Node* node) {
+  if (node->type != NODE_EXPR || node->print)
+    return NULL;
+
+  struct Node* assign = &ir->nodes[node->right];
+  return assign->type == NODE_ASSIGN ? assign : NULL;
+}
+
+static bool removable(struct Uses* use) {
+  return use->reads == 0 && use->declarations == 1 && !use->valueUsed &&
+         use->type != VALUE_NONE &&
+         (use->firstAssignedAt == SIZE_MAX ||
+          use->firstAssignedAt > use->declaredAt);
+}
+
+// visits the statement and the ones nested in it, either forgetting the type
+// of globals that are assigned a value of another one or removing the stores
+// to removable globals
+static void visitStores(struct Ir* ir, struct Uses* uses, size_t index,
+                        bool remove) {
+  if (index == NO_NODE)
+    return;
+
+  struct Node* node = &ir->nodes[index];
+  struct Node* assign = assignmentStatement(ir, node);
+
+  switch (node->type) {
+    case NODE_BLOCK:
+      for (size_t i = node->body; i != NO_NODE; i = ir->nodes[i].next) {
+        visitStores(ir, uses, i, remove);
+      }
+      break;
+    case NODE_IF:
+    case NODE_WHILE:
+      visitStores(ir, uses, node->body, remove);
+      visitStores(ir, uses, node->orElse, remove);
+      break;
+    case NODE_DECLARE:
+      // keep evaluating the value, it may still raise an error
+      if (remove && removable(&uses[node->slot])) {
+        node->type = NODE_EXPR;
+        node->print = false;
+      }
+      break;
+    default:
+      if (assign == NULL) {
+        break;
+      } else if (!remove &&
+                 inferType(ir, assign->right) != uses[assign->slot].type) {
+        uses[assign->slot].type = VALUE_NONE;
+      } else if (remove && removable(&uses[assign->slot])) {
+        node->right = assign->right;
+      }
+  }
+}
+
+void eliminateDeadStores(struct Ir* ir) {
+  size_t slots = 0;
+  for (size_t i = 0; i < ir->length; i++) {
+    struct Node* node = &ir->nodes[i];
+    if ((node->type == NODE_READ || node->type == NODE_ASSIGN ||
+         node->type == NODE_DECLARE) &&
+        node->slot >= slots) {
+      slots = node->slot + 1;
+    }
+  }
+
+  struct Uses* uses = arenaAllocate(ir->arena, slots * sizeof(struct Uses));
+  for (size_t i = 0; i < slots; i++) {
+    uses[i] = (struct Uses){.firstAssignedAt = SIZE_MAX, .type = VALUE_NONE};
+  }
+
+  for (size_t i = 0; i < ir->statementsLength; i++) {
+    countUses(ir, uses, ir->statements[i], i, false);
+  }
+
+  // a store can only go if it cannot fail: the single declaration is at the
+  // top level and runs before any assignment, and every stored value has the
+  // declared type
+  for (size_t i = 0; i < ir->statementsLength; i++) {
+    struct Node* node = &ir->nodes[ir->statements[i]];
+    if (node->type != NODE_DECLARE)
+      continue;
+
+    enum ValueType type = inferType(ir, node->right);
+    if (node->valueType == VALUE_NONE || node->valueType == type) {
+      uses[node->slot].type = type;
+    }
+  }
+
+  for (size_t i = 0; i < ir->statementsLength; i++) {
+    visitStores(ir, uses, ir->statements[i], false);
+  }
+
+  for (size_t i = 0; i < ir->statementsLength; i++) {
+    visitStores(ir, uses, ir->statements[i], true);
+  }
+}
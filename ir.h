@@ -0,0 +1,111 @@
+#pragma once
+
+#include "chunk.h"
+#include "memory.h"
+#include "op.h"
+#include "str.h"
+#include "token.h"
+#include "value.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// nodes refer to each other by 32 bit indices, a unit never gets near that
+// many nodes
+#define NO_NODE UINT32_MAX
+#define NO_TEMP UINT16_MAX
+
+enum NodeType {
+  // expressions, each leaves one value on the stack
+  NODE_CONSTANT,  // value
+  NODE_READ,      // global at slot
+  NODE_UNARY,     // op applied to right
+  NODE_BINARY,    // op applied to left and right, 'and' / 'or' only evaluate
+                  // right if left does not decide the result
+  NODE_ASSIGN,    // stores right into slot and evaluates to left, which is the
+                  // old value of the target
+  NODE_TEMP,      // value an earlier node of the statement saved in temp
+  NODE_LOCAL,     // local at slot of valueType, VALUE_NONE if not known
+  NODE_SET_LOCAL, // like NODE_ASSIGN for the local at slot of valueType
+  NODE_CALL,      // calls left with the slot NODE_ARGs from right on, op is
+                  // OP_TAIL_CALL if the call is returned
+  NODE_ARG,       // argument left followed by the NODE_ARG right, no value of
+                  // its own
+  NODE_FUNCTION,  // function named by token running the body block, with the
+                  // slot NODE_DECLARE_LOCAL parameters from left on
+
+  // statements
+  NODE_DECLARE,       // declares slot of valueType with right as its value
+  NODE_DECLARE_LOCAL, // leaves right on the stack as a local of valueType
+  NODE_EXPR,          // evaluates right and discards it, printing it if print
+  NODE_BLOCK,         // runs the statements from body on, drops its locals
+  NODE_IF,            // runs the body block if left holds, orElse otherwise
+  NODE_WHILE,         // runs the body block as long as left holds
+  NODE_RETURN,        // returns right from the function, none if NO_NODE
+};
+
+// a whole unit is kept as nodes until it is lowered, so they are kept small
+struct Node {
+  enum NodeType type;
+  enum OpCode op;
+  enum ValueType valueType;
+  // where the node was parsed, for errors while lowering it
+  uint32_t line;
+
+  uint32_t left, right;
+
+  // statements only
+  uint32_t body, orElse;
+  uint32_t next; // following statement of the same block or parameter
+
+  uint32_t slot;
+  // temp read by NODE_TEMP, for other nodes the temp their value is also saved
+  // in. NO_TEMP if none
+  uint16_t temp;
+  uint16_t locals; // declared directly in a block
+  bool print;
+
+  union {
+    struct Value value; // constants
+    struct String name; // the token the node was parsed from otherwise
+  } as;
+};
+
+// the parsed compilation unit, a tree per statement. nodes refer to each
+// other by index so the array can grow while parsing
+struct Ir {
+  // owns everything below, it is freed with the rest of the compilation
+  struct Arena* arena;
+
+  struct Node* nodes;
+  size_t size, length;
+
+  // root nodes of the statements in order
+  uint32_t* statements;
+  size_t statementsSize, statementsLength;
+
+  // kept between the statements common subexpressions are eliminated in
+  size_t* available;
+  size_t availableSize;
+};
+
+void initIr(struct Ir* ir, struct Arena* arena);
+// forgets the nodes and statements but keeps their memory for the next ones
+void resetIr(struct Ir* ir);
+
+struct Node makeNode(enum NodeType type, struct Token token);
+size_t addNode(struct Ir* ir, struct Node node);
+void addStatement(struct Ir* ir, size_t node);
+
+// type of the value the expression produces if it does not raise an error,
+// VALUE_NONE if that is only known at runtime
+enum ValueType inferType(struct Ir* ir, size_t index);
+
+// computes repeated subexpressions of an expression statement or a condition
+// once and reuses the value through a temp
+void eliminateCommonSubexpressions(struct Ir* ir, size_t root);
+
+// removes the declaration of and the assignments to globals that are never
+// read. only valid when the unit runs alone on a fresh vm, so not in the REPL
+void eliminateDeadStores(struct Ir* ir);
@@ -0,0 +1,801 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "jit.h"
+
+#include "chunk.h"
+#include "memory.h"
+#include "op.h"
+#include "str.h"
+#include "value.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+
+// a template jit: every instruction becomes a fixed sequence of x86-64 code
+// working on the same value stack as the interpreter. type guards and
+// instructions without a template leave the native code with the offset of
+// the instruction, which the interpreter then runs, raising the same errors
+
+enum Register {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15,
+};
+
+// sse registers share the numbering
+enum { XMM0, XMM1, XMM2 };
+
+// state the native code keeps in callee saved registers
+#define REG_SP RBX      // one past the topmost value
+#define REG_OUT R12     // where the stack top is written back on exit
+#define REG_SLOTS R13   // locals of the running frame
+#define REG_VM R14      // the vm, for its temps
+#define REG_GLOBALS R15 // vm->globals, which does not move during a run
+
+enum Condition {
+  CC_ALWAYS = -1,
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_A = 0x7,
+  CC_P = 0xa,
+  CC_NP = 0xb,
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(struct Value))
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#else
+#define PAYLOAD ((int32_t)offsetof(struct Value, as))
+#define TYPE ((int32_t)offsetof(struct Value, type))
+#endif
+
+// the lowest bit of a bool's payload byte is set for true in both value
+// representations
+#define TRUE_BIT 1
+
+#define TOP_VALUE (-VALUE_SIZE)
+#define BELOW_TOP_VALUE (-2 * VALUE_SIZE)
+
+// a rel32 to patch once the code it jumps to is emitted
+struct Fixup {
+  size_t at;
+  size_t target; // bytecode offset
+  bool exit;     // to the exit of the instruction at target instead of its code
+};
+
+struct Assembler {
+  uint8_t* code;
+  size_t size, length;
+
+  struct Fixup* fixups;
+  size_t fixupsSize, fixupsLength;
+
+  size_t epilogue;
+};
+
+static void emitByte(struct Assembler* a, uint8_t byte) {
+  if (a->length >= a->size) {
+    size_t previousSize = a->size;
+    a->size = nextArraySize(previousSize);
+    a->code = reallocate(a->code, a->size, previousSize, sizeof(uint8_t));
+  }
+
+  a->code[a->length++] = byte;
+}
+
+static void emitBytes(struct Assembler* a, const uint8_t* bytes, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    emitByte(a, bytes[i]);
+  }
+}
+
+static void emit32(struct Assembler* a, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(a, value >> (8 * i));
+  }
+}
+
+static void emit64(struct Assembler* a, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emitByte(a, value >> (8 * i));
+  }
+}
+
+static void rex(struct Assembler* a, bool wide, int reg, int base) {
+  uint8_t prefix = 0x40 | wide << 3 | (reg >> 3) << 2 | base >> 3;
+  if (prefix != 0x40)
+    emitByte(a, prefix);
+}
+
+// modrm for [base + disp], always with a 32 bit displacement
+static void memory(struct Assembler* a, int reg, int base, int32_t disp) {
+  emitByte(a, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP)
+    emitByte(a, 0x24); // sib without an index
+  emit32(a, (uint32_t)disp);
+}
+
+// op between reg and [base + disp], the opcode decides the direction
+static void memoryOp(struct Assembler* a, bool wide, uint8_t op, int reg,
+                     int base, int32_t disp) {
+  rex(a, wide, reg, base);
+  emitByte(a, op);
+  memory(a, reg, base, disp);
+}
+
+// op with an opcode extension on [base + disp], the immediate follows
+static void immediateOp(struct Assembler* a, bool wide, uint8_t op,
+                        int extension, int base, int32_t disp) {
+  memoryOp(a, wide, op, extension, base, disp);
+}
+
+// op between the registers rm and reg
+static void registerOp(struct Assembler* a, bool wide, uint8_t op, int rm,
+                       int reg) {
+  rex(a, wide, reg, rm);
+  emitByte(a, op);
+  emitByte(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// sse op between xmm and [base + disp], prefix 0 if it has none
+static void sseOp(struct Assembler* a, uint8_t prefix, uint8_t op, int xmm,
+                  int base, int32_t disp) {
+  if (prefix != 0)
+    emitByte(a, prefix);
+  rex(a, false, xmm, base);
+  emitByte(a, 0x0f);
+  emitByte(a, op);
+  memory(a, xmm, base, disp);
+}
+
+static void load(struct Assembler* a, int reg, int base, int32_t disp) {
+  memoryOp(a, true, 0x8b, reg, base, disp);
+}
+
+static void store(struct Assembler* a, int base, int32_t disp, int reg) {
+  memoryOp(a, true, 0x89, reg, base, disp);
+}
+
+static void loadImmediate(struct Assembler* a, int reg, uint64_t value) {
+  emitByte(a, 0x48 | reg >> 3);
+  emitByte(a, 0xb8 + (reg & 7));
+  emit64(a, value);
+}
+
+// moves the stack top by a number of values
+static void moveSp(struct Assembler* a, int32_t values) {
+  if (values == 0)
+    return;
+
+  rex(a, true, 0, REG_SP);
+  emitByte(a, 0x81);
+  emitByte(a, (values > 0 ? 0xc0 : 0xe8) | (REG_SP & 7)); // add / sub
+  emit32(a, (uint32_t)(values > 0 ? values : -values) * VALUE_SIZE);
+}
+
+// emits a jump with a zero rel32 and returns where the rel32 is
+static size_t jump(struct Assembler* a, enum Condition condition) {
+  if (condition == CC_ALWAYS) {
+    emitByte(a, 0xe9);
+  } else {
+    emitByte(a, 0x0f);
+    emitByte(a, 0x80 | condition);
+  }
+
+  size_t at = a->length;
+  emit32(a, 0);
+  return at;
+}
+
+static void patch(struct Assembler* a, size_t at, size_t target) {
+  int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(&a->code[at], &rel, sizeof(rel));
+}
+
+// points the jump at the code emitted next
+static void land(struct Assembler* a, size_t at) { patch(a, at, a->length); }
+
+static void addFixup(struct Assembler* a, size_t at, size_t target,
+                     bool exit) {
+  if (a->fixupsLength >= a->fixupsSize) {
+    size_t previousSize = a->fixupsSize;
+    a->fixupsSize = nextArraySize(previousSize);
+    a->fixups = reallocate(a->fixups, a->fixupsSize, previousSize,
+                           sizeof(struct Fixup));
+  }
+
+  a->fixups[a->fixupsLength++] = (struct Fixup){at, target, exit};
+}
+
+static void jumpTo(struct Assembler* a, enum Condition condition,
+                   size_t target) {
+  addFixup(a, jump(a, condition), target, false);
+}
+
+// leaves the native code for the interpreter to run the instruction at offset
+static void exitIf(struct Assembler* a, enum Condition condition,
+                   size_t offset) {
+  addFixup(a, jump(a, condition), offset, true);
+}
+
+static void exitTo(struct Assembler* a, size_t offset) {
+  emitByte(a, 0xb8); // mov eax, offset
+  emit32(a, (uint32_t)offset);
+  patch(a, jump(a, CC_ALWAYS), a->epilogue);
+}
+
+// value representation
+
+static void copyValue(struct Assembler* a, int toBase, int32_t toDisp,
+                      int fromBase, int32_t fromDisp) {
+#ifdef NAN_BOXING
+  load(a, RAX, fromBase, fromDisp);
+  store(a, toBase, toDisp, RAX);
+#else
+  sseOp(a, 0, 0x10, XMM2, fromBase, fromDisp); // movups
+  sseOp(a, 0, 0x11, XMM2, toBase, toDisp);
+#endif
+}
+
+static void storeConstant(struct Assembler* a, int base, int32_t disp,
+                          struct Value value) {
+  uint64_t words[sizeof(struct Value) / 8];
+  memcpy(words, &value, sizeof(words));
+
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    loadImmediate(a, RAX, words[i]);
+    store(a, base, disp + 8 * i, RAX);
+  }
+}
+
+// emits a jump taken if the value does not have the type, returns its rel32
+static size_t jumpUnlessType(struct Assembler* a, int base, int32_t disp,
+                             enum ValueType type) {
+#ifdef NAN_BOXING
+  load(a, RAX, base, disp);
+
+  switch (type) {
+    case VALUE_NUMBER:
+      loadImmediate(a, RCX, QNAN);
+      registerOp(a, true, 0x21, RAX, RCX); // and rax, rcx
+      registerOp(a, true, 0x39, RAX, RCX); // cmp rax, rcx
+      return jump(a, CC_E);
+    case VALUE_BOOL:
+      emitBytes(a, (uint8_t[]){0x48, 0x83, 0xc8, 0x01}, 4); // or rax, 1
+      loadImmediate(a, RCX, QNAN | TAG_TRUE);
+      break;
+    case VALUE_FUNCTION:
+      loadImmediate(a, RCX, SIGN_BIT | QNAN);
+      registerOp(a, true, 0x21, RAX, RCX);
+      break;
+    case VALUE_NONE:
+      loadImmediate(a, RCX, QNAN | TAG_NONE);
+      break;
+    case VALUE_UNDECLARED:
+      loadImmediate(a, RCX, QNAN | TAG_UNDECLARED);
+      break;
+  }
+
+  registerOp(a, true, 0x39, RAX, RCX);
+  return jump(a, CC_NE);
+#else
+  immediateOp(a, false, 0x81, 7, base, disp + TYPE); // cmp dword
+  emit32(a, type);
+  return jump(a, CC_NE);
+#endif
+}
+
+static void guardType(struct Assembler* a, int base, int32_t disp,
+                      enum ValueType type, size_t offset) {
+  addFixup(a, jumpUnlessType(a, base, disp, type), offset, true);
+}
+
+// exits unless both values have the same type, which has to be a number or a
+// bool. covers an undeclared global, which has neither
+static void guardSameType(struct Assembler* a, int base, int32_t disp,
+                          int otherBase, int32_t otherDisp, size_t offset) {
+#ifdef NAN_BOXING
+  size_t notNumber = jumpUnlessType(a, base, disp, VALUE_NUMBER);
+  guardType(a, otherBase, otherDisp, VALUE_NUMBER, offset);
+  size_t done = jump(a, CC_ALWAYS);
+
+  land(a, notNumber);
+  guardType(a, base, disp, VALUE_BOOL, offset);
+  guardType(a, otherBase, otherDisp, VALUE_BOOL, offset);
+  land(a, done);
+#else
+  memoryOp(a, false, 0x8b, RAX, base, disp + TYPE);    // mov eax, type
+  emitByte(a, 0x3d);                                   // cmp eax, imm32
+  emit32(a, VALUE_UNDECLARED);
+  exitIf(a, CC_E, offset);
+  memoryOp(a, false, 0x3b, RAX, otherBase, otherDisp + TYPE); // cmp eax
+  exitIf(a, CC_NE, offset);
+#endif
+}
+
+// stores al, which is 0 or 1, as a bool
+static void storeBool(struct Assembler* a, int base, int32_t disp) {
+#ifdef NAN_BOXING
+  emitBytes(a, (uint8_t[]){0x0f, 0xb6, 0xc0}, 3); // movzx eax, al
+  loadImmediate(a, RCX, QNAN | TAG_FALSE);
+  registerOp(a, true, 0x09, RAX, RCX); // or rax, rcx
+  store(a, base, disp, RAX);
+#else
+  immediateOp(a, false, 0xc7, 0, base, disp + TYPE);
+  emit32(a, VALUE_BOOL);
+  memoryOp(a, false, 0x88, RAX, base, disp + PAYLOAD); // mov byte, al
+#endif
+}
+
+// stores xmm0 as a number, typed if the slot holds a number already
+static void storeNumber(struct Assembler* a, int base, int32_t disp,
+                        bool typed) {
+  sseOp(a, 0xf2, 0x11, XMM0, base, disp + PAYLOAD); // movsd
+#ifdef NAN_BOXING
+  (void)typed;
+#else
+  if (!typed) {
+    immediateOp(a, false, 0xc7, 0, base, disp + TYPE);
+    emit32(a, VALUE_NUMBER);
+  }
+#endif
+}
+
+// templates
+
+static void emitArithmetic(struct Assembler* a, enum OpCode op,
+                           size_t offset) {
+  guardType(a, REG_SP, BELOW_TOP_VALUE, VALUE_NUMBER, offset);
+  guardType(a, REG_SP, TOP_VALUE, VALUE_NUMBER, offset);
+
+  if (op == OP_DIVIDE) {
+    // the interpreter reports the division by zero
+    sseOp(a, 0xf2, 0x10, XMM1, REG_SP, TOP_VALUE + PAYLOAD);
+    emitBytes(a, (uint8_t[]){0x66, 0x0f, 0x57, 0xd2}, 4); // xorpd xmm2, xmm2
+    emitBytes(a, (uint8_t[]){0x66, 0x0f, 0x2e, 0xca}, 4); // ucomisd xmm1, xmm2
+    exitIf(a, CC_E, offset);
+
+    sseOp(a, 0xf2, 0x10, XMM0, REG_SP, BELOW_TOP_VALUE + PAYLOAD);
+    emitBytes(a, (uint8_t[]){0xf2, 0x0f, 0x5e, 0xc1}, 4); // divsd xmm0, xmm1
+  } else {
+    uint8_t code = op == OP_ADD        ? 0x58
+                   : op == OP_SUBTRACT ? 0x5c
+                                       : 0x59;
+    sseOp(a, 0xf2, 0x10, XMM0, REG_SP, BELOW_TOP_VALUE + PAYLOAD);
+    sseOp(a, 0xf2, code, XMM0, REG_SP, TOP_VALUE + PAYLOAD);
+  }
+
+  storeNumber(a, REG_SP, BELOW_TOP_VALUE, true);
+  moveSp(a, -1);
+}
+
+static void emitComparison(struct Assembler* a, enum OpCode op,
+                           size_t offset) {
+  guardType(a, REG_SP, BELOW_TOP_VALUE, VALUE_NUMBER, offset);
+  guardType(a, REG_SP, TOP_VALUE, VALUE_NUMBER, offset);
+
+  // unordered operands set the carry flag, so a NaN compares false
+  bool swap = op == OP_LESSER || op == OP_LESSER_EQUAL;
+  bool orEqual = op == OP_GREATER_EQUAL || op == OP_LESSER_EQUAL;
+
+  sseOp(a, 0xf2, 0x10, XMM0, REG_SP,
+        (swap ? TOP_VALUE : BELOW_TOP_VALUE) + PAYLOAD);
+  sseOp(a, 0x66, 0x2e, XMM0, REG_SP,
+        (swap ? BELOW_TOP_VALUE : TOP_VALUE) + PAYLOAD); // ucomisd
+  emitBytes(a, (uint8_t[]){0x0f, 0x90 | (orEqual ? CC_AE : CC_A), 0xc0}, 3);
+
+  storeBool(a, REG_SP, BELOW_TOP_VALUE);
+  moveSp(a, -1);
+}
+
+static void emitEquality(struct Assembler* a, bool equal, size_t offset) {
+  size_t notNumber =
+      jumpUnlessType(a, REG_SP, BELOW_TOP_VALUE, VALUE_NUMBER);
+  guardType(a, REG_SP, TOP_VALUE, VALUE_NUMBER, offset);
+
+  // NaN is not equal to anything, ucomisd sets the parity flag for it
+  sseOp(a, 0xf2, 0x10, XMM0, REG_SP, BELOW_TOP_VALUE + PAYLOAD);
+  sseOp(a, 0x66, 0x2e, XMM0, REG_SP, TOP_VALUE + PAYLOAD);
+  if (equal) {
+    emitBytes(a, (uint8_t[]){0x0f, 0x94, 0xc0}, 3); // sete al
+    emitBytes(a, (uint8_t[]){0x0f, 0x9b, 0xc1}, 3); // setnp cl
+    emitBytes(a, (uint8_t[]){0x20, 0xc8}, 2);       // and al, cl
+  } else {
+    emitBytes(a, (uint8_t[]){0x0f, 0x95, 0xc0}, 3); // setne al
+    emitBytes(a, (uint8_t[]){0x0f, 0x9a, 0xc1}, 3); // setp cl
+    emitBytes(a, (uint8_t[]){0x08, 0xc8}, 2);       // or al, cl
+  }
+  size_t done = jump(a, CC_ALWAYS);
+
+  land(a, notNumber);
+  guardType(a, REG_SP, BELOW_TOP_VALUE, VALUE_BOOL, offset);
+  guardType(a, REG_SP, TOP_VALUE, VALUE_BOOL, offset);
+#ifdef NAN_BOXING
+  load(a, RAX, REG_SP, BELOW_TOP_VALUE);
+  memoryOp(a, true, 0x3b, RAX, REG_SP, TOP_VALUE); // cmp rax
+#else
+  memoryOp(a, false, 0x8a, RAX, REG_SP, BELOW_TOP_VALUE + PAYLOAD); // mov al
+  memoryOp(a, false, 0x3a, RAX, REG_SP, TOP_VALUE + PAYLOAD);       // cmp al
+#endif
+  emitBytes(a, (uint8_t[]){0x0f, equal ? 0x94 : 0x95, 0xc0}, 3);
+
+  land(a, done);
+  storeBool(a, REG_SP, BELOW_TOP_VALUE);
+  moveSp(a, -1);
+}
+
+// pops a bool and jumps if its value is jumpIf
+static void emitConditionalJump(struct Assembler* a, bool jumpIf,
+                                size_t target, size_t offset) {
+  guardType(a, REG_SP, TOP_VALUE, VALUE_BOOL, offset);
+  memoryOp(a, false, 0x8a, RAX, REG_SP, TOP_VALUE + PAYLOAD); // mov al
+  moveSp(a, -1);
+  emitBytes(a, (uint8_t[]){0xa8, TRUE_BIT}, 2); // test al, TRUE_BIT
+  jumpTo(a, jumpIf ? CC_NE : CC_E, target);
+}
+
+static void emitCall(struct Assembler* a, void (*function)(struct Value*)) {
+  uintptr_t address = (uintptr_t)function;
+  loadImmediate(a, RAX, address);
+  emitBytes(a, (uint8_t[]){0xff, 0xd0}, 2); // call rax
+}
+
+static int32_t globalDisp(size_t slot) { return (int32_t)slot * VALUE_SIZE; }
+
+static int32_t tempDisp(size_t temp) {
+  return (int32_t)(offsetof(struct VM, temps) + temp * sizeof(struct Value));
+}
+
+static size_t readOperand(const uint8_t* code, bool wide) {
+  return wide ? (size_t)code[1] | (size_t)code[2] << 8 | (size_t)code[3] << 16
+              : code[1];
+}
+
+// emits the template of the instruction at offset
+static void emitInstruction(struct Assembler* a, struct Chunk* chunk,
+                            size_t offset) {
+  const uint8_t* code = &chunk->code[offset];
+  struct Value* constants = chunk->values.values;
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      size_t index = readOperand(code, code[0] == OP_CONSTANT_LONG);
+      storeConstant(a, REG_SP, 0, constants[index]);
+      moveSp(a, 1);
+      break;
+    }
+    case OP_POP:
+      moveSp(a, -1);
+      break;
+    case OP_PRINT:
+    case OP_PRINT_POP:
+      memoryOp(a, true, 0x8d, RDI, REG_SP, TOP_VALUE); // lea rdi
+      emitCall(a, printValue);
+      if (code[0] == OP_PRINT_POP)
+        moveSp(a, -1);
+      break;
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+      guardType(a, REG_SP, TOP_VALUE, VALUE_NUMBER, offset);
+      // btc qword [top], 63 flips the sign
+      rex(a, true, 0, REG_SP);
+      emitBytes(a, (uint8_t[]){0x0f, 0xba}, 2);
+      memory(a, 7, REG_SP, TOP_VALUE + PAYLOAD);
+      emitByte(a, 63);
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM_NUM:
+      emitArithmetic(a, OP_ADD, offset);
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM_NUM:
+      emitArithmetic(a, OP_SUBTRACT, offset);
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM_NUM:
+      emitArithmetic(a, OP_MULTIPLY, offset);
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM_NUM:
+      emitArithmetic(a, OP_DIVIDE, offset);
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM_NUM:
+      emitComparison(a, OP_GREATER, offset);
+      break;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM_NUM:
+      emitComparison(a, OP_GREATER_EQUAL, offset);
+      break;
+    case OP_LESSER:
+    case OP_LESSER_NUM_NUM:
+      emitComparison(a, OP_LESSER, offset);
+      break;
+    case OP_LESSER_EQUAL:
+    case OP_LESSER_EQUAL_NUM_NUM:
+      emitComparison(a, OP_LESSER_EQUAL, offset);
+      break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM_NUM:
+      emitEquality(a, true, offset);
+      break;
+    case OP_NOT_EQUAL:
+    case OP_NOT_EQUAL_NUM_NUM:
+      emitEquality(a, false, offset);
+      break;
+    case OP_NOT:
+      guardType(a, REG_SP, TOP_VALUE, VALUE_BOOL, offset);
+      immediateOp(a, false, 0x80, 6, REG_SP, TOP_VALUE + PAYLOAD); // xor byte
+      emitByte(a, TRUE_BIT);
+      break;
+    case OP_AND:
+    case OP_OR:
+      // true and false only differ in TRUE_BIT
+      guardType(a, REG_SP, BELOW_TOP_VALUE, VALUE_BOOL, offset);
+      guardType(a, REG_SP, TOP_VALUE, VALUE_BOOL, offset);
+      memoryOp(a, false, 0x8a, RAX, REG_SP, TOP_VALUE + PAYLOAD); // mov al
+      memoryOp(a, false, code[0] == OP_AND ? 0x20 : 0x08, RAX, REG_SP,
+               BELOW_TOP_VALUE + PAYLOAD); // and / or byte, al
+      moveSp(a, -1);
+      break;
+    case OP_READ:
+    case OP_READ_LONG: {
+      int32_t global = globalDisp(readOperand(code, code[0] == OP_READ_LONG));
+#ifdef NAN_BOXING
+      load(a, RAX, REG_GLOBALS, global);
+      loadImmediate(a, RCX, QNAN | TAG_UNDECLARED);
+      registerOp(a, true, 0x39, RAX, RCX);
+      exitIf(a, CC_E, offset);
+      store(a, REG_SP, 0, RAX);
+#else
+      immediateOp(a, false, 0x81, 7, REG_GLOBALS, global + TYPE);
+      emit32(a, VALUE_UNDECLARED);
+      exitIf(a, CC_E, offset);
+      copyValue(a, REG_SP, 0, REG_GLOBALS, global);
+#endif
+      moveSp(a, 1);
+      break;
+    }
+    case OP_ASSIGN:
+    case OP_ASSIGN_LONG: {
+      int32_t global =
+          globalDisp(readOperand(code, code[0] == OP_ASSIGN_LONG));
+      guardSameType(a, REG_GLOBALS, global, REG_SP, TOP_VALUE, offset);
+      copyValue(a, REG_GLOBALS, global, REG_SP, TOP_VALUE);
+      moveSp(a, -1);
+      break;
+    }
+    case OP_READ_CONST_ADD: {
+      struct Value constant = constants[code[2]];
+      if (!IS_NUMBER(constant)) {
+        exitTo(a, offset);
+        break;
+      }
+
+      // an undeclared global is not a number either
+      double number = AS_NUMBER(constant);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+
+      guardType(a, REG_GLOBALS, globalDisp(code[1]), VALUE_NUMBER, offset);
+      sseOp(a, 0xf2, 0x10, XMM0, REG_GLOBALS, globalDisp(code[1]) + PAYLOAD);
+      loadImmediate(a, RAX, bits);
+      emitBytes(a, (uint8_t[]){0x66, 0x48, 0x0f, 0x6e, 0xc8}, 5); // movq
+      emitBytes(a, (uint8_t[]){0xf2, 0x0f, 0x58, 0xc1}, 4); // addsd
+      storeNumber(a, REG_SP, 0, false);
+      moveSp(a, 1);
+      break;
+    }
+    case OP_STORE_TEMP:
+      copyValue(a, REG_VM, tempDisp(code[1]), REG_SP, TOP_VALUE);
+      break;
+    case OP_LOAD_TEMP:
+      copyValue(a, REG_SP, 0, REG_VM, tempDisp(code[1]));
+      moveSp(a, 1);
+      break;
+    case OP_GET_LOCAL:
+      copyValue(a, REG_SP, 0, REG_SLOTS, code[1] * VALUE_SIZE);
+      moveSp(a, 1);
+      break;
+    case OP_SET_LOCAL_CHECKED:
+      guardSameType(a, REG_SLOTS, code[1] * VALUE_SIZE, REG_SP, TOP_VALUE,
+                    offset);
+      // fallthrough
+    case OP_SET_LOCAL:
+      copyValue(a, REG_SLOTS, code[1] * VALUE_SIZE, REG_SP, TOP_VALUE);
+      moveSp(a, -1);
+      break;
+    case OP_POP_LOCALS:
+      moveSp(a, -code[1]);
+      break;
+    case OP_CHECK_TYPE:
+      guardType(a, REG_SP, TOP_VALUE, code[1], offset);
+      break;
+    case OP_JUMP:
+      jumpTo(a, CC_ALWAYS, jumpTarget(chunk->code, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      emitConditionalJump(a, false, jumpTarget(chunk->code, offset), offset);
+      break;
+    case OP_LOOP_IF_TRUE:
+      emitConditionalJump(a, true, jumpTarget(chunk->code, offset), offset);
+      break;
+    case OP_SHORT_AND:
+    case OP_SHORT_OR:
+      // the left operand stays for the operator after the right one
+      guardType(a, REG_SP, TOP_VALUE, VALUE_BOOL, offset);
+      immediateOp(a, false, 0xf6, 0, REG_SP, TOP_VALUE + PAYLOAD); // test
+      emitByte(a, TRUE_BIT);
+      jumpTo(a, code[0] == OP_SHORT_AND ? CC_E : CC_NE,
+             jumpTarget(chunk->code, offset));
+      break;
+    default:
+      // declarations, calls and returns are always left to the interpreter
+      exitTo(a, offset);
+  }
+}
+
+static FILE* perfMap = NULL;
+
+// lets perf attribute samples in the code to the chunk's name
+static void writePerfMap(struct JitCode* jit, struct String name) {
+  if (perfMap == NULL) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+    perfMap = fopen(path, "w");
+    if (perfMap == NULL)
+      return;
+  }
+
+  if (name.length == 0) {
+    name = (struct String){.str = "<fn>", .length = 4};
+  }
+
+  fprintf(perfMap, "%lx %zx toy:%.*s\n", (unsigned long)(uintptr_t)jit->code,
+          jit->size, (int)name.length, name.str);
+  fflush(perfMap);
+}
+
+struct JitCode* compileJit(struct Chunk* chunk, struct String name) {
+  struct Assembler a = {0};
+
+  // entry(sp, slots, vm, address): saves the callee saved registers, which
+  // also aligns the stack for calls, and jumps to the instruction's code
+  emitBytes(&a,
+            (uint8_t[]){0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57},
+            9);
+  registerOp(&a, true, 0x89, REG_OUT, RDI);
+  load(&a, REG_SP, RDI, 0);
+  registerOp(&a, true, 0x89, REG_SLOTS, RSI);
+  registerOp(&a, true, 0x89, REG_VM, RDX);
+  load(&a, REG_GLOBALS, RDX, offsetof(struct VM, globals));
+  emitBytes(&a, (uint8_t[]){0xff, 0xe1}, 2); // jmp rcx
+
+  // exits return the offset of the instruction in eax
+  a.epilogue = a.length;
+  store(&a, REG_OUT, 0, REG_SP);
+  emitBytes(&a,
+            (uint8_t[]){0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b,
+                        0xc3},
+            10);
+
+  uint32_t* entries = malloc(chunk->length * sizeof(uint32_t));
+  for (size_t offset = 0; offset < chunk->length;
+       offset += instructionLength(&chunk->code[offset])) {
+    entries[offset] = a.length;
+    emitInstruction(&a, chunk, offset);
+  }
+
+  // exits of guards are kept out of the way of the code that passes them,
+  // one per instruction
+  size_t lastExit = SIZE_MAX, lastExitAt = 0;
+  for (size_t i = 0; i < a.fixupsLength; i++) {
+    struct Fixup* fixup = &a.fixups[i];
+
+    if (!fixup->exit) {
+      patch(&a, fixup->at, entries[fixup->target]);
+      continue;
+    }
+
+    if (fixup->target != lastExit) {
+      lastExit = fixup->target;
+      lastExitAt = a.length;
+      exitTo(&a, fixup->target);
+    }
+    patch(&a, fixup->at, lastExitAt);
+  }
+  free(a.fixups);
+
+  // written while writable, executed once it is not anymore
+  uint8_t* code = mmap(NULL, a.length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    free(a.code);
+    free(entries);
+    return NULL;
+  }
+
+  memcpy(code, a.code, a.length);
+  free(a.code);
+
+  // policies like selinux's execmem can refuse to make it executable
+  if (mprotect(code, a.length, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, a.length);
+    free(entries);
+    return NULL;
+  }
+
+  struct JitCode* jit = malloc(sizeof(struct JitCode));
+  jit->code = code;
+  jit->size = a.length;
+  jit->entries = entries;
+
+  writePerfMap(jit, name);
+  return jit;
+}
+
+void freeJitCode(struct JitCode* jit) {
+  if (jit == NULL)
+    return;
+
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+size_t runJit(struct JitCode* jit, size_t offset, struct VM* vm,
+              struct Value** sp, struct Value* slots) {
+  typedef size_t (*Entry)(struct Value**, struct Value*, struct VM*,
+                          uint8_t*);
+
+  // iso c has no conversion from data to function pointers
+  Entry entry;
+  memcpy(&entry, &jit->code, sizeof(entry));
+
+  return entry(sp, slots, vm, jit->code + jit->entries[offset]);
+}
+
+#else
+
+struct JitCode* compileJit(struct Chunk* chunk, struct String name) {
+  (void)chunk;
+  (void)name;
+  return NULL;
+}
+
+void freeJitCode(struct JitCode* jit) { (void)jit; }
+
+size_t runJit(struct JitCode* jit, size_t offset, struct VM* vm,
+              struct Value** sp, struct Value* slots) {
+  (void)jit;
+  (void)vm;
+  (void)sp;
+  (void)slots;
+  return offset;
+}
+
+#endif
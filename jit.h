@@ -0,0 +1,40 @@
+#pragma once
+
+#include "str.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Chunk;
+struct Value;
+struct VM;
+
+// the jit emits x86-64 code and needs mmap to make it executable, elsewhere
+// compileJit always fails and the vm keeps interpreting
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#endif
+
+// native code for a chunk that can be entered at any of its instructions.
+// simple instructions run natively while the operands have the types they
+// expect, everything else is left to the interpreter
+struct JitCode {
+  uint8_t* code; // executable mapping
+  size_t size;
+
+  // native offset of the code for each bytecode offset, only meaningful at
+  // the start of an instruction
+  uint32_t* entries;
+};
+
+// NULL if the platform is not supported or the memory cannot be mapped and
+// made executable. the
+// code is listed under the name in /tmp/perf-<pid>.map for perf
+struct JitCode* compileJit(struct Chunk* chunk, struct String name);
+void freeJitCode(struct JitCode* jit);
+
+// runs the native code from the instruction at offset until it reaches one
+// that the interpreter has to run, whose offset it returns. sp and slots are
+// the stack top and the frame's locals, without a cached top of the stack
+size_t runJit(struct JitCode* jit, size_t offset, struct VM* vm,
+              struct Value** sp, struct Value* slots);
@@ -1,124 +1,182 @@
 #include "map.h"
 
 #include "memory.h"
-#include "value.h"
 
-#include <inttypes.h>
-#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
-#define MAX_MAP_SIZE_MULTIPLIER 0.75
+// the table grows once it is 3/4 full
+#define MAX_MAP_LOAD(size) ((size) / 4 * 3)
+
+// set in every stored hash so that 0 means empty. the bits below it are the
+// hash's own, which limits the table to 2^31 entries
+#define OCCUPIED 0x80000000u
+
+static uint32_t storedHash(const struct Symbol* key) {
+  return (uint32_t)(key->hash & (OCCUPIED - 1)) | OCCUPIED;
+}
+
+// how far the entry at index is from the one its hash points to
+static size_t distance(struct Map* map, uint32_t hash, size_t index) {
+  return (index - hash) & (map->size - 1);
+}
 
 void initMap(struct Map* map) {
   map->entries = NULL;
   map->length = 0;
   map->size = 0;
+  map->allocator = &mallocAllocator;
 }
 
-// FNV-1A hash function
-static uint64_t hash(struct String* string) {
-#define FNV_OFFSET_BASIS (14695981039346656037ULL)
-#define FNV_PRIME (1099511628211ULL)
-
-  uint64_t hash_ = FNV_OFFSET_BASIS;
+// adds the entry or updates the slot of its key. a key in the map is always
+// found before the first place the entry could take
+static void insert(struct Map* map, struct Entry entry) {
+  size_t mask = map->size - 1;
+  size_t index = entry.hash & mask;
+
+  for (size_t probed = 0;; probed++, index = (index + 1) & mask) {
+    struct Entry* stored = &map->entries[index];
+    if (stored->hash == 0) {
+      *stored = entry;
+      map->length++;
+      return;
+    } else if (stored->key == entry.key) {
+      stored->slot = entry.slot;
+      return;
+    }
 
-  for (size_t i = 0; i < string->length; i++) {
-    hash_ ^= string->str[i];
-    hash_ *= FNV_PRIME;
+    // the poorer entry takes the place and the richer one moves on
+    size_t storedDistance = distance(map, stored->hash, index);
+    if (storedDistance < probed) {
+      struct Entry displaced = *stored;
+      *stored = entry;
+      entry = displaced;
+      probed = storedDistance;
+    }
   }
-
-  return hash_;
-
-#undef FNV_OFFSET_BASIS
-#undef FNV_PRIME
 }
 
-static void reallocateMap(struct Map* map) {
-  size_t oldSize = map->size;
-  map->size = nextArraySize(oldSize);
-
-  struct Entry* newEntries =
-      reallocate(NULL, map->size, oldSize, sizeof(struct Entry));
+static void resize(struct Map* map, size_t size) {
+  struct Map resized = {
+      .entries = reallocateWith(map->allocator, MEMORY_MAP, NULL, size, 0,
+                                sizeof(struct Entry)),
+      .length = 0,
+      .size = size,
+      .allocator = map->allocator,
+  };
+  memset(resized.entries, 0, size * sizeof(struct Entry));
 
   for (size_t i = 0; i < map->size; i++) {
-    newEntries->key.length = 0;
-    newEntries->key.str = NULL;
+    if (map->entries[i].hash != 0) {
+      insert(&resized, map->entries[i]);
+    }
+  }
+
+  deinitMap(map);
+  *map = resized;
+}
 
-    // can leave newEntries->value as is
+// the smallest size that holds length entries
+static size_t sizeFor(size_t length) {
+  size_t size = 0;
+  while (length > MAX_MAP_LOAD(size)) {
+    size = nextArraySize(size);
   }
+  return size;
+}
 
-  if (map->entries == NULL) {
-    map->entries = newEntries;
-    return;
+void reserveMap(struct Map* map, size_t length) {
+  if (length > MAX_MAP_LOAD(map->size)) {
+    resize(map, sizeFor(length));
   }
+}
 
-  struct Map newMap;
-  initMap(&newMap);
+void shrinkMap(struct Map* map) {
+  size_t size = sizeFor(map->length);
+  if (size == 0) {
+    deinitMap(map);
+  } else if (size < map->size) {
+    resize(map, size);
+  }
+}
 
-  newMap.entries = newEntries;
-  newMap.length = map->length;
-  newMap.size = map->size;
+struct Entry* getMap(struct Map* map, const struct Symbol* key) {
+  if (map->size == 0)
+    return NULL;
 
-  for (size_t i = 0; i < oldSize; i++) {
-    struct Entry* currentEntry = &map->entries[i];
-    if (currentEntry == NULL)
-      continue;
+  uint32_t hash = storedHash(key);
+  size_t mask = map->size - 1;
+  size_t index = hash & mask;
 
-    setMap(&newMap, currentEntry);
-  }
+  for (size_t probed = 0;; probed++, index = (index + 1) & mask) {
+    struct Entry* entry = &map->entries[index];
 
-  deinitMap(map);
-  *map = newMap;
-}
+    // the key would have taken the place of an entry closer to its home
+    if (entry->hash == 0 || distance(map, entry->hash, index) < probed)
+      return NULL;
 
-void setMap(struct Map* map, struct Entry* entry) {
-  if (map->length >= (map->size * MAX_MAP_SIZE_MULTIPLIER)) {
-    reallocateMap(map);
+    if (entry->key == key)
+      return entry;
   }
+}
 
-  size_t index = hash(&entry->key) % (map->size - 1);
-
-  for (;;) {
-    struct Entry* map_entry = &map->entries[index];
-
-    if (map_entry->key.str != NULL) {
-      if (map_entry->key.length == entry->key.length &&
-          memcmp(map_entry->key.str, entry->key.str, map_entry->key.length) ==
-              0) { // found existing entry
-        map_entry->value = entry->value;
-        break;
-      } else {
-        index++;
-      }
-    } else { // empty slot -> new entry
-      *map_entry = *entry;
-      break;
+void setMap(struct Map* map, struct Entry* entry) {
+  // updating a key must not grow the table
+  if (map->length + 1 > MAX_MAP_LOAD(map->size)) {
+    struct Entry* existing = getMap(map, entry->key);
+    if (existing != NULL) {
+      existing->slot = entry->slot;
+      return;
     }
+
+    reserveMap(map, map->length + 1);
   }
+
+  struct Entry added = *entry;
+  added.hash = storedHash(entry->key);
+  insert(map, added);
 }
 
-struct Entry* getMap(struct Map* map, struct String* key) {
-  if (map->entries == NULL)
-    return NULL;
+bool removeMap(struct Map* map, const struct Symbol* key) {
+  struct Entry* entry = getMap(map, key);
+  if (entry == NULL)
+    return false;
 
-  size_t index = hash(key) % (map->size - 1);
+  // the entries after it move back one place until one is already at home,
+  // leaving the table as if the key had never been added
+  size_t mask = map->size - 1;
+  size_t index = entry - map->entries;
+  for (;;) {
+    size_t next = (index + 1) & mask;
+    struct Entry* moved = &map->entries[next];
+    if (moved->hash == 0 || distance(map, moved->hash, next) == 0)
+      break;
 
-  for (;;) { // not an infinite loop since there will always be an empty entry
-    struct Entry* entry = &map->entries[index++];
+    map->entries[index] = *moved;
+    index = next;
+  }
 
-    if (entry->key.length == 0) { // empty
-      return NULL;
-    }
+  map->entries[index].hash = 0;
+  map->length--;
+  return true;
+}
 
-    if (key->length == entry->key.length &&
-        memcmp(entry->key.str, key->str, key->length) == 0) { // found it
-      return entry;
-    }
+struct Entry* nextMap(struct Map* map, size_t* index) {
+  for (; *index < map->size; (*index)++) {
+    if (map->entries[*index].hash != 0)
+      return &map->entries[(*index)++];
   }
+
+  return NULL;
 }
 
 void deinitMap(struct Map* map) {
-  free(map->entries);
+  freeWith(map->allocator, MEMORY_MAP, map->entries, map->size,
+           sizeof(struct Entry));
 
-  initMap(map);
+  map->entries = NULL;
+  map->length = 0;
+  map->size = 0;
 }
@@ -1,21 +1,42 @@
 #pragma once
 
+#include "memory.h"
 #include "str.h"
-#include "value.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+// maps variable names to their global slot. a robin hood hash table: an entry
+// that is further from its home than the one in its way takes that place,
+// which keeps probes short and lets a lookup stop as soon as it passes where
+// the key would be. the low bits of every key's hash are kept in its entry,
+// so probing and growing do not touch the keys, and an entry takes 16 bytes
 struct Entry {
-  struct String key;
-  struct Value value;
+  const struct Symbol* key;
+  uint32_t slot;
+  uint32_t hash; // set by the map, 0 if the entry is empty
 };
 
 struct Map {
   struct Entry* entries;
-  size_t length, size;
+  size_t length, size; // the size is 0 or a power of two
+  struct Allocator* allocator; // malloc unless set after initMap
 };
 
 void initMap(struct Map* map);
-struct Entry* getMap(struct Map* map, struct String* key);
+struct Entry* getMap(struct Map* map, const struct Symbol* key);
 void setMap(struct Map* map, struct Entry* entry);
+// false if the key was not in the map
+bool removeMap(struct Map* map, const struct Symbol* key);
 void deinitMap(struct Map* map);
+
+// makes room for length entries in total, so that adding them does not grow
+// the table again
+void reserveMap(struct Map* map, size_t length);
+// resizes the table to the smallest size its entries fit in
+void shrinkMap(struct Map* map);
+
+// the first entry at or after *index, which moves past it, or NULL after the
+// last one. *index starts at 0 and the map may not change in between
+struct Entry* nextMap(struct Map* map, size_t* index);
@@ -1,8 +1,373 @@
 #include "memory.h"
 
+#include <stdbool.h>
+#include <string.h>
+
 size_t nextArraySize(size_t oldSize) { return oldSize < 8 ? 8 : oldSize * 2; }
 
 void* reallocate(void* array, size_t newSize, size_t oldSize, size_t dataSize) {
   (void)oldSize; // not used for now;
   return realloc(array, newSize * dataSize);
 }
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+// allocations bigger than this get a block of their own
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+// enough for any value
+#define ARENA_ALIGNMENT 16
+
+struct ArenaBlock {
+  struct ArenaBlock *next, *previous;
+  size_t used, size;
+};
+
+// the allocations start after the header, which keeps them aligned
+#define ARENA_HEADER                                                           \
+  ((sizeof(struct ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+static size_t align(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static void* blockData(struct ArenaBlock* block) {
+  return (char*)block + ARENA_HEADER;
+}
+
+void initArena(struct Arena* arena) { arena->blocks = NULL; }
+
+static struct ArenaBlock* newBlock(size_t size) {
+  struct ArenaBlock* block = malloc(ARENA_HEADER + size);
+  block->next = block->previous = NULL;
+  block->used = 0;
+  block->size = size;
+  return block;
+}
+
+// large blocks go behind the shared one so that it stays first
+static void linkBlock(struct Arena* arena, struct ArenaBlock* block,
+                      bool large) {
+  struct ArenaBlock* first = arena->blocks;
+
+  if (large && first != NULL) {
+    block->previous = first;
+    block->next = first->next;
+    first->next = block;
+  } else {
+    block->next = first;
+    arena->blocks = block;
+  }
+
+  if (block->next != NULL) {
+    block->next->previous = block;
+  }
+}
+
+void* arenaAllocate(struct Arena* arena, size_t size) {
+  size = align(size);
+
+  if (size > ARENA_LARGE_SIZE) {
+    struct ArenaBlock* block = newBlock(size);
+    block->used = size;
+    linkBlock(arena, block, true);
+    return blockData(block);
+  }
+
+  struct ArenaBlock* block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    block = newBlock(ARENA_BLOCK_SIZE);
+    linkBlock(arena, block, false);
+  }
+
+  void* allocation = (char*)blockData(block) + block->used;
+  block->used += size;
+  return allocation;
+}
+
+void* arenaReallocate(struct Arena* arena, void* array, size_t newSize,
+                      size_t oldSize, size_t dataSize) {
+  size_t newBytes = align(newSize * dataSize);
+  size_t oldBytes = align(oldSize * dataSize);
+
+  if (array == NULL)
+    return arenaAllocate(arena, newBytes);
+
+  if (oldBytes > ARENA_LARGE_SIZE) { // has a block of its own
+    struct ArenaBlock* block =
+        realloc((char*)array - ARENA_HEADER, ARENA_HEADER + newBytes);
+    block->used = block->size = newBytes;
+
+    if (block->previous != NULL) {
+      block->previous->next = block;
+    } else {
+      arena->blocks = block;
+    }
+    if (block->next != NULL) {
+      block->next->previous = block;
+    }
+
+    return blockData(block);
+  }
+
+  // the last allocation of the shared block can grow into the rest of it
+  struct ArenaBlock* first = arena->blocks;
+  char* end = (char*)blockData(first) + first->used;
+  if ((char*)array + oldBytes == end && newBytes <= ARENA_LARGE_SIZE &&
+      newBytes - oldBytes <= first->size - first->used) {
+    first->used += newBytes - oldBytes;
+    return array;
+  }
+
+  if (newBytes <= oldBytes)
+    return array;
+
+  void* moved = arenaAllocate(arena, newBytes);
+  memcpy(moved, array, oldBytes);
+  return moved;
+}
+
+void freeArena(struct Arena* arena) {
+  while (arena->blocks != NULL) {
+    struct ArenaBlock* next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+}
+
+void resetArena(struct Arena* arena) {
+  struct ArenaBlock* kept = arena->blocks;
+  if (kept == NULL || kept->size != ARENA_BLOCK_SIZE) {
+    freeArena(arena);
+    return;
+  }
+
+  arena->blocks = kept->next;
+  freeArena(arena);
+
+  kept->next = kept->previous = NULL;
+  kept->used = 0;
+  arena->blocks = kept;
+}
+
+static void* mallocReallocate(struct Allocator* allocator, void* pointer,
+                              size_t newSize, size_t oldSize) {
+  (void)allocator;
+  (void)oldSize;
+
+  if (newSize == 0) {
+    free(pointer);
+    return NULL;
+  }
+
+  return realloc(pointer, newSize);
+}
+
+struct Allocator mallocAllocator = {mallocReallocate, NULL};
+
+static struct MemoryStats stats;
+
+// the counters are updated by the compiler thread of --stream and the vm at
+// the same time
+#ifdef __GNUC__
+#define ADD_COUNT(counter, n)                                                  \
+  __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+#define READ_COUNT(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define ADD_COUNT(counter, n) ((counter) += (n))
+#define READ_COUNT(counter) (counter)
+#endif
+
+static void raisePeak(size_t* peak, size_t bytes) {
+#ifdef __GNUC__
+  size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (seen < bytes &&
+         !__atomic_compare_exchange_n(peak, &seen, bytes, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+#else
+  if (*peak < bytes) {
+    *peak = bytes;
+  }
+#endif
+}
+
+// unsigned arithmetic wraps, so adding the difference also counts frees
+static void count(enum MemoryUse use, size_t newBytes, size_t oldBytes,
+                  bool allocated) {
+  struct MemoryUsage* usage = &stats.uses[use];
+  size_t difference = newBytes - oldBytes;
+
+  size_t bytes = ADD_COUNT(usage->bytes, difference);
+  size_t total = ADD_COUNT(stats.total.bytes, difference);
+  if (newBytes > oldBytes) {
+    raisePeak(&usage->peak, bytes);
+    raisePeak(&stats.total.peak, total);
+  }
+
+  if (allocated) {
+    ADD_COUNT(usage->allocations, 1);
+    ADD_COUNT(stats.total.allocations, 1);
+  }
+}
+
+void* reallocateWith(struct Allocator* allocator, enum MemoryUse use,
+                     void* array, size_t newSize, size_t oldSize,
+                     size_t dataSize) {
+  size_t oldBytes = array != NULL ? oldSize * dataSize : 0;
+  count(use, newSize * dataSize, oldBytes, newSize > 0);
+  if (allocator->counted != NULL) {
+    allocator->counted[use] += newSize * dataSize - oldBytes;
+  }
+
+  return allocator->reallocate(allocator, array, newSize * dataSize,
+                               oldSize * dataSize);
+}
+
+void freeWith(struct Allocator* allocator, enum MemoryUse use, void* array,
+              size_t size, size_t dataSize) {
+  if (array != NULL) {
+    count(use, 0, size * dataSize, false);
+    if (allocator->counted != NULL) {
+      allocator->counted[use] -= size * dataSize;
+    }
+    allocator->reallocate(allocator, array, 0, size * dataSize);
+  }
+}
+
+void getMemoryStats(struct MemoryStats* copy) {
+  for (size_t i = 0; i < MEMORY_USES; i++) {
+    copy->uses[i] = (struct MemoryUsage){
+        .bytes = READ_COUNT(stats.uses[i].bytes),
+        .peak = READ_COUNT(stats.uses[i].peak),
+        .allocations = READ_COUNT(stats.uses[i].allocations),
+    };
+  }
+
+  copy->total = (struct MemoryUsage){
+      .bytes = READ_COUNT(stats.total.bytes),
+      .peak = READ_COUNT(stats.total.peak),
+      .allocations = READ_COUNT(stats.total.allocations),
+  };
+}
+
+const char* memoryUseName(enum MemoryUse use) {
+  switch (use) {
+    case MEMORY_CODE:
+      return "code";
+    case MEMORY_CONSTANTS:
+      return "constants";
+    case MEMORY_STRINGS:
+      return "strings";
+    case MEMORY_MAP:
+      return "map";
+    case MEMORY_FUNCTIONS:
+      return "functions";
+    case MEMORY_VM:
+      return "vm";
+    case MEMORY_USES:
+      break;
+  }
+
+  return "?";
+}
+
+static void printUsage(FILE* out, const char* name,
+                       struct MemoryUsage* usage) {
+  fprintf(out, "%-10s %12zu %12zu %12zu\n", name, usage->bytes, usage->peak,
+          usage->allocations);
+}
+
+void printMemoryStats(FILE* out) {
+  struct MemoryStats copy;
+  getMemoryStats(&copy);
+
+  fprintf(out, "%-10s %12s %12s %12s\n", "memory", "live bytes", "peak bytes",
+          "allocations");
+  for (size_t i = 0; i < MEMORY_USES; i++) {
+    printUsage(out, memoryUseName(i), &copy.uses[i]);
+  }
+  printUsage(out, "total", &copy.total);
+}
+
+#define POOL_SMALLEST ((size_t)16)
+
+// the class of an allocation of size bytes, POOL_CLASSES if it is larger
+// than every class
+static size_t sizeClass(size_t size) {
+  size_t class = 0;
+  while (class < POOL_CLASSES && POOL_SMALLEST << class < size) {
+    class++;
+  }
+  return class;
+}
+
+static void* poolReallocate(struct Allocator* allocator, void* pointer,
+                            size_t newSize, size_t oldSize) {
+  struct Pool* pool = (struct Pool*)allocator;
+  size_t oldClass = sizeClass(oldSize), newClass = sizeClass(newSize);
+
+  if (pointer != NULL && newSize != 0 && oldClass == newClass) {
+    if (newClass < POOL_CLASSES)
+      return pointer; // still fits its class
+
+    // the arena grows the last and the largest allocations in place
+    return arenaReallocate(&pool->arena, pointer, newSize, oldSize, 1);
+  }
+
+  void* allocation = NULL;
+  if (newSize == 0) {
+    // only frees
+  } else if (newClass < POOL_CLASSES && pool->freed[newClass] != NULL) {
+    allocation = pool->freed[newClass];
+    memcpy(&pool->freed[newClass], allocation, sizeof(void*));
+  } else {
+    allocation = arenaAllocate(&pool->arena, newClass < POOL_CLASSES
+                                                 ? POOL_SMALLEST << newClass
+                                                 : newSize);
+  }
+
+  if (pointer != NULL) {
+    if (allocation != NULL) {
+      memcpy(allocation, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+
+    if (oldClass < POOL_CLASSES) {
+      memcpy(pointer, &pool->freed[oldClass], sizeof(void*));
+      pool->freed[oldClass] = pointer;
+    }
+  }
+
+  return allocation;
+}
+
+void initPool(struct Pool* pool) {
+  pool->allocator.reallocate = poolReallocate;
+  pool->allocator.counted = pool->counted;
+  initArena(&pool->arena);
+  for (size_t i = 0; i < POOL_CLASSES; i++) {
+    pool->freed[i] = NULL;
+  }
+  for (size_t i = 0; i < MEMORY_USES; i++) {
+    pool->counted[i] = 0;
+  }
+}
+
+// what was never given back with freeWith goes with the arena
+static void uncountPool(struct Pool* pool) {
+  for (size_t i = 0; i < MEMORY_USES; i++) {
+    count(i, 0, pool->counted[i], false);
+    pool->counted[i] = 0;
+  }
+}
+
+void freePool(struct Pool* pool) {
+  uncountPool(pool);
+  freeArena(&pool->arena);
+}
+
+void resetPool(struct Pool* pool) {
+  uncountPool(pool);
+  resetArena(&pool->arena);
+  for (size_t i = 0; i < POOL_CLASSES; i++) {
+    pool->freed[i] = NULL;
+  }
+}
@@ -1,5 +1,96 @@
 #pragma once
+#include <stdio.h>
 #include <stdlib.h>
 
 size_t nextArraySize(size_t oldSize);
 void* reallocate(void* array, size_t newSize, size_t oldSize, size_t dataSize);
+
+// allocations that are all freed together. small ones are carved out of
+// shared blocks, large ones get a block of their own that grows in place like
+// with reallocate, so growing arrays do not leave copies behind
+struct ArenaBlock;
+
+struct Arena {
+  struct ArenaBlock* blocks; // the shared block being carved first
+};
+
+void initArena(struct Arena* arena);
+void* arenaAllocate(struct Arena* arena, size_t size);
+// like reallocate, the old size has to be the one the array was given
+void* arenaReallocate(struct Arena* arena, void* array, size_t newSize,
+                      size_t oldSize, size_t dataSize);
+void freeArena(struct Arena* arena);
+// frees every allocation but keeps a shared block to carve the next ones from
+void resetArena(struct Arena* arena);
+
+// where the arrays of chunks, maps, functions, global names and the vm come
+// from, so that an embedder can supply its own. the function resizes the
+// allocation at pointer from oldSize to newSize bytes, allocates when pointer
+// is NULL and frees when newSize is 0. an allocator with state of its own
+// starts with this struct and casts the pointer back
+struct Allocator {
+  void* (*reallocate)(struct Allocator* allocator, void* pointer,
+                      size_t newSize, size_t oldSize);
+  // bytes still allocated from it per use, kept by reallocateWith and freeWith
+  // when not NULL, for an allocator that frees everything at once to take
+  // them out of the memory stats
+  size_t* counted;
+};
+
+// malloc, realloc and free, what everything uses unless given another
+extern struct Allocator mallocAllocator;
+
+// what the memory from allocators is used for, counted separately
+enum MemoryUse {
+  MEMORY_CODE,      // bytecode of chunks
+  MEMORY_CONSTANTS, // constant pools of chunks and their indexes
+  MEMORY_STRINGS,   // names of global slots in chunks and global names
+  MEMORY_MAP,       // entries of maps
+  MEMORY_FUNCTIONS, // functions, their names and the lists of them
+  MEMORY_VM,        // the vm's stack and globals
+  MEMORY_USES,
+};
+
+// like reallocate, from the allocator and counted for the use
+void* reallocateWith(struct Allocator* allocator, enum MemoryUse use,
+                     void* array, size_t newSize, size_t oldSize,
+                     size_t dataSize);
+// size is the number of elements the array was given, NULL is ignored
+void freeWith(struct Allocator* allocator, enum MemoryUse use, void* array,
+              size_t size, size_t dataSize);
+
+// bytes allocated and not freed yet, the most there were at once and how
+// often memory was allocated or resized. counted for the whole process and
+// safe to read while other threads allocate
+struct MemoryUsage {
+  size_t bytes, peak, allocations;
+};
+
+struct MemoryStats {
+  struct MemoryUsage uses[MEMORY_USES];
+  struct MemoryUsage total; // its peak is the most all uses had at once
+};
+
+void getMemoryStats(struct MemoryStats* stats);
+const char* memoryUseName(enum MemoryUse use);
+// one line per use and the total
+void printMemoryStats(FILE* out);
+
+// allocations rounded up to a size class, from 16 bytes to 2 KiB, reuse the
+// ones freed in the same class. they and the larger ones are carved out of an
+// arena, so the large ones are only given back when the pool is reset.
+// meant for work with a known end, like compiling and running one script
+#define POOL_CLASSES 8
+
+struct Pool {
+  struct Allocator allocator; // passed wherever an allocator goes
+  struct Arena arena;
+  void* freed[POOL_CLASSES]; // lists linked through their first bytes
+  size_t counted[MEMORY_USES];
+};
+
+void initPool(struct Pool* pool);
+// frees everything allocated from the pool, which can be used again, and
+// counts it as freed in the memory stats
+void resetPool(struct Pool* pool);
+void freePool(struct Pool* pool);
@@ -1,6 +1,8 @@
 #pragma once
 
 enum OpCode {
+  // returns the top of the stack to the caller, or ends the run when the chunk
+  // passed to runVM returns
   OP_RETURN,
   OP_PRINT,
   OP_POP,
@@ -22,4 +24,61 @@ enum OpCode {
   OP_GREATER_EQUAL,
   OP_LESSER,
   OP_LESSER_EQUAL,
+
+  // copy the top of the stack to / push a temp, so a value computed once can
+  // be used again later in the statement
+  OP_STORE_TEMP,
+  OP_LOAD_TEMP,
+
+  // locals live on the value stack, addressed by their index from its bottom.
+  // OP_SET_LOCAL stores a value the compiler proved to have the local's type,
+  // OP_SET_LOCAL_CHECKED compares the types at runtime for locals whose type is
+  // not known while compiling
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
+  OP_SET_LOCAL_CHECKED,
+  OP_POP_LOCALS, // drops the operand's amount of values at the end of a block
+  OP_CHECK_TYPE, // errors unless the top of the stack has the operand's type
+
+  // call the function below the operand's amount of arguments, which become
+  // its first locals. the tail call replaces the frame of the caller
+  OP_CALL,
+  OP_TAIL_CALL,
+
+  // jumps with a 16 bit little endian offset from the end of the instruction.
+  // the conditional ones pop a condition that has to be a bool
+  OP_JUMP,
+  OP_JUMP_IF_FALSE,
+  OP_LOOP_IF_TRUE, // backwards
+  // left operand of a short circuiting 'and' / 'or', which has to be a bool.
+  // jumps over the right one if it decides the result, keeping it on the stack
+  // as the result, and falls through to the right one and OP_AND / OP_OR
+  // otherwise
+  OP_SHORT_AND,
+  OP_SHORT_OR,
+
+  // same as the short forms but with a 24 bit little endian index operand
+  OP_CONSTANT_LONG,
+  OP_ASSIGN_LONG,
+  OP_DECLARE_LONG,
+  OP_READ_LONG,
+
+  // superinstructions emitted by the compiler for common sequences
+  OP_READ_CONST_ADD,
+  OP_CONST_DECLARE,
+  OP_PRINT_POP,
+
+  // specialized forms the vm rewrites generic instructions into at runtime,
+  // never emitted by the compiler
+  OP_NEGATE_NUM,
+  OP_ADD_NUM_NUM,
+  OP_SUBTRACT_NUM_NUM,
+  OP_MULTIPLY_NUM_NUM,
+  OP_DIVIDE_NUM_NUM,
+  OP_EQUAL_NUM_NUM,
+  OP_NOT_EQUAL_NUM_NUM,
+  OP_GREATER_NUM_NUM,
+  OP_GREATER_EQUAL_NUM_NUM,
+  OP_LESSER_NUM_NUM,
+  OP_LESSER_EQUAL_NUM_NUM,
 };
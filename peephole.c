@@ -0,0 +1,187 @@
+#include "peephole.h"
+
+#include "memory.h"
+#include "op.h"
+#include "value.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_PATTERN_LENGTH 2
+#define NO_PREVIOUS SIZE_MAX
+
+// a sequence of instructions and the operandless ones that replace it
+struct Pattern {
+  enum OpCode match[MAX_PATTERN_LENGTH];
+  size_t matchLength;
+  enum OpCode replacement[MAX_PATTERN_LENGTH];
+  size_t replacementLength;
+
+  // what the instruction before the sequence has to leave on top of the stack
+  // for the rewrite to keep the same behaviour, VALUE_NONE if anything goes
+  enum ValueType operand;
+};
+
+// tried in order at every instruction
+static const struct Pattern patterns[] = {
+    // constants that are discarded right away
+    {{OP_CONSTANT, OP_POP}, 2, {0}, 0, VALUE_NONE},
+    {{OP_CONSTANT_LONG, OP_POP}, 2, {0}, 0, VALUE_NONE},
+
+    // operators applied twice give the value back, but only cannot fail for
+    // the type they expect
+    {{OP_NEGATE, OP_NEGATE}, 2, {0}, 0, VALUE_NUMBER},
+    {{OP_NOT, OP_NOT}, 2, {0}, 0, VALUE_BOOL},
+
+    // operators that cannot fail and whose result is discarded
+    {{OP_NEGATE, OP_POP}, 2, {OP_POP}, 1, VALUE_NUMBER},
+    {{OP_NOT, OP_POP}, 2, {OP_POP}, 1, VALUE_BOOL},
+
+#ifndef NO_SUPERINSTRUCTIONS
+    {{OP_PRINT, OP_POP}, 2, {OP_PRINT_POP}, 1, VALUE_NONE},
+#endif
+};
+
+// type of the value the instruction leaves on top of the stack when it
+// succeeds, VALUE_NONE if that is only known at runtime
+static enum ValueType resultType(struct Chunk* chunk, const uint8_t* code) {
+  switch (*code) {
+    case OP_CONSTANT:
+      return VALUE_TYPE(chunk->values.values[code[1]]);
+    case OP_CONSTANT_LONG:
+      return VALUE_TYPE(
+          chunk->values.values[code[1] | code[2] << 8 | code[3] << 16]);
+    case OP_NEGATE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_READ_CONST_ADD:
+      return VALUE_NUMBER;
+    case OP_NOT:
+    case OP_AND:
+    case OP_OR:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESSER:
+    case OP_LESSER_EQUAL:
+      return VALUE_BOOL;
+    default:
+      return VALUE_NONE;
+  }
+}
+
+// a jump in the chunk, by offsets before the rewrite
+struct Jump {
+  size_t from, to;
+};
+
+// a sequence can start at a jump target but not contain one, the instructions
+// before the target are not the only way to reach it
+static bool matches(struct Chunk* chunk, const struct Pattern* pattern,
+                    size_t offset, size_t previous, const bool* targets) {
+  for (size_t i = 0; i < pattern->matchLength; i++) {
+    if (offset >= chunk->length || chunk->code[offset] != pattern->match[i] ||
+        (i > 0 && targets[offset]))
+      return false;
+
+    offset += instructionLength(&chunk->code[offset]);
+  }
+
+  return pattern->operand == VALUE_NONE ||
+         (previous != NO_PREVIOUS &&
+          resultType(chunk, &chunk->code[previous]) == pattern->operand);
+}
+
+// rewrites the chunk in place once, returns whether any pattern matched
+static bool rewriteChunk(struct Chunk* chunk) {
+  uint8_t* code = chunk->code;
+  size_t read = 0, write = 0;
+  size_t instructions = 0;
+  bool changed = false;
+
+  // the last instruction written, already rewritten
+  size_t previous = NO_PREVIOUS;
+
+  // patterns never contain jumps, so they only have to be moved afterwards
+  bool* targets = reallocate(NULL, chunk->length + 1, 0, sizeof(bool));
+  size_t* moved = reallocate(NULL, chunk->length + 1, 0, sizeof(size_t));
+  struct Jump* jumps = NULL;
+  size_t jumpsSize = 0, jumpsLength = 0;
+
+  memset(targets, 0, (chunk->length + 1) * sizeof(bool));
+  for (size_t i = 0; i < chunk->length; i += instructionLength(&code[i])) {
+    if (!isJump(code[i]))
+      continue;
+
+    if (jumpsLength >= jumpsSize) {
+      size_t previousSize = jumpsSize;
+      jumpsSize = nextArraySize(previousSize);
+      jumps = reallocate(jumps, jumpsSize, previousSize, sizeof(struct Jump));
+    }
+
+    jumps[jumpsLength++] = (struct Jump){i, jumpTarget(code, i)};
+    targets[jumpTarget(code, i)] = true;
+  }
+
+  while (read < chunk->length) {
+    moved[read] = write;
+    if (targets[read])
+      previous = NO_PREVIOUS;
+
+    const struct Pattern* pattern = NULL;
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+      if (matches(chunk, &patterns[i], read, previous, targets)) {
+        pattern = &patterns[i];
+        break;
+      }
+    }
+
+    if (pattern == NULL) {
+      size_t length = instructionLength(&code[read]);
+      memmove(&code[write], &code[read], length);
+
+      previous = write;
+      read += length;
+      write += length;
+      continue;
+    }
+
+    for (size_t i = 0; i < pattern->matchLength; i++) {
+      read += instructionLength(&code[read]);
+    }
+
+    // never longer than what it replaces, so it cannot overtake read
+    for (size_t i = 0; i < pattern->replacementLength; i++) {
+      previous = write;
+      code[write++] = pattern->replacement[i];
+    }
+
+    instructions += pattern->matchLength - pattern->replacementLength;
+    changed = true;
+  }
+
+  moved[read] = write;
+  for (size_t i = 0; i < jumpsLength; i++) {
+    setJumpTarget(code, moved[jumps[i].from], moved[jumps[i].to]);
+  }
+
+  free(targets);
+  free(moved);
+  free(jumps);
+
+  chunk->peepholeBytes += chunk->length - write;
+  chunk->peepholeDispatches += instructions;
+  chunk->length = write;
+
+  return changed;
+}
+
+void runPeephole(struct Chunk* chunk) {
+  // removing a sequence can bring together the parts of another one
+  while (rewriteChunk(chunk))
+    ;
+}
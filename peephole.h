@@ -0,0 +1,7 @@
+#pragma once
+
+#include "chunk.h"
+
+// rewrites short instruction sequences of a compiled chunk into cheaper ones,
+// adding what it saved to the chunk's peephole counters
+void runPeephole(struct Chunk* chunk);
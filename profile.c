@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 199309L // clock_gettime
+
+#include "profile.h"
+
+#include "debug.h"
+#include "op.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct Profile vmProfile;
+
+uint64_t profileNanoseconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct ProfileRow {
+  enum OpCode op;
+  struct OpProfile profile;
+};
+
+static int compareCycles(const void* a, const void* b) {
+  uint64_t x = ((const struct ProfileRow*)a)->profile.cycles;
+  uint64_t y = ((const struct ProfileRow*)b)->profile.cycles;
+  return (x < y) - (x > y);
+}
+
+// every opcode in opcode order
+static void collectRows(struct ProfileRow rows[OP_CODES], uint64_t* cycles) {
+  *cycles = 0;
+  for (size_t i = 0; i < OP_CODES; i++) {
+    rows[i] = (struct ProfileRow){.op = i, .profile = vmProfile.ops[i]};
+    *cycles += vmProfile.ops[i].cycles;
+  }
+}
+
+void printProfile(FILE* out) {
+  struct ProfileRow rows[OP_CODES];
+  uint64_t cycles;
+  collectRows(rows, &cycles);
+  qsort(rows, OP_CODES, sizeof(struct ProfileRow), compareCycles);
+
+  fprintf(out, "%-26s %12s %14s %6s %10s %11s %7s\n", "opcode", "count",
+          PROFILE_UNIT, "share", "per op", "type errors", "deopts");
+
+  uint64_t count = 0;
+  for (size_t i = 0; i < OP_CODES; i++) {
+    struct OpProfile* profile = &rows[i].profile;
+    if (profile->count == 0 && profile->typeErrors == 0 &&
+        profile->deoptimizations == 0) {
+      continue;
+    }
+
+    count += profile->count;
+    fprintf(out,
+            "%-26s %12" PRIu64 " %14" PRIu64 " %5.1f%% %10.1f %11" PRIu64
+            " %7" PRIu64 "\n",
+            opCodeString(rows[i].op), profile->count, profile->cycles,
+            cycles > 0 ? 100.0 * profile->cycles / cycles : 0.0,
+            profile->count > 0 ? (double)profile->cycles / profile->count
+                               : 0.0,
+            profile->typeErrors, profile->deoptimizations);
+  }
+
+  fprintf(out, "%-26s %12" PRIu64 " %14" PRIu64 "\n", "total", count, cycles);
+}
+
+void writeProfileJson(FILE* out) {
+  struct ProfileRow rows[OP_CODES];
+  uint64_t cycles;
+  collectRows(rows, &cycles);
+
+  fprintf(out, "{\n  \"unit\": \"%s\",\n  \"total\": %" PRIu64 ",\n",
+          PROFILE_UNIT, cycles);
+  fprintf(out, "  \"opcodes\": [\n");
+
+  for (size_t i = 0; i < OP_CODES; i++) {
+    struct OpProfile* profile = &rows[i].profile;
+    fprintf(out,
+            "    {\"name\": \"%s\", \"count\": %" PRIu64
+            ", \"cycles\": %" PRIu64 ", \"typeErrors\": %" PRIu64
+            ", \"deoptimizations\": %" PRIu64 "}%s\n",
+            opCodeString(rows[i].op), profile->count, profile->cycles,
+            profile->typeErrors, profile->deoptimizations,
+            i + 1 < OP_CODES ? "," : "");
+  }
+
+  fprintf(out, "  ]\n}\n");
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "op.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// builds with -D PROFILE count every instruction the vm interprets and the
+// time from its dispatch to the next one, in TSC cycles on x86 and in
+// nanoseconds elsewhere. other builds have none of the hooks. instructions
+// that run in native code are not seen, so toy --profile does not use the jit
+
+#define OP_CODES (OP_LESSER_EQUAL_NUM_NUM + 1)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROFILE_CLOCK() __builtin_ia32_rdtsc()
+#define PROFILE_UNIT "cycles"
+#else
+#define PROFILE_CLOCK() profileNanoseconds()
+#define PROFILE_UNIT "ns"
+#endif
+
+uint64_t profileNanoseconds(void);
+
+struct OpProfile {
+  uint64_t count, cycles;
+  uint64_t typeErrors;      // runtime errors for operands of the wrong type
+  uint64_t deoptimizations; // guards of the quickened form that failed
+};
+
+struct Profile {
+  // the one after the last opcode is timed while no instruction runs, between
+  // runs of the vm, and never reported
+  struct OpProfile ops[OP_CODES + 1];
+  size_t running;
+  uint64_t started;
+};
+
+extern struct Profile vmProfile;
+
+// the vm calls these when it starts a run, before every instruction and when
+// the run returns
+static inline void profileEnter(void) {
+  vmProfile.running = OP_CODES;
+  vmProfile.started = PROFILE_CLOCK();
+}
+
+static inline void profileInstruction(uint8_t op) {
+  uint64_t now = PROFILE_CLOCK();
+  vmProfile.ops[vmProfile.running].cycles += now - vmProfile.started;
+  vmProfile.ops[op].count++;
+  vmProfile.running = op;
+  vmProfile.started = now;
+}
+
+static inline void profileLeave(void) { profileInstruction(OP_CODES); }
+
+// the instructions that ran or failed, the most time first
+void printProfile(FILE* out);
+// every opcode in the same order, for tools comparing runs
+void writeProfileJson(FILE* out);
@@ -6,29 +6,37 @@
 #include <stdio.h>
 #include <string.h>
 
-void initScanner(struct Scanner* scanner, const char* string) {
+void initScanner(struct Scanner* scanner, const char* string, size_t length) {
   scanner->start = 0;
   scanner->current = 0;
   scanner->line = 1;
 
   scanner->string = string;
+  scanner->length = length;
 }
 
 static bool atEnd(struct Scanner* scanner) {
-  return scanner->string[scanner->current] == '\0';
+  return scanner->current >= scanner->length;
+}
+
+// the character ahead of the current one, '\0' past the end since the source
+// does not have to be terminated
+static char peek(struct Scanner* scanner, size_t ahead) {
+  size_t index = scanner->current + ahead;
+  return index < scanner->length ? scanner->string[index] : '\0';
 }
 
 static void skipWhitespace(struct Scanner* scanner) {
   for (;;) {
-    char c = scanner->string[scanner->current];
+    char c = peek(scanner, 0);
 
     switch (c) {
       case '/': // skip comment
-        if (scanner->string[scanner->current + 1] ==
+        if (peek(scanner, 1) ==
             '/') { // not necessarily whitespace but ignored nonetheless
           scanner->current += 2;
 
-          while (scanner->string[scanner->current] != '\n') {
+          while (peek(scanner, 0) != '\n') {
             if (atEnd(scanner)) {
               return;
             }
@@ -60,7 +68,7 @@ static struct Token scanToken(struct Scanner* scanner, enum TokenType type) {
 }
 
 static struct Token scanNumber(struct Scanner* scanner) {
-  char c = scanner->string[scanner->current];
+  char c = peek(scanner, 0);
   bool hadDot = c == '.';
 
   if (!isNumber(c)) { // single length number
@@ -71,17 +79,17 @@ static struct Token scanNumber(struct Scanner* scanner) {
     }
   }
 
-  while (isNumber(scanner->string[scanner->current])) {
+  while (isNumber(peek(scanner, 0))) {
     scanner->current++;
 
-    if (scanner->string[scanner->current] == '.') {
+    if (peek(scanner, 0) == '.') {
       if (hadDot) {         // if we are parsing past the '.' then we stop
         scanner->current--; // move before the '.'
         return scanToken(scanner, TOKEN_NUMBER);
       } else {              // continue parsing
         scanner->current++; // move past the '.'
 
-        while (isNumber(scanner->string[scanner->current])) {
+        while (isNumber(peek(scanner, 0))) {
           scanner->current++;
         }
 
@@ -117,6 +125,8 @@ static struct Token scanKeyword(struct Scanner* scanner) {
     case 'f':
       if (matchString(scanner, "alse", 1, 4)) {
         return scanToken(scanner, TOKEN_FALSE);
+      } else if (matchString(scanner, "n", 1, 1)) {
+        return scanToken(scanner, TOKEN_FN);
       }
       break;
     case 'a':
@@ -134,6 +144,26 @@ static struct Token scanKeyword(struct Scanner* scanner) {
         return scanToken(scanner, TOKEN_LET);
       }
       break;
+    case 'i':
+      if (matchString(scanner, "f", 1, 1)) {
+        return scanToken(scanner, TOKEN_IF);
+      }
+      break;
+    case 'e':
+      if (matchString(scanner, "lse", 1, 3)) {
+        return scanToken(scanner, TOKEN_ELSE);
+      }
+      break;
+    case 'w':
+      if (matchString(scanner, "hile", 1, 4)) {
+        return scanToken(scanner, TOKEN_WHILE);
+      }
+      break;
+    case 'r':
+      if (matchString(scanner, "eturn", 1, 5)) {
+        return scanToken(scanner, TOKEN_RETURN);
+      }
+      break;
   }
 
   return scanToken(scanner, TOKEN_IDENTIFIER);
@@ -144,7 +174,7 @@ static bool isAlphaNumeric(char c) {
 }
 
 static struct Token scanIdentifier(struct Scanner* scanner) {
-  while (isAlphaNumeric(scanner->string[scanner->current])) {
+  while (isAlphaNumeric(peek(scanner, 0))) {
     scanner->current++;
   }
 
@@ -163,8 +193,12 @@ struct Token scanNext(struct Scanner* scanner) {
   char c = scanner->string[scanner->current++];
 
   switch (c) {
-    case '\n':
-      return scanToken(scanner, TOKEN_NEWLINE);
+    case '\n': {
+      // the newline still belongs to the line it ends
+      struct Token t = scanToken(scanner, TOKEN_NEWLINE);
+      scanner->line++;
+      return t;
+    }
     case '+':
       return scanToken(scanner, TOKEN_PLUS);
     case '-':
@@ -179,14 +213,20 @@ struct Token scanNext(struct Scanner* scanner) {
       return scanToken(scanner, TOKEN_LPAREN);
     case ')':
       return scanToken(scanner, TOKEN_RPAREN);
+    case '{':
+      return scanToken(scanner, TOKEN_LBRACE);
+    case '}':
+      return scanToken(scanner, TOKEN_RBRACE);
+    case ',':
+      return scanToken(scanner, TOKEN_COMMA);
     case '.':
-      if (isNumber(scanner->string[scanner->current])) {
+      if (isNumber(peek(scanner, 0))) {
         return scanNumber(scanner);
       } else {
         return errorToken(scanner);
       }
     case '=':
-      if (scanner->string[scanner->current] == '=') {
+      if (peek(scanner, 0) == '=') {
         scanner->current++;
         return scanToken(scanner, TOKEN_EQUALS_EQUALS);
       } else {
@@ -194,21 +234,21 @@ struct Token scanNext(struct Scanner* scanner) {
       }
       break;
     case '!':
-      if (scanner->string[scanner->current] == '=') {
+      if (peek(scanner, 0) == '=') {
         scanner->current++;
         return scanToken(scanner, TOKEN_NOT_EQUALS);
       } else {
         return scanToken(scanner, TOKEN_NOT);
       }
     case '>':
-      if (scanner->string[scanner->current] == '=') {
+      if (peek(scanner, 0) == '=') {
         scanner->current++;
         return scanToken(scanner, TOKEN_GREATER_EQUALS);
       } else {
         return scanToken(scanner, TOKEN_GREATER);
       }
     case '<':
-      if (scanner->string[scanner->current] == '=') {
+      if (peek(scanner, 0) == '=') {
         scanner->current++;
         return scanToken(scanner, TOKEN_LESSER_EQUALS);
       } else {
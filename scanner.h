@@ -5,8 +5,9 @@
 
 struct Scanner {
   size_t start, current, line;
-  const char* string;
+  const char* string; // not necessarily terminated
+  size_t length;
 };
 
-void initScanner(struct Scanner* scanner, const char* string);
+void initScanner(struct Scanner* scanner, const char* string, size_t length);
 struct Token scanNext(struct Scanner* scanner);
@@ -0,0 +1,82 @@
+#define _DEFAULT_SOURCE // mmap, madvise
+
+#include "source.h"
+
+#include "memory.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool mapSource(int fd, struct Source* source) {
+  struct stat status;
+  if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) ||
+      status.st_size == 0) {
+    return false;
+  }
+
+  void* mapping =
+      mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  // the scanner reads it once from the start to the end
+  madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+
+  source->string = mapping;
+  source->length = status.st_size;
+  source->mapped = true;
+  return true;
+}
+
+static bool readSource(int fd, struct Source* source) {
+  char* string = NULL;
+  size_t length = 0, size = 0;
+
+  for (;;) {
+    if (length == size) {
+      size_t previousSize = size;
+      size = nextArraySize(previousSize);
+      string = reallocate(string, size, previousSize, sizeof(char));
+    }
+
+    ssize_t bytes = read(fd, string + length, size - length);
+    if (bytes < 0) {
+      free(string);
+      return false;
+    } else if (bytes == 0) {
+      break;
+    }
+    length += bytes;
+  }
+
+  source->string = string;
+  source->length = length;
+  source->mapped = false;
+  return true;
+}
+
+bool openSource(const char* path, struct Source* source) {
+  int fd = open(path, O_RDONLY);
+  bool opened = fd >= 0 && (mapSource(fd, source) || readSource(fd, source));
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  if (!opened) {
+    printf("could not read %s\n", path);
+  }
+  return opened;
+}
+
+void closeSource(struct Source* source) {
+  if (source->mapped) {
+    munmap((void*)source->string, source->length);
+  } else {
+    free((char*)source->string);
+  }
+}
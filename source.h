@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+// a script's source, mapped read-only straight from its file so it is never
+// copied. files that cannot be mapped, like pipes, are read into memory
+// instead. either way the characters are not terminated
+struct Source {
+  const char* string;
+  size_t length;
+  bool mapped;
+};
+
+// prints an error if the file cannot be read
+bool openSource(const char* path, struct Source* source);
+void closeSource(struct Source* source);
@@ -0,0 +1,110 @@
+#include "str.h"
+
+#include "memory.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_SEED 0x243f6a8885a308d3ULL
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+// reads the string eight bytes at a time, multiplying each word into the
+// state, then spreads the last words over every bit
+uint64_t hashString(struct String* string) {
+  const char* bytes = string->str;
+  size_t length = string->length;
+  uint64_t hash = HASH_SEED ^ (length * HASH_MULTIPLIER);
+
+  for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    bytes += sizeof(word);
+
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+    hash ^= hash >> 29;
+  }
+
+  if (length > 0) {
+    uint64_t word = 0;
+    memcpy(&word, bytes, length);
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+#define MAX_INTERN_LOAD 0.5
+
+// every symbol of the process, open addressing over a power of two size
+static struct {
+  const struct Symbol** symbols;
+  size_t size, length;
+  struct Arena arena; // the symbols and their characters
+} interned;
+
+static const struct Symbol** findSymbol(const struct Symbol** symbols,
+                                        size_t size, const char* string,
+                                        size_t length, uint64_t hash) {
+  size_t index = hash & (size - 1);
+
+  for (;;) {
+    const struct Symbol** symbol = &symbols[index];
+    if (*symbol == NULL ||
+        ((*symbol)->hash == hash && (*symbol)->string.length == length &&
+         memcmp((*symbol)->string.str, string, length) == 0)) {
+      return symbol;
+    }
+
+    index = (index + 1) & (size - 1);
+  }
+}
+
+static void growInterned(void) {
+  size_t size = nextArraySize(interned.size);
+  const struct Symbol** symbols = calloc(size, sizeof(struct Symbol*));
+
+  for (size_t i = 0; i < interned.size; i++) {
+    const struct Symbol* symbol = interned.symbols[i];
+    if (symbol != NULL) {
+      *findSymbol(symbols, size, symbol->string.str, symbol->string.length,
+                  symbol->hash) = symbol;
+    }
+  }
+
+  free(interned.symbols);
+  interned.symbols = symbols;
+  interned.size = size;
+}
+
+const struct Symbol* intern(const char* string, size_t length) {
+  if (interned.length + 1 > interned.size * MAX_INTERN_LOAD) {
+    growInterned();
+  }
+
+  struct String key = {.str = string, .length = length};
+  uint64_t hash = hashString(&key);
+
+  const struct Symbol** found =
+      findSymbol(interned.symbols, interned.size, string, length, hash);
+  if (*found != NULL)
+    return *found;
+
+  // the characters follow the symbol
+  struct Symbol* symbol =
+      arenaAllocate(&interned.arena, sizeof(struct Symbol) + length);
+  char* copy = (char*)(symbol + 1);
+  memcpy(copy, string, length);
+
+  symbol->string = (struct String){.str = copy, .length = length};
+  symbol->hash = hash;
+
+  *found = symbol;
+  interned.length++;
+  return symbol;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
 
 struct String {
@@ -11,3 +12,15 @@ struct StringArray {
   struct String* strings;
   size_t size, length;
 };
+
+uint64_t hashString(struct String* string);
+
+// a name interned by intern, equal names are the same symbol so they compare
+// by pointer. symbols live as long as the process and only one thread may
+// intern at a time
+struct Symbol {
+  struct String string;
+  uint64_t hash;
+};
+
+const struct Symbol* intern(const char* string, size_t length);
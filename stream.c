@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L // pthreads, read
+
+#include "stream.h"
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef PRINT_DEBUG
+#include "debug.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// bytes read at once. a batch is cut after every read that completed a line,
+// so slow input starts running right away and fast input is compiled in
+// batches of about this size
+#define STREAM_READ_SIZE (64 * 1024)
+
+// compiled batches waiting to run
+#define STREAM_QUEUE_LENGTH 2
+
+struct Stream {
+  int fd;
+  unsigned passes;
+  struct GlobalNames globals; // only the compiling thread touches them
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct Chunk queue[STREAM_QUEUE_LENGTH];
+  size_t head, length;
+  bool ended;   // nothing more is queued
+  bool failed;  // the input could not be read
+  bool stopped; // the runner takes no more batches
+};
+
+// what was read but not compiled yet
+struct Input {
+  char* string;
+  size_t length, size;
+
+  size_t scanned; // where looking for the end of a line continues
+  size_t end;     // after the last line that ends outside of braces
+  size_t lines, endLines; // newlines before scanned and before end
+  size_t line;            // of the first character
+  int depth;              // braces open at scanned
+  bool comment;           // scanned is inside a comment
+};
+
+// a newline ends a statement unless a brace is still open, as in the REPL
+static void findLines(struct Input* input) {
+  size_t i = input->scanned;
+
+  for (; i < input->length; i++) {
+    char c = input->string[i];
+
+    if (c == '\n') {
+      input->lines++;
+      input->comment = false;
+
+      if (input->depth <= 0) {
+        input->depth = 0; // the compiler reports a stray '}'
+        input->end = i + 1;
+        input->endLines = input->lines;
+      }
+    } else if (input->comment) {
+      continue;
+    } else if (c == '/') {
+      if (i + 1 == input->length)
+        break; // whether a comment starts is decided by the next read
+
+      input->comment = input->string[i + 1] == '/';
+      i += input->comment;
+    } else if (c == '{') {
+      input->depth++;
+    } else if (c == '}') {
+      input->depth--;
+    }
+  }
+
+  input->scanned = i;
+}
+
+// the compiled batch waits for room in the queue, false if it is not run
+static bool queueBatch(struct Stream* stream, struct Input* input) {
+  struct Chunk compiled = compileBatch(input->string, input->end, input->line,
+                                       &stream->globals, stream->passes);
+
+#ifdef PRINT_DEBUG
+  debugChunk(compiled);
+#endif
+
+  // the lines after the batch move to the front
+  memmove(input->string, input->string + input->end,
+          input->length - input->end);
+  input->length -= input->end;
+  input->scanned -= input->end;
+  input->lines -= input->endLines;
+  input->line += input->endLines;
+  input->end = input->endLines = 0;
+
+  if (compiled.code == NULL) // the errors were reported
+    return false;
+
+  pthread_mutex_lock(&stream->lock);
+  while (stream->length == STREAM_QUEUE_LENGTH && !stream->stopped) {
+    pthread_cond_wait(&stream->changed, &stream->lock);
+  }
+
+  bool queued = !stream->stopped;
+  if (queued) {
+    size_t tail = (stream->head + stream->length++) % STREAM_QUEUE_LENGTH;
+    stream->queue[tail] = compiled;
+    pthread_cond_broadcast(&stream->changed);
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  if (!queued) {
+    deinitChunk(&compiled);
+  }
+  return queued;
+}
+
+static void freeInput(void* input) { free(((struct Input*)input)->string); }
+
+static void* compileStream(void* argument) {
+  struct Stream* stream = argument;
+  struct Input input = {.line = 1};
+
+  // the runner cancels the thread when it stops early, which may only happen
+  // while it waits for input and holds nothing else
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  pthread_cleanup_push(freeInput, &input);
+
+  for (;;) {
+    while (input.size - input.length < STREAM_READ_SIZE) {
+      size_t previousSize = input.size;
+      input.size = nextArraySize(previousSize);
+      input.string =
+          reallocate(input.string, input.size, previousSize, sizeof(char));
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    ssize_t bytes =
+        read(stream->fd, input.string + input.length, STREAM_READ_SIZE);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes < 0) {
+      stream->failed = true; // only read once the thread ended
+      break;
+    } else if (bytes == 0) { // the rest is the last batch
+      input.end = input.length;
+      input.endLines = input.lines;
+      if (input.end > 0) {
+        queueBatch(stream, &input);
+      }
+      break;
+    }
+
+    input.length += bytes;
+    findLines(&input);
+    if (input.end > 0 && !queueBatch(stream, &input))
+      break;
+  }
+
+  pthread_cleanup_pop(true);
+
+  pthread_mutex_lock(&stream->lock);
+  stream->ended = true;
+  pthread_cond_broadcast(&stream->changed);
+  pthread_mutex_unlock(&stream->lock);
+
+  return NULL;
+}
+
+// false once every batch ran
+static bool nextBatch(struct Stream* stream, struct Chunk* batch) {
+  pthread_mutex_lock(&stream->lock);
+  while (stream->length == 0 && !stream->ended) {
+    pthread_cond_wait(&stream->changed, &stream->lock);
+  }
+
+  bool next = stream->length > 0;
+  if (next) {
+    *batch = stream->queue[stream->head];
+    stream->head = (stream->head + 1) % STREAM_QUEUE_LENGTH;
+    stream->length--;
+    pthread_cond_broadcast(&stream->changed);
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  return next;
+}
+
+bool runStream(int fd, unsigned passes, bool jit) {
+  struct Stream stream = {.fd = fd, .passes = passes};
+  initGlobalNames(&stream.globals, &mallocAllocator);
+  pthread_mutex_init(&stream.lock, NULL);
+  pthread_cond_init(&stream.changed, NULL);
+
+  pthread_t compiler;
+  if (pthread_create(&compiler, NULL, compileStream, &stream) != 0) {
+    puts("could not start compiling the stream");
+    deinitGlobalNames(&stream.globals);
+    return false;
+  }
+
+  struct VM vm;
+  initVM(&vm, &mallocAllocator);
+  vm.jit = jit;
+
+  struct Chunk batch;
+  while (nextBatch(&stream, &batch)) {
+    enum RunResult result = runVM(&vm, &batch);
+    deinitChunk(&batch);
+    fflush(stdout); // whoever reads the output sees it as the input arrives
+
+    if (result != RUN_OK)
+      break;
+  }
+
+  // after an error the compiler may still be waiting for room or for input
+  pthread_mutex_lock(&stream.lock);
+  stream.stopped = true;
+  pthread_cond_broadcast(&stream.changed);
+  pthread_mutex_unlock(&stream.lock);
+
+  pthread_cancel(compiler);
+  pthread_join(compiler, NULL);
+
+  for (; stream.length > 0; stream.length--) {
+    deinitChunk(&stream.queue[stream.head]);
+    stream.head = (stream.head + 1) % STREAM_QUEUE_LENGTH;
+  }
+
+  deinitVM(&vm);
+  deinitGlobalNames(&stream.globals);
+  pthread_cond_destroy(&stream.changed);
+  pthread_mutex_destroy(&stream.lock);
+
+  if (stream.failed) {
+    puts("could not read the stream");
+  }
+  return !stream.failed;
+}
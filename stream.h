@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+// toy --stream runs a script while it is still being written to it, for
+// input generated by another program. a thread reads whole lines and
+// compiles them in batches that run in order on one vm while the next batch
+// compiles, printing the values of expressions like the REPL. only a couple
+// of batches are held at once, so memory stays flat however long the input
+// is. a batch that does not compile or fails to run ends the stream after
+// the ones before it ran
+
+// reads fd to its end, false if it could not be read
+bool runStream(int fd, unsigned passes, bool jit);
@@ -11,6 +11,9 @@ enum TokenType {
   TOKEN_SEMICOLON,
   TOKEN_LPAREN,
   TOKEN_RPAREN,
+  TOKEN_LBRACE,
+  TOKEN_RBRACE,
+  TOKEN_COMMA,
   TOKEN_NOT,
   TOKEN_EQUALS,
   TOKEN_EQUALS_EQUALS,
@@ -28,6 +31,11 @@ enum TokenType {
   TOKEN_AND,
   TOKEN_OR,
   TOKEN_LET,
+  TOKEN_IF,
+  TOKEN_ELSE,
+  TOKEN_WHILE,
+  TOKEN_FN,
+  TOKEN_RETURN,
 
   TOKEN_EOF,
   TOKEN_ERROR,
@@ -0,0 +1,147 @@
+// counts the most frequent opcode sequences of length N in a corpus of
+// scripts, used to pick which sequences get a superinstruction
+#include "chunk.h"
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "source.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_N 8
+#define TOP_NGRAMS 20
+
+// an n-gram packed one opcode per byte
+struct NGrams {
+  uint64_t* grams;
+  size_t size, length;
+};
+
+struct Count {
+  uint64_t gram;
+  size_t count;
+};
+
+static void addGram(struct NGrams* grams, uint64_t gram) {
+  if (grams->length >= grams->size) {
+    grams->size = grams->size < 8 ? 8 : grams->size * 2;
+    grams->grams = realloc(grams->grams, grams->size * sizeof(uint64_t));
+  }
+
+  grams->grams[grams->length++] = gram;
+}
+
+// a sequence can start at a jump target but not contain one, like the ones the
+// compiler and the peephole pass fuse
+static void collectGrams(struct NGrams* grams, struct Chunk* chunk, int n) {
+  uint64_t window = 0;
+  int filled = 0;
+  uint64_t mask = n == MAX_N ? UINT64_MAX : (1ULL << (8 * n)) - 1;
+
+  bool* targets = calloc(chunk->length + 1, sizeof(bool));
+  for (size_t i = 0; i < chunk->length;
+       i += instructionLength(&chunk->code[i])) {
+    if (isJump(chunk->code[i])) {
+      targets[jumpTarget(chunk->code, i)] = true;
+    }
+  }
+
+  for (size_t i = 0; i < chunk->length;
+       i += instructionLength(&chunk->code[i])) {
+    if (targets[i]) {
+      filled = 0;
+    }
+
+    window = ((window << 8) | chunk->code[i]) & mask;
+
+    if (++filled >= n) {
+      addGram(grams, window);
+    }
+  }
+
+  free(targets);
+}
+
+static int compareGram(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static int compareCount(const void* a, const void* b) {
+  size_t x = ((const struct Count*)a)->count;
+  size_t y = ((const struct Count*)b)->count;
+  return (x < y) - (x > y); // descending
+}
+
+static void printGram(uint64_t gram, int n) {
+  for (int i = n - 1; i >= 0; i--) {
+    printf(" %s", opCodeString((gram >> (8 * i)) & 0xff));
+  }
+  printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+  int n = argc > 2 ? atoi(argv[1]) : 0;
+  if (n < 1 || n > MAX_N) {
+    puts("usage: ngrams N FILE...");
+    return 1;
+  }
+
+  struct NGrams grams = {0};
+
+  for (int i = 2; i < argc; i++) {
+    struct Source source;
+    if (!openSource(argv[i], &source)) {
+      continue;
+    }
+
+    struct GlobalNames globals;
+    initGlobalNames(&globals, &mallocAllocator);
+
+    struct Chunk chunk = compileString(source.string, source.length, false,
+                                      &globals,
+                                      optLevelPasses(DEFAULT_OPT_LEVEL));
+    collectGrams(&grams, &chunk, n);
+
+    // the bodies of every function the script declares, at any depth
+    for (size_t j = 0; j < globals.functionsLength; j++) {
+      collectGrams(&grams, &globals.functions[j]->chunk, n);
+    }
+
+    deinitChunk(&chunk);
+    deinitGlobalNames(&globals);
+    closeSource(&source);
+  }
+
+  if (grams.length == 0) {
+    return 0;
+  }
+
+  // sort so equal n-grams are adjacent, then count each run
+  qsort(grams.grams, grams.length, sizeof(uint64_t), compareGram);
+
+  struct Count* counts = malloc(grams.length * sizeof(struct Count));
+  size_t nCounts = 0;
+
+  for (size_t i = 0; i < grams.length; i++) {
+    if (nCounts > 0 && counts[nCounts - 1].gram == grams.grams[i]) {
+      counts[nCounts - 1].count++;
+    } else {
+      counts[nCounts++] = (struct Count){grams.grams[i], 1};
+    }
+  }
+
+  qsort(counts, nCounts, sizeof(struct Count), compareCount);
+
+  for (size_t i = 0; i < nCounts && i < TOP_NGRAMS; i++) {
+    printf("%8zu %5.1f%%", counts[i].count,
+           100. * counts[i].count / grams.length);
+    printGram(counts[i].gram, n);
+  }
+
+  free(counts);
+  free(grams.grams);
+}
@@ -1,19 +1,49 @@
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "aot.h"
+#include "cache.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "image.h"
+#include "jit.h"
+#include "memory.h"
+#include "profile.h"
+#include "source.h"
+#include "stream.h"
 #include "value.h"
 #include "vm.h"
 
-#define MAX_REPL_SIZE 256
+#define MAX_REPL_SIZE 1024
 
 #ifdef PRINT_DEBUG
 #include "debug.h"
 #endif
 
-static void runRepl(void) {
+// braces opened but not closed yet, the input continues on the next line
+static int openBraces(const char* input) {
+  int open = 0;
+  for (; *input != '\0'; input++) {
+    if (*input == '{') {
+      open++;
+    } else if (*input == '}') {
+      open--;
+    }
+  }
+
+  return open;
+}
+
+static void runRepl(unsigned passes, bool jit) {
   struct VM vm;
-  initVM(&vm);
+  initVM(&vm, &mallocAllocator);
+  vm.jit = jit;
+
+  struct GlobalNames globals;
+  initGlobalNames(&globals, &mallocAllocator);
 
   char buffer[MAX_REPL_SIZE] = {0};
 
@@ -23,10 +53,20 @@ static void runRepl(void) {
     char* err = fgets(buffer, MAX_REPL_SIZE, stdin);
     if (err == NULL) {
       printf("\n");
-      return;
+      break;
     }
 
-    struct Chunk compiled = compileString(buffer, true);
+    size_t length = strlen(buffer);
+    while (openBraces(buffer) > 0 && length < MAX_REPL_SIZE - 1) {
+      printf(". ");
+
+      if (fgets(buffer + length, MAX_REPL_SIZE - length, stdin) == NULL)
+        break;
+      length += strlen(buffer + length);
+    }
+
+    struct Chunk compiled =
+        compileString(buffer, length, true, &globals, passes);
 
 #ifdef PRINT_DEBUG
     debugChunk(compiled);
@@ -37,58 +77,300 @@ static void runRepl(void) {
     deinitChunk(&compiled);
   }
 
+  deinitGlobalNames(&globals);
   deinitVM(&vm);
 }
 
-static char* readFile(const char* fileName) {
-  FILE* file = fopen(fileName, "r");
-  if (file == NULL) {
-    printf("could not read %s\n", fileName);
-    return NULL;
-  }
-
-  fseek(file, 0, SEEK_END);
-  size_t fileSize = ftell(file);
-  fseek(file, 0, SEEK_SET);
+static bool hasSuffix(const char* fileName, const char* suffix) {
+  size_t length = strlen(fileName), suffixLength = strlen(suffix);
+  return length > suffixLength &&
+         strcmp(fileName + length - suffixLength, suffix) == 0;
+}
 
-  char* contents = malloc(fileSize + 1); // + 1 for '\0'
-  fread(contents, 1, fileSize, file);
-  contents[fileSize] = '\0';
+static void runChunk(struct Chunk* chunk, bool jit) {
+  struct VM vm;
+  initVM(&vm, &mallocAllocator);
+  vm.jit = jit;
+  runVM(&vm, chunk);
+  deinitVM(&vm);
+}
 
-  fclose(file);
+static void runNativeUnit(const char* fileName) {
+  struct NativeUnit unit;
+  if (!loadNativeUnit(fileName, &unit)) {
+    exit(1);
+  }
 
-  return contents;
+  runChunk(unit.chunk, true); // the chunks bring their own code
+  unloadNativeUnit(&unit);
 }
 
-static void runFile(const char* fileName) {
-  char* source = readFile(fileName);
-  if (source == NULL) {
+static void runImage(const char* fileName, bool jit) {
+  struct Image image;
+  const char* error = loadImage(fileName, &image);
+  if (error != NULL) {
+    printf("%s %s\n", fileName, error);
     exit(1);
   }
 
-  struct Chunk compiled = compileString(source, false);
-  free(source);
+#ifdef PRINT_DEBUG
+  debugChunk(image.chunk);
+#endif
+
+  runChunk(&image.chunk, jit);
+  unloadImage(&image);
+}
+
+// the code is NULL if the source did not compile
+static struct Chunk compileSource(struct Source* source, unsigned passes,
+                                  struct GlobalNames* globals) {
+  struct Chunk compiled =
+      compileString(source->string, source->length, false, globals, passes);
 
 #ifdef PRINT_DEBUG
   debugChunk(compiled);
 #endif
 
-  struct VM vm;
-  initVM(&vm);
-  runVM(&vm, &compiled);
-  deinitVM(&vm);
+  return compiled;
+}
+
+// exits if the file cannot be read
+static struct Chunk compileFile(const char* fileName, unsigned passes,
+                                struct GlobalNames* globals) {
+  struct Source source;
+  if (!openSource(fileName, &source)) {
+    exit(1);
+  }
+
+  struct Chunk compiled = compileSource(&source, passes, globals);
+  closeSource(&source);
+  return compiled;
+}
+
+static void runFile(const char* fileName, unsigned passes, bool jit,
+                    bool cached) {
+  struct Source source;
+  if (!openSource(fileName, &source)) {
+    exit(1);
+  }
+
+  struct Cache cache;
+  struct CacheKey key;
+  cached = cached && openCache(&cache);
+
+  if (cached) {
+    key = cacheKey(source.string, source.length, passes);
+
+    struct Image image;
+    if (loadCached(&cache, &key, &image)) {
+      closeSource(&source);
+      runChunk(&image.chunk, jit);
+      unloadImage(&image);
+      return;
+    }
+  }
+
+  struct GlobalNames globals;
+  initGlobalNames(&globals, &mallocAllocator);
+
+  struct Chunk compiled = compileSource(&source, passes, &globals);
+  closeSource(&source);
+
+  if (cached && compiled.code != NULL) {
+    storeCached(&cache, &key, &compiled);
+  }
+
+  runChunk(&compiled, jit);
 
   deinitChunk(&compiled);
+  deinitGlobalNames(&globals);
+}
+
+// streams the file, or stdin without one
+static int streamFile(const char* fileName, unsigned passes, bool jit) {
+  int fd = 0;
+  if (fileName != NULL && (fd = open(fileName, O_RDONLY)) < 0) {
+    printf("could not read %s\n", fileName);
+    return 1;
+  }
+
+  bool ok = runStream(fd, passes, jit);
+  if (fd != 0) {
+    close(fd);
+  }
+  return ok ? 0 : 1;
+}
+
+static int cacheStats(void) {
+  struct Cache cache;
+  if (!openCache(&cache)) {
+    puts("there is no cache directory");
+    return 1;
+  }
+
+  printCacheStats(&cache);
+  return 0;
+}
+
+// writes the compiled file as C to stdout, or as an image to outputName
+static void translateFile(const char* fileName, unsigned passes,
+                          const char* outputName) {
+  struct GlobalNames globals;
+  initGlobalNames(&globals, &mallocAllocator);
+
+  struct Chunk compiled = compileFile(fileName, passes, &globals);
+  if (compiled.code == NULL) { // the errors were reported
+    exit(1);
+  }
+
+  if (outputName == NULL) {
+    emitC(stdout, &compiled);
+  } else {
+    FILE* output = fopen(outputName, "wb");
+    if (output == NULL || !writeImage(output, &compiled) ||
+        fclose(output) != 0) {
+      printf("could not write %s\n", outputName);
+      exit(1);
+    }
+  }
+
+  deinitChunk(&compiled);
+  deinitGlobalNames(&globals);
+}
+
+// on stderr, which keeps it apart from what the script prints
+static void printMemoryStatsAtExit(void) {
+  fflush(stdout);
+  printMemoryStats(stderr);
+}
+
+// where --profile-json writes, NULL for the table
+static const char* profileName = NULL;
+
+static void printProfileAtExit(void) {
+  fflush(stdout);
+  if (profileName == NULL) {
+    printProfile(stderr);
+    return;
+  }
+
+  FILE* output = fopen(profileName, "w");
+  if (output == NULL) {
+    fprintf(stderr, "could not write %s\n", profileName);
+    return;
+  }
+
+  writeProfileJson(output);
+  fclose(output);
+}
+
+static int usage(void) {
+  puts("usage: toy [--opt-level 0-2] [--passes fold,cse,dse,peephole] [--jit] "
+       "[--emit-c | --compile -o OUTPUT | --stream] [--no-cache] "
+       "[--mem-stats] [--profile | --profile-json OUTPUT] [FILE]\n"
+       "       toy --cache-stats");
+  return 1;
 }
 
 int main(int argc, char* argv[]) {
-  if (argc == 1) {
-    runRepl();
-  } else if (argc == 2) {
-    char* fileName = argv[1];
-    runFile(fileName);
+  unsigned passes = optLevelPasses(DEFAULT_OPT_LEVEL);
+  char* fileName = NULL;
+  bool jit = false;
+  bool emit = false;
+  bool compile = false;
+  bool stream = false;
+  bool memStats = false;
+  bool profile = false;
+  char* outputName = NULL;
+#ifdef PRINT_DEBUG
+  bool cached = false; // debug builds show every compilation
+#else
+  bool cached = true;
+#endif
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--opt-level") == 0 && i + 1 < argc) {
+      char* end;
+      long level = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || level < 0 || level > MAX_OPT_LEVEL) {
+        return usage();
+      }
+
+      passes = optLevelPasses(level);
+    } else if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+      if (!parsePasses(argv[++i], &passes)) {
+        printf("unknown pass in '%s'\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--jit") == 0) {
+#ifdef JIT_SUPPORTED
+      jit = true;
+#else
+      puts("the jit is not supported on this platform, interpreting instead");
+#endif
+    } else if (strcmp(argv[i], "--emit-c") == 0) {
+      emit = true;
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      compile = true;
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      outputName = argv[++i];
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      cached = false;
+    } else if (strcmp(argv[i], "--mem-stats") == 0) {
+      memStats = true;
+    } else if (strcmp(argv[i], "--profile") == 0 ||
+               (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc)) {
+#ifdef PROFILE
+      profile = true;
+      if (strcmp(argv[i], "--profile-json") == 0) {
+        profileName = argv[++i];
+      }
+#else
+      puts("toy was built without the profiler, build it with make profile");
+      i += strcmp(argv[i], "--profile-json") == 0;
+#endif
+    } else if (strcmp(argv[i], "--cache-stats") == 0 && argc == 2) {
+      return cacheStats();
+    } else if (argv[i][0] != '-' && fileName == NULL) {
+      fileName = argv[i];
+    } else {
+      return usage();
+    }
+  }
+
+  // compiling writes an image to the output, emitting C writes to stdout
+  if ((compile && (emit || outputName == NULL)) ||
+      (!compile && outputName != NULL) || (stream && (emit || compile))) {
+    return usage();
+  }
+
+  // also reported when the script exits with an error
+  if (memStats) {
+    atexit(printMemoryStatsAtExit);
+  }
+
+  // native code runs instructions the profiler never sees
+  if (profile) {
+    jit = false;
+    atexit(printProfileAtExit);
+  }
+
+  if (stream) {
+    return streamFile(fileName, passes, jit);
+  } else if (fileName == NULL) {
+    if (emit || compile)
+      return usage();
+
+    runRepl(passes, jit);
+  } else if (emit || compile) {
+    translateFile(fileName, passes, outputName);
+  } else if (hasSuffix(fileName, ".so")) {
+    runNativeUnit(fileName);
+  } else if (hasSuffix(fileName, ".toyc")) {
+    runImage(fileName, jit);
   } else {
-    puts("usage: toy [FILE]");
-    return 1;
+    runFile(fileName, passes, jit, cached);
   }
 }
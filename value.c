@@ -1,4 +1,7 @@
 #include "value.h"
+
+#include "function.h"
+
 #include <stdio.h>
 
 const char* valueTypeStr(enum ValueType type) {
@@ -7,23 +10,39 @@ const char* valueTypeStr(enum ValueType type) {
       return "Number";
     case VALUE_BOOL:
       return "Bool";
+    case VALUE_FUNCTION:
+      return "Function";
     case VALUE_NONE:
       return "<none type>";
+    case VALUE_UNDECLARED:
+      return "<undeclared>";
   }
 
   return NULL;
 }
 
 void printValue(struct Value* v) {
-  switch (v->type) {
+  switch (VALUE_TYPE(*v)) {
     case VALUE_NUMBER:
-      printf("%.16g\n", v->as.number);
+      printf("%.16g\n", AS_NUMBER(*v));
       break;
     case VALUE_BOOL:
-      printf("%s\n", v->as._bool == true ? "true" : "false");
+      printf("%s\n", AS_BOOL(*v) == true ? "true" : "false");
       break;
+    case VALUE_FUNCTION: {
+      struct String name = AS_FUNCTION(*v)->name;
+      if (name.length == 0) {
+        puts("<fn>");
+      } else {
+        printf("<fn %.*s>\n", (int)name.length, name.str);
+      }
+      break;
+    }
     case VALUE_NONE:
       puts("<none type>");
       break;
+    case VALUE_UNDECLARED:
+      puts("<undeclared>");
+      break;
   }
 }
@@ -1,27 +1,117 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 enum ValueType {
-  // used for type inference
+  // used for type inference, and as the value of calls that return nothing
   VALUE_NONE,
 
   // used inside the Value struct
   VALUE_NUMBER,
   VALUE_BOOL,
+  VALUE_FUNCTION,
+
+  // only held by global slots that were never declared, no expression has it
+  VALUE_UNDECLARED,
 };
 
+// values only point to functions, which the compiler owns
+struct Function;
+
 const char* valueTypeStr(enum ValueType type);
 
+// values are only built and inspected through the macros below, so the
+// representation can be switched at build time: a tagged union by default, or
+// with -D NAN_BOXING a single 64 bit word where numbers are stored as doubles
+// and every other type hides inside the payload of a quiet NaN
+#ifndef NAN_BOXING
+
 struct Value {
   enum ValueType type;
   union {
     double number;
     bool _bool;
+    struct Function* function;
   } as;
 };
 
 #define NUMBER_VALUE(value) ((struct Value){VALUE_NUMBER, {.number = (value)}})
 #define BOOL_VALUE(value) ((struct Value){VALUE_BOOL, {._bool = (value)}})
+#define FUNCTION_VALUE(value)                                                  \
+  ((struct Value){VALUE_FUNCTION, {.function = (value)}})
+#define NONE_VALUE ((struct Value){VALUE_NONE, {.number = 0}})
+#define UNDECLARED_VALUE ((struct Value){VALUE_UNDECLARED, {.number = 0}})
+
+#define VALUE_TYPE(value) ((value).type)
+#define IS_NUMBER(value) ((value).type == VALUE_NUMBER)
+#define IS_BOOL(value) ((value).type == VALUE_BOOL)
+#define IS_NONE(value) ((value).type == VALUE_NONE)
+#define IS_FUNCTION(value) ((value).type == VALUE_FUNCTION)
+#define IS_UNDECLARED(value) ((value).type == VALUE_UNDECLARED)
+
+#define AS_NUMBER(value) ((value).as.number)
+#define AS_BOOL(value) ((value).as._bool)
+#define AS_FUNCTION(value) ((value).as.function)
+
+#else
+
+struct Value {
+  uint64_t bits;
+};
+
+// exponent and quiet bit set, plus one more bit so that the NaNs produced by
+// arithmetic are still numbers
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+// tags stored in the low bits of the NaN payload
+#define TAG_NONE 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDECLARED 4
+
+// functions keep their pointer in the payload and set the sign bit instead
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+
+static inline struct Value numberToValue(double number) {
+  struct Value value;
+  memcpy(&value.bits, &number, sizeof(number));
+  return value;
+}
+
+static inline double valueToNumber(struct Value value) {
+  double number;
+  memcpy(&number, &value.bits, sizeof(number));
+  return number;
+}
+
+#define NUMBER_VALUE(value) (numberToValue(value))
+#define BOOL_VALUE(value)                                                      \
+  ((struct Value){QNAN | ((value) ? TAG_TRUE : TAG_FALSE)})
+#define NONE_VALUE ((struct Value){QNAN | TAG_NONE})
+#define UNDECLARED_VALUE ((struct Value){QNAN | TAG_UNDECLARED})
+#define FUNCTION_VALUE(value)                                                  \
+  ((struct Value){SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value)})
+
+#define IS_NUMBER(value) (((value).bits & QNAN) != QNAN)
+#define IS_BOOL(value) (((value).bits | 1) == (QNAN | TAG_TRUE))
+#define IS_NONE(value) ((value).bits == (QNAN | TAG_NONE))
+#define IS_FUNCTION(value)                                                     \
+  (((value).bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN))
+#define IS_UNDECLARED(value) ((value).bits == (QNAN | TAG_UNDECLARED))
+#define VALUE_TYPE(value)                                                      \
+  (IS_NUMBER(value)     ? VALUE_NUMBER                                         \
+   : IS_BOOL(value)     ? VALUE_BOOL                                           \
+   : IS_FUNCTION(value) ? VALUE_FUNCTION                                       \
+   : IS_NONE(value)     ? VALUE_NONE                                           \
+                        : VALUE_UNDECLARED)
+
+#define AS_NUMBER(value) (valueToNumber(value))
+#define AS_BOOL(value) ((value).bits == (QNAN | TAG_TRUE))
+#define AS_FUNCTION(value)                                                     \
+  ((struct Function*)(uintptr_t)((value).bits & ~(SIGN_BIT | QNAN)))
+
+#endif
 
 void printValue(struct Value* v);
@@ -1,283 +1,956 @@
 #include "vm.h"
 
 #include "chunk.h"
-#include "map.h"
+#include "function.h"
+#include "jit.h"
+#include "memory.h"
 #include "op.h"
+#include "profile.h"
 #include "value.h"
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-void initVM(struct VM* vm) {
-  vm->ip = NULL;
+#include <string.h>
+
+// computed goto dispatch is used wherever the compiler supports it, build with
+// -D SWITCH_DISPATCH to force the portable switch loop
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// build with -D CACHE_TOS to keep the top of the value stack in a local of
+// runVM, so that operators only touch vm->stack when they grow or shrink it
+// past the cached value. on x86-64 store forwarding makes the stack cheap
+// enough that this is not faster, so it is off by default
+
+// arithmetic and comparison instructions rewrite themselves into a variant
+// specialized for the operand types they saw, build with -D NO_QUICKENING to
+// always run the generic instructions
+
+void initVM(struct VM* vm, struct Allocator* allocator) {
+  vm->allocator = allocator;
+  vm->frameCount = 0;
+  vm->stack = reallocateWith(allocator, MEMORY_VM, NULL, STACK_MAX, 0,
+                             sizeof(struct Value));
   vm->stackTop = vm->stack;
+  vm->jit = false;
 
-  initMap(&vm->variables);
+  vm->globals = NULL;
+  vm->globalsSize = 0;
 }
 
 void deinitVM(struct VM* vm) {
-  vm->ip = NULL;
-  deinitMap(&vm->variables);
+  vm->frameCount = 0;
+
+  freeWith(vm->allocator, MEMORY_VM, vm->stack, STACK_MAX,
+           sizeof(struct Value));
+  vm->stack = vm->stackTop = NULL;
+
+  freeWith(vm->allocator, MEMORY_VM, vm->globals, vm->globalsSize,
+           sizeof(struct Value));
+  vm->globals = NULL;
+  vm->globalsSize = 0;
 }
 
 // assumes types of values are the same
 static bool compareValue(struct Value* a, struct Value* b) {
-  switch (a->type) {
+  switch (VALUE_TYPE(*a)) {
     case VALUE_NUMBER:
-      return a->as.number == b->as.number;
+      return AS_NUMBER(*a) == AS_NUMBER(*b);
     case VALUE_BOOL:
-      return a->as._bool == b->as._bool;
-    case VALUE_NONE:; // uncomparable
+      return AS_BOOL(*a) == AS_BOOL(*b);
+    case VALUE_FUNCTION:
+      return AS_FUNCTION(*a) == AS_FUNCTION(*b);
+    case VALUE_NONE:
+    case VALUE_UNDECLARED:; // uncomparable
   }
 
   return false;
 }
 
-static void resetStack(struct VM* vm) { vm->stackTop = vm->stack; }
+// every error ends the run through here, so profiling builds stop timing the
+// instruction that failed like a return does
+static enum RunResult reportError(const char* err, va_list args) {
+#ifdef PROFILE
+  profileLeave();
+#endif
 
-static void pushStack(struct VM* vm, struct Value value) {
-  *(vm->stackTop++) = value;
+  printf("Runtime Error: ");
+  vprintf(err, args);
+  printf("\n");
+
+  return RUN_ERROR;
 }
-static struct Value popStack(struct VM* vm) { return *(--vm->stackTop); }
 
 static enum RunResult runtimeError(const char* err, ...) {
   va_list args;
+  va_start(args, err);
+  reportError(err, args);
+  va_end(args);
 
-  printf("Runtime Error: ");
+  return RUN_ERROR;
+}
 
+// an operand of the wrong type, which profiling builds count for the running
+// instruction
+static enum RunResult typeError(const char* err, ...) {
+#ifdef PROFILE
+  vmProfile.ops[vmProfile.running].typeErrors++;
+#endif
+
+  va_list args;
   va_start(args, err);
-  vprintf(err, args);
+  reportError(err, args);
   va_end(args);
 
-  printf("\n");
-
   return RUN_ERROR;
 }
 
+// whether a frame starting at slots can hold the most values its code needs,
+// with CACHE_TOS one of them is kept in a register and the slot below spilled
+static bool hasRoom(struct VM* vm, struct Value* slots, struct Chunk* chunk) {
+  return chunk->maxStack < (size_t)(vm->stack + STACK_MAX - slots);
+}
+
+// RUN_OK if the value is a function taking argc arguments
+static enum RunResult checkCall(struct Value callee, size_t argc) {
+  if (!IS_FUNCTION(callee)) {
+    return typeError("can only call functions, not '%s'",
+                     valueTypeStr(VALUE_TYPE(callee)));
+  }
+
+  struct Function* function = AS_FUNCTION(callee);
+  if (argc != function->arity) {
+    return runtimeError("expected %zu arguments but got %zu", function->arity,
+                        argc);
+  }
+
+  return RUN_OK;
+}
+
+// runs the frame in native code from the instruction at offset for as long as
+// the jit can, returns the offset the interpreter continues at
+static size_t resumeJit(struct VM* vm, struct CallFrame* frame, size_t offset,
+                        struct Value** sp, struct Value* slots) {
+  struct Chunk* chunk = frame->chunk;
+
+  if (chunk->native != NULL) {
+    return chunk->native(offset, vm, sp, slots);
+  }
+
+  if (chunk->jit == NULL) {
+    struct String name = frame->function != NULL
+                             ? frame->function->name
+                             : (struct String){.str = "script", .length = 6};
+    chunk->jit = compileJit(chunk, name);
+
+    if (chunk->jit == NULL) { // keep interpreting
+      vm->jit = false;
+      return offset;
+    }
+  }
+
+  return runJit(chunk->jit, offset, vm, sp, slots);
+}
+
+#if defined(THREADED_DISPATCH) && !defined(__clang__)
+// stop gcc from merging the per-handler dispatch jumps back into one
+__attribute__((optimize("no-crossjumping")))
+#endif
 enum RunResult runVM(struct VM* vm, struct Chunk* runningChunk) {
-  vm->ip = runningChunk->code;
-  if (vm->ip == NULL)
+  if (runningChunk->code == NULL)
     return RUN_ERROR;
+  if (!hasRoom(vm, vm->stack, runningChunk))
+    return runtimeError("stack overflow");
+
+  // make room for the slots of globals first seen by this chunk
+  if (vm->globalsSize < runningChunk->strings.length) {
+    size_t previousSize = vm->globalsSize;
+    vm->globalsSize = runningChunk->strings.length;
+    vm->globals =
+        reallocateWith(vm->allocator, MEMORY_VM, vm->globals, vm->globalsSize,
+                       previousSize, sizeof(struct Value));
+
+    for (size_t i = previousSize; i < vm->globalsSize; i++) {
+      vm->globals[i] = UNDECLARED_VALUE;
+    }
+  }
 
-  resetStack(vm);
-
+  // kept in locals so they can live in registers, written back on return.
+  // quickening rewrites the code of the chunk and of its functions in place
+  uint8_t* ip = runningChunk->code;
+  struct Value* sp = vm->stack;
+  struct Value* constants = runningChunk->values.values;
+
+  vm->frameCount = 1;
+  struct CallFrame* frame = &vm->frames[0];
+  frame->function = NULL;
+  frame->chunk = runningChunk;
+  frame->slots = vm->stack;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (size_t)ip[-2] | (size_t)ip[-1] << 8)
+#define READ_LONG()                                                            \
+  (ip += 3, (size_t)ip[-3] | (size_t)ip[-2] << 8 | (size_t)ip[-1] << 16)
+
+  // operand of an instruction that has a short and a long form
+  size_t operand;
+
+#ifndef NO_QUICKENING
+// only used by instructions without operands, so ip[-1] is the opcode
+#define QUICKEN(op) (ip[-1] = (op))
+#else
+#define QUICKEN(op) ((void)0)
+#endif
+// reverts a quickened instruction whose guard failed and runs the generic one,
+// which expects the stack as it was before the instruction started
+#define DEOPTIMIZE(op)                                                         \
+  PROFILE_DEOPTIMIZATION();                                                    \
+  *--ip = (op);                                                                \
+  NEXT()
+
+#ifdef PROFILE
+  // charges the time since the last dispatch to the instruction that ran and
+  // starts timing the one at ip
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+  // the quickened instruction that failed is the one running
+#define PROFILE_DEOPTIMIZATION() vmProfile.ops[ip[-1]].deoptimizations++
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#define PROFILE_DEOPTIMIZATION() ((void)0)
+#endif
+
+#ifdef CACHE_TOS
+  // tos is the topmost value and sp[-1] the one below it. vm->stack[0] is
+  // never a real value: the first push spills the uninitialized tos there
+  struct Value tos = NUMBER_VALUE(0);
+  struct Value spilled;
+
+#define TOP tos
+#define PUSH(value) (*sp++ = tos, tos = (value))
+#define POP() (spilled = tos, tos = *--sp, spilled)
+// the value distance places below the top
+#define PEEK(distance) ((distance) == 0 ? tos : sp[-(distance)])
+// the local at index of the running frame
+#define LOCAL(index)                                                           \
+  (*(sp == frame->slots + (index) + 1 ? &tos : &frame->slots[(index) + 1]))
+#else
+#define TOP (sp[-1])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define LOCAL(index) (frame->slots[index])
+#endif
+
+  // the running frame continues in native code if the jit is enabled. it is
+  // entered where the interpreter may have left it: at the start, at loop back
+  // edges, and after the instructions it never compiles
+#define FRAME_CODE (frame->chunk->code)
+#ifdef CACHE_TOS
+  // native code does not cache the top, so it is spilled around it
+#define RESUME_JIT()                                                           \
+  do {                                                                         \
+    if (vm->jit) {                                                             \
+      uint8_t* base = FRAME_CODE;                                              \
+      *sp++ = tos;                                                             \
+      ip = base + resumeJit(vm, frame, ip - base, &sp, frame->slots + 1);      \
+      tos = *--sp;                                                             \
+    }                                                                          \
+  } while (0)
+#else
+#define RESUME_JIT()                                                           \
+  do {                                                                         \
+    if (vm->jit) {                                                             \
+      uint8_t* base = FRAME_CODE;                                              \
+      ip = base + resumeJit(vm, frame, ip - base, &sp, frame->slots);          \
+    }                                                                          \
+  } while (0)
+#endif
+
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" // labels as values
+  // every opcode gets its own indirect jump at the end of the previous
+  // handler, which the branch predictor can learn separately
+#define LABEL(op) [op] = &&op##_LABEL
+  static void* dispatchTable[] = {
+      LABEL(OP_RETURN),
+      LABEL(OP_PRINT),
+      LABEL(OP_POP),
+      LABEL(OP_CONSTANT),
+      LABEL(OP_NEGATE),
+      LABEL(OP_ADD),
+      LABEL(OP_SUBTRACT),
+      LABEL(OP_DIVIDE),
+      LABEL(OP_MULTIPLY),
+      LABEL(OP_NOT),
+      LABEL(OP_AND),
+      LABEL(OP_OR),
+      LABEL(OP_ASSIGN),
+      LABEL(OP_DECLARE),
+      LABEL(OP_READ),
+      LABEL(OP_EQUAL),
+      LABEL(OP_NOT_EQUAL),
+      LABEL(OP_GREATER),
+      LABEL(OP_GREATER_EQUAL),
+      LABEL(OP_LESSER),
+      LABEL(OP_LESSER_EQUAL),
+      LABEL(OP_STORE_TEMP),
+      LABEL(OP_LOAD_TEMP),
+      LABEL(OP_GET_LOCAL),
+      LABEL(OP_SET_LOCAL),
+      LABEL(OP_SET_LOCAL_CHECKED),
+      LABEL(OP_POP_LOCALS),
+      LABEL(OP_CHECK_TYPE),
+      LABEL(OP_CALL),
+      LABEL(OP_TAIL_CALL),
+      LABEL(OP_JUMP),
+      LABEL(OP_JUMP_IF_FALSE),
+      LABEL(OP_LOOP_IF_TRUE),
+      LABEL(OP_SHORT_AND),
+      LABEL(OP_SHORT_OR),
+      LABEL(OP_CONSTANT_LONG),
+      LABEL(OP_ASSIGN_LONG),
+      LABEL(OP_DECLARE_LONG),
+      LABEL(OP_READ_LONG),
+      LABEL(OP_READ_CONST_ADD),
+      LABEL(OP_CONST_DECLARE),
+      LABEL(OP_PRINT_POP),
+      LABEL(OP_NEGATE_NUM),
+      LABEL(OP_ADD_NUM_NUM),
+      LABEL(OP_SUBTRACT_NUM_NUM),
+      LABEL(OP_MULTIPLY_NUM_NUM),
+      LABEL(OP_DIVIDE_NUM_NUM),
+      LABEL(OP_EQUAL_NUM_NUM),
+      LABEL(OP_NOT_EQUAL_NUM_NUM),
+      LABEL(OP_GREATER_NUM_NUM),
+      LABEL(OP_GREATER_EQUAL_NUM_NUM),
+      LABEL(OP_LESSER_NUM_NUM),
+      LABEL(OP_LESSER_EQUAL_NUM_NUM),
+  };
+#undef LABEL
+
+#define CASE(op) case op: op##_LABEL
+#define NEXT()                                                                 \
+  PROFILE_INSTRUCTION();                                                       \
+  goto *dispatchTable[READ_BYTE()]
+#else
+#define CASE(op) case op
+#define NEXT() break
+#endif
+
+  // binary operators pop the right operand and replace the left one in place,
+  // so with a cached top they load one value and store none
+
+#ifdef PROFILE
+  profileEnter();
+#endif
+
+  RESUME_JIT();
+
+  // in threaded mode the switch only dispatches the first instruction
   for (;;) {
-    switch (*(vm->ip++)) {
-      case OP_CONSTANT: // push to value stack
-        pushStack(vm, runningChunk->values.values[*(vm->ip++)]);
-        break;
-      case OP_PRINT: {
-        struct Value a = popStack(vm);
+    PROFILE_INSTRUCTION();
+    switch (READ_BYTE()) {
+      CASE(OP_CONSTANT_LONG):
+        operand = READ_LONG();
+        goto constant;
+      CASE(OP_CONSTANT):
+        operand = READ_BYTE();
+      constant: // push to value stack
+        PUSH(constants[operand]);
+        NEXT();
+      CASE(OP_PRINT): {
+        struct Value a = TOP;
         printValue(&a);
-        pushStack(vm, a);
-        break;
+        NEXT();
       }
-      case OP_POP:
-        popStack(vm);
-        break;
-      case OP_NEGATE: {
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER) {
-          return runtimeError("operator '-' is only defined for numbers");
+      CASE(OP_POP):
+        (void)POP();
+        NEXT();
+      CASE(OP_NEGATE): {
+        if (!IS_NUMBER(TOP)) {
+          return typeError("operator '-' is only defined for numbers");
         }
 
-        pushStack(vm, NUMBER_VALUE(-a.as.number));
-        break;
+        TOP = NUMBER_VALUE(-AS_NUMBER(TOP));
+        QUICKEN(OP_NEGATE_NUM);
+        NEXT();
       }
-      case OP_ADD: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '+' is only defined for numbers");
+      CASE(OP_ADD): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '+' is only defined for numbers");
         }
 
-        pushStack(vm, NUMBER_VALUE(a.as.number + b.as.number));
-        break;
+        TOP = NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b));
+        QUICKEN(OP_ADD_NUM_NUM);
+        NEXT();
       }
-      case OP_SUBTRACT: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '-' is only defined for numbers");
+      CASE(OP_SUBTRACT): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '-' is only defined for numbers");
         }
 
-        pushStack(vm, NUMBER_VALUE(a.as.number - b.as.number));
-        break;
+        TOP = NUMBER_VALUE(AS_NUMBER(a) - AS_NUMBER(b));
+        QUICKEN(OP_SUBTRACT_NUM_NUM);
+        NEXT();
       }
-      case OP_MULTIPLY: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '*' is only defined for numbers");
+      CASE(OP_MULTIPLY): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '*' is only defined for numbers");
         }
 
-        pushStack(vm, NUMBER_VALUE(a.as.number * b.as.number));
-        break;
+        TOP = NUMBER_VALUE(AS_NUMBER(a) * AS_NUMBER(b));
+        QUICKEN(OP_MULTIPLY_NUM_NUM);
+        NEXT();
       }
-      case OP_DIVIDE: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '/' is only defined for numbers");
+      CASE(OP_DIVIDE): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '/' is only defined for numbers");
         }
 
-        if (b.as.number == 0.) {
+        if (AS_NUMBER(b) == 0.) {
           return runtimeError("division by zero");
         }
 
-        pushStack(vm, NUMBER_VALUE(a.as.number / b.as.number));
-        break;
+        TOP = NUMBER_VALUE(AS_NUMBER(a) / AS_NUMBER(b));
+        QUICKEN(OP_DIVIDE_NUM_NUM);
+        NEXT();
       }
-      case OP_NOT: {
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_BOOL) {
-          return runtimeError("operator '!' is only defined for bools");
+      CASE(OP_NOT): {
+        if (!IS_BOOL(TOP)) {
+          return typeError("operator '!' is only defined for bools");
         }
 
-        pushStack(vm, BOOL_VALUE(!a.as._bool));
-        break;
+        TOP = BOOL_VALUE(!AS_BOOL(TOP));
+        NEXT();
       }
-      case OP_AND: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_BOOL || b.type != VALUE_BOOL) {
-          return runtimeError("operator 'and' is only defined for bools");
+      CASE(OP_AND): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_BOOL(a) || !IS_BOOL(b)) {
+          return typeError("operator 'and' is only defined for bools");
         }
 
-        pushStack(vm, BOOL_VALUE(a.as._bool && b.as._bool));
-        break;
+        TOP = BOOL_VALUE(AS_BOOL(a) && AS_BOOL(b));
+        NEXT();
       }
-      case OP_OR: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_BOOL || b.type != VALUE_BOOL) {
-          return runtimeError("operator 'or' is only defined for bools");
+      CASE(OP_OR): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_BOOL(a) || !IS_BOOL(b)) {
+          return typeError("operator 'or' is only defined for bools");
         }
 
-        pushStack(vm, BOOL_VALUE(a.as._bool || b.as._bool));
-        break;
+        TOP = BOOL_VALUE(AS_BOOL(a) || AS_BOOL(b));
+        NEXT();
       }
-      case OP_ASSIGN: {
-        struct String name = runningChunk->strings.strings[*(vm->ip++)];
-        struct Entry* entry = getMap(&vm->variables, &name);
-
-        if (entry == NULL) {
+      CASE(OP_ASSIGN_LONG):
+        operand = READ_LONG();
+        goto assign;
+      CASE(OP_ASSIGN):
+        operand = READ_BYTE();
+      assign: {
+        size_t slot = operand;
+        struct Value* global = &vm->globals[slot];
+
+        if (IS_UNDECLARED(*global)) {
+          struct String name = runningChunk->strings.strings[slot];
           return runtimeError("undefined variable '%.*s'", name.length,
                               name.str);
         } else {
-          struct Value value = popStack(vm);
+          struct Value value = POP();
 
-          if (value.type != entry->value.type) {
-            return runtimeError("expected type '%s' but got '%s'",
-                                valueTypeStr(entry->value.type),
-                                valueTypeStr(value.type));
+          if (VALUE_TYPE(value) != VALUE_TYPE(*global)) {
+            return typeError("expected type '%s' but got '%s'",
+                             valueTypeStr(VALUE_TYPE(*global)),
+                             valueTypeStr(VALUE_TYPE(value)));
           }
 
-          entry->value = value;
+          *global = value;
         }
-        break;
+        NEXT();
       }
-      case OP_DECLARE: {
-        struct String name = runningChunk->strings.strings[*(vm->ip++)];
-        struct Entry* entry = getMap(&vm->variables, &name);
-        enum ValueType type = *(vm->ip++);
-
-        if (entry != NULL) {
+      CASE(OP_DECLARE_LONG):
+        operand = READ_LONG();
+        goto declare;
+      CASE(OP_DECLARE):
+        operand = READ_BYTE();
+      declare: {
+        size_t slot = operand;
+        struct Value* global = &vm->globals[slot];
+        enum ValueType type = READ_BYTE();
+
+        if (!IS_UNDECLARED(*global)) {
+          struct String name = runningChunk->strings.strings[slot];
           return runtimeError(
               "redeclaration of previously defined variable '%.*s'",
               name.length, name.str);
         } else {
-          struct Value value = popStack(vm);
+          struct Value value = POP();
 
-          if (type != VALUE_NONE && value.type != type) {
-            return runtimeError("expected type '%s' but got '%s'",
-                                valueTypeStr(type), valueTypeStr(value.type));
+          if (type != VALUE_NONE && VALUE_TYPE(value) != type) {
+            return typeError("expected type '%s' but got '%s'",
+                             valueTypeStr(type),
+                             valueTypeStr(VALUE_TYPE(value)));
           }
 
-          struct Entry newEntry = {
-              .key = name,
-              .value = value,
-          };
-          setMap(&vm->variables, &newEntry);
+          *global = value;
         }
-        break;
+        RESUME_JIT();
+        NEXT();
       }
-      case OP_READ: {
-        struct String name = runningChunk->strings.strings[*(vm->ip++)];
-        struct Entry* entry = getMap(&vm->variables, &name);
-
-        if (entry == NULL) {
+      CASE(OP_READ_LONG):
+        operand = READ_LONG();
+        goto read;
+      CASE(OP_READ):
+        operand = READ_BYTE();
+      read: {
+        size_t slot = operand;
+        struct Value global = vm->globals[slot];
+
+        if (IS_UNDECLARED(global)) {
+          struct String name = runningChunk->strings.strings[slot];
           return runtimeError("unknown variable '%.*s'", name.length, name.str);
         } else {
-          pushStack(vm, entry->value);
+          PUSH(global);
+        }
+        NEXT();
+      }
+      CASE(OP_EQUAL): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
+          return typeError("operator '==' only allows comparing same types");
+        }
+
+        TOP = BOOL_VALUE(compareValue(&a, &b));
+        if (IS_NUMBER(a)) {
+          QUICKEN(OP_EQUAL_NUM_NUM);
+        }
+        NEXT();
+      }
+      CASE(OP_NOT_EQUAL): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
+          return typeError("operator '!=' only allows comparing same types");
+        }
+
+        TOP = BOOL_VALUE(!compareValue(&a, &b));
+        if (IS_NUMBER(a)) {
+          QUICKEN(OP_NOT_EQUAL_NUM_NUM);
+        }
+        NEXT();
+      }
+      CASE(OP_GREATER): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '>' is only implemented for numbers");
         }
-        break;
+
+        TOP = BOOL_VALUE(AS_NUMBER(a) > AS_NUMBER(b));
+        QUICKEN(OP_GREATER_NUM_NUM);
+        NEXT();
       }
-      case OP_EQUAL: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != b.type) {
-          return runtimeError("operator '==' only allows comparing same types");
+      CASE(OP_GREATER_EQUAL): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '>=' is only implemented for numbers");
         }
 
-        pushStack(vm, BOOL_VALUE(compareValue(&a, &b)));
-        break;
+        TOP = BOOL_VALUE(AS_NUMBER(a) >= AS_NUMBER(b));
+        QUICKEN(OP_GREATER_EQUAL_NUM_NUM);
+        NEXT();
       }
-      case OP_NOT_EQUAL: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != b.type) {
-          return runtimeError("operator '!=' only allows comparing same types");
+      CASE(OP_LESSER): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '<' is only implemented for numbers");
         }
 
-        pushStack(vm, BOOL_VALUE(!compareValue(&a, &b)));
-        break;
+        TOP = BOOL_VALUE(AS_NUMBER(a) < AS_NUMBER(b));
+        QUICKEN(OP_LESSER_NUM_NUM);
+        NEXT();
       }
-      case OP_GREATER: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '>' is only implemented for numbers");
+      CASE(OP_LESSER_EQUAL): {
+        struct Value b = POP();
+        struct Value a = TOP;
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '<=' is only implemented for numbers");
         }
 
-        pushStack(vm, BOOL_VALUE(a.as.number > b.as.number));
-        break;
+        TOP = BOOL_VALUE(AS_NUMBER(a) <= AS_NUMBER(b));
+        QUICKEN(OP_LESSER_EQUAL_NUM_NUM);
+        NEXT();
+      }
+      CASE(OP_STORE_TEMP):
+        vm->temps[READ_BYTE()] = TOP;
+        NEXT();
+      CASE(OP_LOAD_TEMP):
+        PUSH(vm->temps[READ_BYTE()]);
+        NEXT();
+      CASE(OP_GET_LOCAL): {
+        uint8_t slot = READ_BYTE();
+        struct Value local = LOCAL(slot);
+        PUSH(local);
+        NEXT();
+      }
+      CASE(OP_SET_LOCAL): {
+        uint8_t slot = READ_BYTE();
+        struct Value value = POP();
+        LOCAL(slot) = value;
+        NEXT();
       }
-      case OP_GREATER_EQUAL: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '>=' is only implemented for numbers");
+      CASE(OP_SET_LOCAL_CHECKED): {
+        uint8_t slot = READ_BYTE();
+        struct Value value = POP();
+
+        if (VALUE_TYPE(value) != VALUE_TYPE(LOCAL(slot))) {
+          return typeError("expected type '%s' but got '%s'",
+                           valueTypeStr(VALUE_TYPE(LOCAL(slot))),
+                           valueTypeStr(VALUE_TYPE(value)));
         }
 
-        pushStack(vm, BOOL_VALUE(a.as.number >= b.as.number));
-        break;
+        LOCAL(slot) = value;
+        NEXT();
       }
-      case OP_LESSER: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '<' is only implemented for numbers");
+      CASE(OP_POP_LOCALS): {
+        uint8_t count = READ_BYTE();
+        sp -= count;
+#ifdef CACHE_TOS
+        tos = *sp;
+#endif
+        NEXT();
+      }
+      CASE(OP_CHECK_TYPE): {
+        enum ValueType type = READ_BYTE();
+
+        if (VALUE_TYPE(TOP) != type) {
+          return typeError("expected type '%s' but got '%s'",
+                           valueTypeStr(type), valueTypeStr(VALUE_TYPE(TOP)));
+        }
+        NEXT();
+      }
+      CASE(OP_JUMP): {
+        size_t offset = READ_SHORT();
+        ip += offset;
+        NEXT();
+      }
+      CASE(OP_JUMP_IF_FALSE): {
+        size_t offset = READ_SHORT();
+        struct Value condition = POP();
+        if (!IS_BOOL(condition)) {
+          return typeError("expected type 'Bool' but got '%s'",
+                           valueTypeStr(VALUE_TYPE(condition)));
         }
 
-        pushStack(vm, BOOL_VALUE(a.as.number < b.as.number));
-        break;
+        if (!AS_BOOL(condition)) {
+          ip += offset;
+        }
+        NEXT();
       }
-      case OP_LESSER_EQUAL: {
-        struct Value b = popStack(vm);
-        struct Value a = popStack(vm);
-        if (a.type != VALUE_NUMBER || b.type != VALUE_NUMBER) {
-          return runtimeError("operator '<=' is only implemented for numbers");
+      CASE(OP_LOOP_IF_TRUE): {
+        size_t offset = READ_SHORT();
+        struct Value condition = POP();
+        if (!IS_BOOL(condition)) {
+          return typeError("expected type 'Bool' but got '%s'",
+                           valueTypeStr(VALUE_TYPE(condition)));
         }
 
-        pushStack(vm, BOOL_VALUE(a.as.number <= b.as.number));
-        break;
+        if (AS_BOOL(condition)) {
+          ip -= offset;
+          RESUME_JIT();
+        }
+        NEXT();
+      }
+      CASE(OP_SHORT_AND): {
+        size_t offset = READ_SHORT();
+        if (!IS_BOOL(TOP)) {
+          return typeError("operator 'and' is only defined for bools");
+        }
+
+        if (!AS_BOOL(TOP)) {
+          ip += offset;
+        }
+        NEXT();
+      }
+      CASE(OP_SHORT_OR): {
+        size_t offset = READ_SHORT();
+        if (!IS_BOOL(TOP)) {
+          return typeError("operator 'or' is only defined for bools");
+        }
+
+        if (AS_BOOL(TOP)) {
+          ip += offset;
+        }
+        NEXT();
+      }
+      CASE(OP_READ_CONST_ADD): {
+        uint8_t slot = READ_BYTE();
+        struct Value a = vm->globals[slot];
+        struct Value b = constants[READ_BYTE()];
+
+        if (IS_UNDECLARED(a)) {
+          struct String name = runningChunk->strings.strings[slot];
+          return runtimeError("unknown variable '%.*s'", name.length, name.str);
+        }
+
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          return typeError("operator '+' is only defined for numbers");
+        }
+
+        PUSH(NUMBER_VALUE(AS_NUMBER(a) + AS_NUMBER(b)));
+        NEXT();
+      }
+      CASE(OP_CONST_DECLARE): {
+        struct Value value = constants[READ_BYTE()];
+        uint8_t slot = READ_BYTE();
+        struct Value* global = &vm->globals[slot];
+        enum ValueType type = READ_BYTE();
+
+        if (!IS_UNDECLARED(*global)) {
+          struct String name = runningChunk->strings.strings[slot];
+          return runtimeError(
+              "redeclaration of previously defined variable '%.*s'",
+              name.length, name.str);
+        }
+
+        if (type != VALUE_NONE && VALUE_TYPE(value) != type) {
+          return typeError("expected type '%s' but got '%s'",
+                           valueTypeStr(type), valueTypeStr(VALUE_TYPE(value)));
+        }
+
+        *global = value;
+        RESUME_JIT();
+        NEXT();
+      }
+      CASE(OP_PRINT_POP): {
+        struct Value a = POP();
+        printValue(&a);
+        NEXT();
+      }
+      CASE(OP_NEGATE_NUM): {
+        if (!IS_NUMBER(TOP)) {
+          DEOPTIMIZE(OP_NEGATE);
+        }
+
+        TOP = NUMBER_VALUE(-AS_NUMBER(TOP));
+        NEXT();
+      }
+      CASE(OP_ADD_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_ADD);
+        }
+
+        TOP = NUMBER_VALUE(AS_NUMBER(TOP) + AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_SUBTRACT_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_SUBTRACT);
+        }
+
+        TOP = NUMBER_VALUE(AS_NUMBER(TOP) - AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_MULTIPLY_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_MULTIPLY);
+        }
+
+        TOP = NUMBER_VALUE(AS_NUMBER(TOP) * AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_DIVIDE_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_DIVIDE);
+        }
+
+        if (AS_NUMBER(b) == 0.) {
+          return runtimeError("division by zero");
+        }
+
+        TOP = NUMBER_VALUE(AS_NUMBER(TOP) / AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_EQUAL_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_EQUAL);
+        }
+
+        TOP = BOOL_VALUE(AS_NUMBER(TOP) == AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_NOT_EQUAL_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_NOT_EQUAL);
+        }
+
+        TOP = BOOL_VALUE(AS_NUMBER(TOP) != AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_GREATER_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_GREATER);
+        }
+
+        TOP = BOOL_VALUE(AS_NUMBER(TOP) > AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_GREATER_EQUAL_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_GREATER_EQUAL);
+        }
+
+        TOP = BOOL_VALUE(AS_NUMBER(TOP) >= AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_LESSER_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_LESSER);
+        }
+
+        TOP = BOOL_VALUE(AS_NUMBER(TOP) < AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_LESSER_EQUAL_NUM_NUM): {
+        struct Value b = POP();
+        if (!IS_NUMBER(TOP) || !IS_NUMBER(b)) {
+          PUSH(b);
+          DEOPTIMIZE(OP_LESSER_EQUAL);
+        }
+
+        TOP = BOOL_VALUE(AS_NUMBER(TOP) <= AS_NUMBER(b));
+        NEXT();
+      }
+      CASE(OP_CALL): {
+        size_t argc = READ_BYTE();
+        struct Value callee = PEEK(argc);
+        if (checkCall(callee, argc) != RUN_OK) {
+          return RUN_ERROR;
+        }
+        if (vm->frameCount == FRAMES_MAX ||
+            !hasRoom(vm, sp - argc, &AS_FUNCTION(callee)->chunk)) {
+          return runtimeError("stack overflow");
+        }
+
+        frame->ip = ip;
+        frame = &vm->frames[vm->frameCount++];
+        frame->function = AS_FUNCTION(callee);
+        frame->chunk = &frame->function->chunk;
+        frame->slots = sp - argc;
+
+        ip = frame->chunk->code;
+        constants = frame->chunk->values.values;
+        RESUME_JIT();
+        NEXT();
+      }
+      CASE(OP_TAIL_CALL): {
+        size_t argc = READ_BYTE();
+        struct Value callee = PEEK(argc);
+        if (checkCall(callee, argc) != RUN_OK) {
+          return RUN_ERROR;
+        }
+        if (!hasRoom(vm, frame->slots, &AS_FUNCTION(callee)->chunk)) {
+          return runtimeError("stack overflow");
+        }
+
+        // the callee and its arguments replace the running frame, so a loop
+        // written as tail recursion runs in constant stack space
+#ifdef CACHE_TOS
+        *sp = tos;
+        memmove(frame->slots, sp - argc, (argc + 1) * sizeof(struct Value));
+        sp = frame->slots + argc;
+        tos = *sp;
+#else
+        memmove(frame->slots - 1, sp - argc - 1,
+                (argc + 1) * sizeof(struct Value));
+        sp = frame->slots + argc;
+#endif
+        frame->function = AS_FUNCTION(callee);
+        frame->chunk = &frame->function->chunk;
+
+        ip = frame->chunk->code;
+        constants = frame->chunk->values.values;
+        RESUME_JIT();
+        NEXT();
+      }
+      CASE(OP_RETURN): {
+        if (vm->frameCount == 1) {
+          vm->frameCount = 0;
+          vm->stackTop = sp;
+#ifdef PROFILE
+          profileLeave();
+#endif
+          return RUN_OK; // stop running
+        }
+
+        // the result replaces the callee below the frame's locals
+        struct Value result = POP();
+        struct Value* slots = frame->slots;
+        frame = &vm->frames[--vm->frameCount - 1];
+
+        ip = frame->ip;
+        constants = frame->chunk->values.values;
+        sp = slots;
+#ifdef CACHE_TOS
+        tos = result;
+#else
+        sp[-1] = result;
+#endif
+        RESUME_JIT();
+        NEXT();
       }
-      case OP_RETURN:
-        return RUN_OK; // stop running
       default:
-        return runtimeError("unknown opcode %d", *(vm->ip - 1));
+        return runtimeError("unknown opcode %d", *(ip - 1));
     }
   }
+
+#undef READ_BYTE
+#undef READ_LONG
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TOP
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef LOCAL
+#undef FRAME_CODE
+#undef RESUME_JIT
+#undef CASE
+#undef NEXT
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
 }
@@ -1,19 +1,48 @@
 #pragma once
 
 #include "chunk.h"
-#include "map.h"
+#include "memory.h"
 #include "value.h"
 
 #include <inttypes.h>
+#include <stdbool.h>
 
-#define STACK_MAX 256
+#define FRAMES_MAX 256
+// values all frames hold together, a call whose frame could grow past it is a
+// stack overflow
+#define STACK_MAX (FRAMES_MAX * 256)
+
+// a running function, or the chunk passed to runVM at the bottom
+struct CallFrame {
+  struct Function* function; // NULL at the bottom
+  struct Chunk* chunk;
+  uint8_t* ip;         // where it continues, only saved while it calls
+  struct Value* slots; // its locals, the called value sits right below them
+};
 
 struct VM {
-  uint8_t* ip;
-  struct Value stack[STACK_MAX];
+  // what the stack and the globals below come from
+  struct Allocator* allocator;
+
+  struct CallFrame frames[FRAMES_MAX];
+  size_t frameCount;
+
+  // STACK_MAX values from the allocator, too large for the C stack that the
+  // vm itself is usually kept on
+  struct Value* stack;
   struct Value* stackTop;
 
-  struct Map variables;
+  // run instructions in native code where the jit can, or in the code loaded
+  // ahead of time for chunks that have it. set after initVM
+  bool jit;
+
+  // values the compiler saved to reuse within a statement
+  struct Value temps[MAX_TEMPS];
+
+  // global variables indexed by the slots the compiler resolved, undeclared
+  // ones hold UNDECLARED_VALUE
+  struct Value* globals;
+  size_t globalsSize;
 };
 
 enum RunResult {
@@ -21,6 +50,11 @@ enum RunResult {
   RUN_ERROR,
 };
 
-void initVM(struct VM* vm);
+void initVM(struct VM* vm, struct Allocator* allocator);
 void deinitVM(struct VM* vm);
+// quickening rewrites the code of the chunk and of the functions it calls
+// while they run, which is safe to run again since a rewritten instruction
+// falls back to the generic one. a compiled chunk and its functions must only
+// run on one thread at a time, vms on other threads need their own
+// compilation
 enum RunResult runVM(struct VM* vm, struct Chunk* chunk);